@@ -0,0 +1,634 @@
+/* Copyright (C) 2012 Christian Lutz, Thorsten Engesser
+ *
+ * This file is part of motld
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+This example runs MultiObjectTLD on one or more image sequences (same format as for the
+batchExample) with different configurations and prints runtime and detector statistics.
+All images are loaded into memory first, so file operations are not measured.
+The boxes of the first configuration serve as reference for the column "overlap", "evicted" is the
+number of NN patches removed because of MOTLDSettings::nnMaxPositives and nnMaxNegatives, "cache"
+the fraction of detector windows whose NN similarities were reused (MOTLDSettings::nnCacheTolerance)
+"dropped" the number of detections per frame not verified because of MOTLDSettings::nnVerifyBudget
+and "iters" the average number of iterations of the tracker per point (summed over the pyramid
+levels, see LKSettings::epsilon).
+Afterwards the default configuration is run with 1, 2, 4, 8 and 16 OpenMP threads to measure
+the scaling of the detector (FernFilter::scanPatch()); here the single thread run is the reference.
+Finally the density of the scan grid (MOTLDSettings::scanStride, scanRefine) is varied. The column
+"recall" is the fraction of frames with a valid box in the dense run (stride 0) for which the
+configuration reports a valid box overlapping the dense one by more than 0.5.
+The last section measures the nearest neighbor classifier on its own: a growing number of negative
+patches (random windows of the sequence) is learned ("learned" patches out of 1000, 4000, 16000,
+"learn" time) comparing all patches ("exact") or using the cluster index (MOTLDSettings::nnIndexMin)
+with an exact search and with at most 8 and 32 visited clusters, or storing the patches as 8 bit
+integers (MOTLDSettings::nnStore, "int8"). Then getConf() is timed for further random windows
+against the patches learned without index ("patches"). "recall" is the fraction of queries whose
+confidence equals the one of the exact comparison, "maxerr" the largest difference to it, "bytes"
+the memory of a patch (normalized patch plus the pixels kept with NN_STORE_FLOAT, see
+NNClassifier::getTemplateMemory()).
+Finally the Lucas-Kanade tracker runs alone on the sequence, starting from the initial boxes (which
+are restored whenever an object is lost), with the original kernel (LK_KERNEL_REFERENCE), with
+precomputed template windows (LK_KERNEL_WINDOW, see LKTracker::setKernel()) and additionally with
+early termination (LKSettings::epsilon = 0.01). All track the boxes found by the reference kernel in
+each frame, so they start from identical points; "diff" and "maxdiff" are the mean and largest
+difference of the box coordinates to the reference (in pixels), "disagree" the number of boxes only
+one of both lost.
+"allocs" is the number of heap allocations per frame after the first two frames, counted by the
+replaced global operator new. Any allocation there is reported as an error and makes the program
+return 1.
+*/
+
+#include <iostream>
+#include <fstream>
+#include <cstdlib>
+#include <cstdio>
+#include <string>
+#include <vector>
+#include <new>
+#ifdef _MSC_VER
+  #include "dirent.h"
+#else
+  #include <dirent.h>
+#endif
+#ifdef _OPENMP
+  #include <omp.h>
+#endif
+
+#include "motld/MultiObjectTLD.h"
+#include "motld/Utils.h"
+
+#define DEFAULT_INPUT_1 "input/motocross"
+#define DEFAULT_INPUT_2 "input/carchase"
+
+// the replacements are not inlined, otherwise GCC sees free() on pointers returned by operator new
+#ifdef __GNUC__
+  #define BENCH_NOINLINE __attribute__((noinline))
+#else
+  #define BENCH_NOINLINE
+#endif
+
+/// number of calls of the global operator new (see benchmarkLKTracker())
+long long gAllocations = 0;
+
+/// allocates @c size bytes with malloc() and counts the allocation (see gAllocations)
+BENCH_NOINLINE void* countedAllocation(size_t size)
+{
+  #pragma omp atomic
+  gAllocations++;
+  void * ptr = malloc(size == 0 ? 1 : size);
+  if (ptr == NULL)
+    throw std::bad_alloc();
+  return ptr;
+}
+
+BENCH_NOINLINE void* operator new(size_t size)
+{
+  return countedAllocation(size);
+}
+
+BENCH_NOINLINE void* operator new[](size_t size)
+{
+  return countedAllocation(size);
+}
+
+BENCH_NOINLINE void operator delete(void * ptr) throw()
+{
+  free(ptr);
+}
+
+BENCH_NOINLINE void operator delete[](void * ptr) throw()
+{
+  free(ptr);
+}
+
+BENCH_NOINLINE void operator delete(void * ptr, size_t) throw()
+{
+  free(ptr);
+}
+
+BENCH_NOINLINE void operator delete[](void * ptr, size_t) throw()
+{
+  free(ptr);
+}
+
+/// an image sequence held in memory
+struct Sequence
+{
+  std::string name;
+  int width, height;
+  bool gray;
+  std::vector<unsigned char*> frames;
+  std::vector<ObjectBox> boxes;
+};
+
+/// a named configuration to be benchmarked
+struct Configuration
+{
+  std::string name;
+  MOTLDSettings settings;
+};
+
+int pgm_select(const struct dirent *entry)
+{
+  return strstr(entry->d_name, ".pgm") != NULL;
+}
+
+int ppm_select(const struct dirent *entry)
+{
+  return strstr(entry->d_name, ".ppm") != NULL;
+}
+
+bool loadSequence(const std::string & folder, Sequence & seq)
+{
+  struct dirent **filelist;
+  seq.name = folder;
+  seq.gray = false;
+  int fcount = scandir(folder.c_str(), &filelist, ppm_select, alphasort);
+  if (fcount <= 0)
+  {
+    fcount = scandir(folder.c_str(), &filelist, pgm_select, alphasort);
+    seq.gray = true;
+  }
+  if (fcount <= 0)
+  {
+    std::cout << "There are no .ppm or .pgm files in " << folder << std::endl;
+    return false;
+  }
+  char filename[255];
+  sprintf(filename, "%s/init.txt", folder.c_str());
+  std::ifstream aStream(filename);
+  if(!aStream || aStream.eof())
+  {
+    std::cout << "please create the file \"" << filename
+        << "\" specifying the initial bounding box[es] (x1,y1,x2,y2)" << std::endl;
+    return false;
+  }
+  int x1, y1, x2, y2, imgid;
+  char c;
+  while(aStream >> x1 >> c >> y1 >> c >> x2 >> c >> y2)
+  {
+    imgid = 0;
+    if (aStream.peek() == ',')
+      aStream >> c >> imgid;
+    ObjectBox b = {(float)x1,(float)y1,(float)(x2-x1),(float)(y2-y1),imgid};
+    seq.boxes.push_back(b);
+  }
+  for (int i = 0; i < fcount; ++i)
+  {
+    sprintf(filename, "%s/%s", folder.c_str(), filelist[i]->d_name);
+    int z;
+    seq.frames.push_back(seq.gray ? readFromPGM<unsigned char>(filename, seq.width, seq.height) :
+                                    readFromPPM<unsigned char>(filename, seq.width, seq.height, z));
+    free(filelist[i]);
+  }
+  free(filelist);
+  return true;
+}
+
+/// returns the NN patch of a random window of a random frame of the sequence
+NNPatch randomPatch(const Sequence & seq, RandomGenerator & random)
+{
+  unsigned char * frame = seq.frames[random.randInt(0, seq.frames.size() - 1)];
+  Matrix image(seq.width, seq.height);
+  if (seq.gray)
+    image.copyFromCharArray(frame);
+  else
+    image.fromRGB(frame);
+  float width = random.randInt(24, MIN(80, seq.width - 1));
+  float height = random.randInt(24, MIN(80, seq.height - 1));
+  ObjectBox box = {(float)random.randInt(0, seq.width - width - 1), (float)random.randInt(0, seq.height - height - 1),
+                   width, height, 0};
+  return NNPatch(box, image, 15);
+}
+
+/// times learning and evaluation of the nearest neighbor classifier with and without cluster index
+/// and with 8 bit patches
+void benchmarkNNIndex(const Sequence & seq)
+{
+  const int templateCounts[3] = {1000, 4000, 16000};
+  const int nQueries = 500;
+  const char * modeNames[5] = {"exact", "index", "probe8", "probe32", "int8"};
+  const int indexProbes[5] = {0, 0, 8, 32, 0};
+  std::cout << "patches\tmode\tlearned\tlearn\tconf\trecall\tmaxerr\tbytes"
+            << "\t(learn: ms per patch, conf: microseconds per query, bytes per patch)" << std::endl;
+  for (int n = 0; n < 3; ++n)
+  {
+    RandomGenerator random(n + 1);
+    std::vector<NNPatch> patches, queries;
+    for (int i = 0; i < templateCounts[n]; ++i)
+      patches.push_back(randomPatch(seq, random));
+    for (int i = 0; i < nQueries; ++i)
+      queries.push_back(randomPatch(seq, random));
+    NNClassifier reference(seq.width, seq.height, 15, false);
+    std::vector<double> exact(nQueries);
+    for (int m = 0; m < 5; ++m)
+    {
+      // learning with the index or storage of this mode
+      NNClassifier nn(seq.width, seq.height, 15, false);
+      if (m == 4)
+        nn.setStore(NN_STORE_INT8);
+      else if (m > 0)
+        nn.setIndex(256, indexProbes[m]);
+      nn.addObject(patches[0]);
+      int tStart = getTime();
+      for (int i = 1; i < templateCounts[n]; ++i)
+        nn.trainNN(patches[i], 0, false);
+      int learnTime = getTime() - tStart;
+      // queries against the patches learned without index
+      if (m == 0)
+        reference = nn;
+      NNClassifier indexed = reference;
+      if (m == 4)
+        indexed.setStore(NN_STORE_INT8);
+      else if (m > 0)
+        indexed.setIndex(256, indexProbes[m]);
+      long long tConf = getTimeMicro();
+      int nFound = 0;
+      double maxError = 0;
+      for (int i = 0; i < nQueries; ++i)
+      {
+        double conf = indexed.getConf(queries[i], 0, false);
+        if (m == 0)
+          exact[i] = conf;
+        nFound += fabs(conf - exact[i]) < 1e-6;
+        maxError = MAX(maxError, fabs(conf - exact[i]));
+      }
+      tConf = getTimeMicro() - tConf;
+      std::cout << reference.getNegPatches()->size() << "\t" << modeNames[m] << "\t"
+                << nn.getNegPatches()->size() << "\t" << (float)learnTime / templateCounts[n] << "\t"
+                << (float)tConf / nQueries << "\t" << (float)nFound / nQueries << "\t" << maxError << "\t"
+                << indexed.getTemplateMemory() / (1 + reference.getNegPatches()->size()) << std::endl;
+    }
+  }
+}
+
+///@brief times the Lucas-Kanade tracker on its own with different kernels and settings and counts its heap
+/// allocations; returns false (after printing an error) if a tracker allocated after the first two frames
+bool benchmarkLKTracker(const Sequence & seq)
+{
+  std::vector<Matrix> images(seq.frames.size());
+  for (unsigned int i = 0; i < seq.frames.size(); ++i)
+  {
+    images[i].setSize(seq.width, seq.height);
+    if (seq.gray)
+      images[i].copyFromCharArray(seq.frames[i]);
+    else
+      images[i].fromRGB(seq.frames[i]);
+  }
+  std::vector<ObjectBox> initial;
+  for (unsigned int i = 0; i < seq.boxes.size(); ++i)
+    if (seq.boxes[i].objectId == 0)
+      initial.push_back(seq.boxes[i]);
+  if (initial.empty() || images.size() < 3)
+    return true;
+  // all trackers track the same boxes in each frame (the results of the reference kernel)
+  const int nTrackers = 3;
+  const char * trackerNames[nTrackers] = {"reference", "window", "epsilon"};
+  std::vector<LKTracker> trackers;
+  for (int k = 0; k < nTrackers; ++k)
+  {
+    LKSettings settings;
+    settings.kernel = k == 0 ? LK_KERNEL_REFERENCE : LK_KERNEL_WINDOW;
+    settings.epsilon = k == 2 ? 0.01 : 0;
+    trackers.push_back(LKTracker(seq.width, seq.height, settings));
+  }
+  std::vector<ObjectBox> boxes[nTrackers];
+  std::vector<bool> isDefined[nTrackers];
+  long long time[nTrackers], allocations[nTrackers];
+  int nLost[nTrackers], nDisagree[nTrackers], nCompared[nTrackers];
+  float maxDiff[nTrackers], sumDiff[nTrackers];
+  for (int k = 0; k < nTrackers; ++k)
+  {
+    trackers[k].initFirstFrame(images[0]);
+    boxes[k] = initial;
+    isDefined[k] = std::vector<bool>(initial.size(), true);
+    time[k] = allocations[k] = 0;
+    nLost[k] = nDisagree[k] = nCompared[k] = 0;
+    maxDiff[k] = sumDiff[k] = 0;
+  }
+  for (unsigned int i = 1; i < images.size(); ++i)
+  {
+    for (int k = 0; k < nTrackers; ++k)
+    {
+      long long before = gAllocations;
+      long long tStart = getTimeMicro();
+      trackers[k].processFrame(images[i], boxes[k], isDefined[k]);
+      time[k] += getTimeMicro() - tStart;
+      if (i >= 2)
+        allocations[k] += gAllocations - before;
+    }
+    for (unsigned int b = 0; b < initial.size(); ++b)
+    {
+      for (int k = 1; k < nTrackers; ++k)
+      {
+        if (isDefined[0][b] && isDefined[k][b])
+        {
+          float diff = MAX(MAX(fabs(boxes[k][b].x - boxes[0][b].x), fabs(boxes[k][b].y - boxes[0][b].y)),
+                           MAX(fabs(boxes[k][b].width - boxes[0][b].width), fabs(boxes[k][b].height - boxes[0][b].height)));
+          maxDiff[k] = MAX(maxDiff[k], diff);
+          sumDiff[k] += diff;
+          nCompared[k]++;
+        }
+        nDisagree[k] += isDefined[0][b] != isDefined[k][b];
+      }
+      // restore lost boxes, copying only the coordinates (copying the path would allocate)
+      const ObjectBox & next = isDefined[0][b] ? boxes[0][b] : initial[b];
+      for (int k = nTrackers - 1; k >= 0; --k)
+      {
+        nLost[k] += !isDefined[k][b];
+        boxes[k][b].x = next.x;
+        boxes[k][b].y = next.y;
+        boxes[k][b].width = next.width;
+        boxes[k][b].height = next.height;
+        isDefined[k][b] = true;
+      }
+    }
+  }
+  std::cout << "tracker\ttime\tlost\tallocs\titers\tdiff\tmaxdiff\tdisagree\t(time in ms per frame)" << std::endl;
+  for (int k = 0; k < nTrackers; ++k)
+  {
+    long long iterations, points;
+    trackers[k].getIterationStats(iterations, points);
+    std::cout << trackerNames[k] << "\t" << time[k] / 1000. / (images.size() - 1) << "\t" << nLost[k] << "\t"
+              << (float)allocations[k] / (images.size() - 2) << "\t" << (float)iterations / MAX(1, points) << "\t"
+              << sumDiff[k] / MAX(1, nCompared[k]) << "\t" << maxDiff[k] << "\t" << nDisagree[k] << std::endl;
+  }
+  bool allocationFree = true;
+  for (int k = 0; k < nTrackers; ++k)
+  {
+    if (allocations[k] > 0)
+    {
+      std::cerr << "Error: tracker " << trackerNames[k] << " allocated " << allocations[k]
+                << " times after the first two frames!" << std::endl;
+      allocationFree = false;
+    }
+  }
+  return allocationFree;
+}
+
+/// processes the whole sequence and returns the runtime in milliseconds
+int runSequence(const Sequence & seq, const MOTLDSettings & settings,
+                std::vector<ObjectBox> & result, std::vector<bool> & valid, FernScanStats & stats,
+                int * evicted = NULL, float * cacheHits = NULL, float * dropped = NULL,
+                float * iterations = NULL)
+{
+  MultiObjectTLD p(seq.width, seq.height, settings);
+  std::vector<ObjectBox>::const_iterator boxIt = seq.boxes.begin();
+  int tStart = getTime();
+  for (unsigned int i = 0; i < seq.frames.size(); ++i)
+  {
+    p.processFrame(seq.frames[i]);
+    std::vector<ObjectBox> addBoxes;
+    while(boxIt != seq.boxes.end() && boxIt->objectId == (int)i)
+      addBoxes.push_back(*boxIt++);
+    if (addBoxes.size() > 0)
+      p.addObjects(addBoxes);
+    result.push_back(p.getObjectBox());
+    valid.push_back(p.getValid());
+  }
+  stats = p.getDetectorStats();
+  if (evicted != NULL)
+  {
+    int positives, negatives;
+    p.getNNEvictions(positives, negatives);
+    *evicted = positives + negatives;
+  }
+  if (cacheHits != NULL)
+  {
+    long long hits, misses;
+    p.getNNCacheStats(hits, misses);
+    *cacheHits = (float)hits / MAX(1, hits + misses);
+  }
+  if (dropped != NULL)
+  {
+    long long verified, droppedDetections;
+    p.getNNBudgetStats(verified, droppedDetections);
+    *dropped = (float)droppedDetections / MAX(1, seq.frames.size());
+  }
+  if (iterations != NULL)
+  {
+    long long lkIterations, points;
+    p.getLKStats(lkIterations, points);
+    *iterations = (float)lkIterations / MAX(1, points);
+  }
+  return getTime() - tStart;
+}
+
+int main(int argc, char *argv[])
+{
+  std::vector<std::string> folders;
+  for (int i = 1; i < argc; ++i)
+    folders.push_back(argv[i]);
+  if (folders.empty())
+  {
+    folders.push_back(DEFAULT_INPUT_1);
+    folders.push_back(DEFAULT_INPUT_2);
+  }
+  int result = 0;
+
+  std::vector<Configuration> configurations;
+  Configuration conf;
+  conf.name = "map";
+  conf.settings.fernStore = FERN_STORE_MAP;
+  conf.settings.satMode = FERN_SAT_FLOAT;
+  configurations.push_back(conf);
+  conf.name = "hash";
+  conf.settings = MOTLDSettings();
+  conf.settings.fernStore = FERN_STORE_HASH;
+  conf.settings.satMode = FERN_SAT_FLOAT;
+  configurations.push_back(conf);
+  conf.name = "intsat";
+  conf.settings = MOTLDSettings();
+  configurations.push_back(conf);
+  conf.name = "integral";
+  conf.settings.scanMode = FERN_SCAN_INTEGRAL;
+  configurations.push_back(conf);
+  conf.name = "roi";
+  conf.settings = MOTLDSettings();
+  conf.settings.fullScanInterval = 10;
+  configurations.push_back(conf);
+  conf.name = "budget";
+  conf.settings.detectorBudget = 5;
+  configurations.push_back(conf);
+  conf.name = "scales";
+  conf.settings = MOTLDSettings();
+  conf.settings.scaleMargin = 2;
+  configurations.push_back(conf);
+  conf.name = "nncap";
+  conf.settings = MOTLDSettings();
+  conf.settings.nnMaxPositives = 10;
+  conf.settings.nnMaxNegatives = 20;
+  configurations.push_back(conf);
+  conf.name = "nncache";
+  conf.settings = MOTLDSettings();
+  conf.settings.nnCacheTolerance = 0.5;
+  configurations.push_back(conf);
+  conf.name = "nnbudget";
+  conf.settings = MOTLDSettings();
+  conf.settings.nnVerifyBudget = 5;
+  configurations.push_back(conf);
+  conf.name = "lkeps";
+  conf.settings = MOTLDSettings();
+  conf.settings.lkSettings.epsilon = 0.01;
+  configurations.push_back(conf);
+
+  const char * stepNames[4] = {"scale", "cascade", "fine", "patch"};
+  const int threadCounts[5] = {1, 2, 4, 8, 16};
+  const float strides[4] = {0, 0.1f, 0.2f, 0.3f};
+
+  for (unsigned int f = 0; f < folders.size(); ++f)
+  {
+    Sequence seq;
+    if (!loadSequence(folders[f], seq))
+      continue;
+    std::cout << seq.name << ": " << seq.frames.size() << " frames, "
+              << seq.width << "x" << seq.height << std::endl;
+    std::cout << "config\ttotal\tvalid\toverlap\tscanned\tvariance\tferns\tcoarse\tdetect";
+    for (int s = 0; s < 4; ++s)
+      std::cout << "\t" << stepNames[s];
+    std::cout << "\tevicted\tcache\tdropped\titers\t(times in ms per frame)" << std::endl;
+
+    std::vector<ObjectBox> reference;
+    std::vector<bool> referenceValid;
+    for (unsigned int c = 0; c < configurations.size(); ++c)
+    {
+      MOTLDSettings settings = configurations[c].settings;
+      settings.colorMode = seq.gray ? COLOR_MODE_GRAY : COLOR_MODE_RGB;
+      std::vector<ObjectBox> boxes;
+      std::vector<bool> valid;
+      FernScanStats stats;
+      int evicted;
+      float cacheHits, dropped, iterations;
+      int time = runSequence(seq, settings, boxes, valid, stats, &evicted, &cacheHits, &dropped, &iterations);
+      if (c == 0)
+      {
+        reference = boxes;
+        referenceValid = valid;
+      }
+      int nValid = 0, nCompared = 0;
+      float overlap = 0;
+      for (unsigned int i = 0; i < boxes.size(); ++i)
+      {
+        nValid += valid[i];
+        if (valid[i] && referenceValid[i])
+        {
+          overlap += rectangleOverlap(boxes[i], reference[i]);
+          nCompared++;
+        }
+      }
+      float nFrames = MAX(1, stats.frames);
+      std::cout << configurations[c].name << "\t" << (float)time / seq.frames.size() << "\t"
+                << nValid << "\t" << (nCompared ? overlap / nCompared : 0) << "\t"
+                << stats.scannedWindows / nFrames << "\t" << stats.varianceWindows / nFrames << "\t"
+                << (float)stats.evaluatedFerns / MAX(1, stats.varianceWindows) << "\t"
+                << stats.coarseWindows / nFrames << "\t"
+                << stats.detections / nFrames;
+      for (int s = 0; s < 4; ++s)
+        std::cout << "\t" << stats.time[s] / 1000. / nFrames;
+      std::cout << "\t" << evicted << "\t" << cacheHits << "\t" << dropped << "\t" << iterations << std::endl;
+    }
+
+#ifdef _OPENMP
+    std::cout << "threads\ttotal\tvalid\toverlap\tdetect\tspeedup\t(detector time in ms per frame)" << std::endl;
+    float detectorTime1 = 0;
+    const int maxThreads = omp_get_max_threads();
+    for (int t = 0; t < 5; ++t)
+    {
+      omp_set_num_threads(threadCounts[t]);
+      MOTLDSettings settings;
+      settings.colorMode = seq.gray ? COLOR_MODE_GRAY : COLOR_MODE_RGB;
+      std::vector<ObjectBox> boxes;
+      std::vector<bool> valid;
+      FernScanStats stats;
+      int time = runSequence(seq, settings, boxes, valid, stats);
+      if (t == 0)
+      {
+        reference = boxes;
+        referenceValid = valid;
+      }
+      int nValid = 0, nCompared = 0;
+      float overlap = 0;
+      for (unsigned int i = 0; i < boxes.size(); ++i)
+      {
+        nValid += valid[i];
+        if (valid[i] && referenceValid[i])
+        {
+          overlap += rectangleOverlap(boxes[i], reference[i]);
+          nCompared++;
+        }
+      }
+      float detectorTime = 0;
+      for (int s = 0; s < 4; ++s)
+        detectorTime += stats.time[s] / 1000. / MAX(1, stats.frames);
+      if (t == 0)
+        detectorTime1 = detectorTime;
+      std::cout << threadCounts[t] << "\t" << (float)time / seq.frames.size() << "\t" << nValid << "\t"
+                << (nCompared ? overlap / nCompared : 0) << "\t" << detectorTime << "\t"
+                << detectorTime1 / detectorTime << std::endl;
+    }
+    omp_set_num_threads(maxThreads);
+#endif
+
+    std::cout << "stride	refine	total	valid	recall	scanned	detect	detector"
+              << "	(times in ms per frame)" << std::endl;
+    for (int r = 0; r < 8; ++r)
+    {
+      MOTLDSettings settings;
+      settings.colorMode = seq.gray ? COLOR_MODE_GRAY : COLOR_MODE_RGB;
+      settings.scanStride = strides[r / 2];
+      settings.scanRefine = r % 2 == 1;
+      if (settings.scanStride == 0 && settings.scanRefine)
+        continue;
+      std::vector<ObjectBox> boxes;
+      std::vector<bool> valid;
+      FernScanStats stats;
+      int time = runSequence(seq, settings, boxes, valid, stats);
+      if (r == 0)
+      {
+        reference = boxes;
+        referenceValid = valid;
+      }
+      int nValid = 0, nReference = 0, nFound = 0;
+      for (unsigned int i = 0; i < boxes.size(); ++i)
+      {
+        nValid += valid[i];
+        if (referenceValid[i])
+        {
+          nReference++;
+          nFound += valid[i] && rectangleOverlap(boxes[i], reference[i]) > 0.5;
+        }
+      }
+      float nFrames = MAX(1, stats.frames);
+      float detectorTime = 0;
+      for (int s = 0; s < 4; ++s)
+        detectorTime += stats.time[s] / 1000. / nFrames;
+      std::cout << settings.scanStride << "\t" << settings.scanRefine << "\t"
+                << (float)time / seq.frames.size() << "\t" << nValid << "\t"
+                << (float)nFound / MAX(1, nReference) << "\t" << stats.scannedWindows / nFrames << "\t"
+                << stats.detections / nFrames << "\t" << detectorTime << std::endl;
+    }
+
+    benchmarkNNIndex(seq);
+    if (!benchmarkLKTracker(seq))
+      result = 1;
+
+    for (unsigned int i = 0; i < seq.frames.size(); ++i)
+      delete[] seq.frames[i];
+  }
+
+  return result;
+}
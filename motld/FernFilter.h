@@ -36,6 +36,7 @@
 
 #include "Matrix.h"
 #include "Utils.h"
+#include "FernHashTable.h"
 
 #define USEMAP 1       // Default: 1 - 0 = use lookup table instead: experimental
 #define USETBBP 1      // Default: 1 - 0 = use simple pixel comparison: experimental
@@ -43,6 +44,29 @@
 
 #define TIMING 0
 
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+/// number of consecutive windows processed at once by FernFilter::extractFeatureBatch()
+#define FERNBATCHSIZE 8
+/// size (log2 of the number of bits) of the per fern bitset marking leaves seen as positive
+#define FERNPOSITIVEBITS 16
+
+/// defines concerning the fern posterior store (see MOTLDSettings::fernStore)
+#define FERN_STORE_MAP 0
+#define FERN_STORE_HASH 1
+
+/// defines concerning the summed area tables used for scanning (see MOTLDSettings::satMode)
+#define FERN_SAT_FLOAT 0
+#define FERN_SAT_INTEGER 1
+
+/// defines concerning the way the scales are scanned (see MOTLDSettings::scanMode)
+#define FERN_SCAN_PYRAMID 0
+#define FERN_SCAN_INTEGRAL 1
+
 // some settings - don't change these!
 #define CONFIDENCETHRESHOLD             0.7
 #define POSOVERLAPTHRESHOLD             0.85
@@ -71,10 +95,38 @@ struct WarpSettings
   float scale;
 };
 
+/// performance counters accumulated by FernFilter::scanPatch() (times in microseconds)
+struct FernScanStats
+{
+  /// number of scanned frames
+  int frames;
+  /// number of scanned windows
+  long long scannedWindows;
+  /// number of windows passing the variance filter
+  long long varianceWindows;
+  /// number of windows passing the coarse fern filter
+  long long coarseWindows;
+  /// number of detections (windows passing the fine fern filter of at least one object)
+  long long detections;
+  /// number of ferns evaluated by the coarse filter (all windows passing the variance filter)
+  long long evaluatedFerns;
+  /// accumulated time of each step: scaled images, cascade (variance, features, coarse), fine, patches
+  long long time[4];
+};
+
+/// a region of the frame to be scanned at a range of scales (see FernFilter::changeScanRegions())
+struct FernScanRegion
+{
+  /// the region in image coordinates, windows lying completely inside are scanned
+  float x, y, width, height;
+  /// the scales scanned are scaleBegin, ..., scaleEnd - 1 (see FernFilter::getNumScales())
+  int scaleBegin, scaleEnd;
+};
+
 /// describes a detection by the FernFilter
 struct FernDetection
 {
-  /// the object box (location, dimension, object id)
+  /// the object box (location, dimension, id of the first object in @c objects)
   ObjectBox box;
   /// patch as downscaled, squared image
   Matrix patch;
@@ -85,6 +137,14 @@ struct FernDetection
   // temporary values
   const void * ss;     // pointer to scan parameters used for this detection
   float * imageOffset; // pointer to image / sat position required to compute featureData
+  /// objects whose fine filter the window passed (bit o % 32 of word o / 32 is set for object o)
+  std::vector<unsigned int> objects;
+  /// fern confidence of each object (in the windows returned by FernFilter::scanPatch())
+  std::vector<float> objectConfidences;
+  /// fern confidence of the object box.objectId
+  float objectConfidence;
+  /// returns true if the window passed the fine filter of object @c o
+  bool hasObject(const int & o) const { return o / 32 < (int)objects.size() && (objects[o / 32] >> (o % 32) & 1); }
   /// ordering over FernDetections (using their confidence values)
   static bool fdBetter(FernDetection fd1, FernDetection fd2) { return fd1.confidence > fd2.confidence; }
 };
@@ -96,19 +156,23 @@ public:
   /// public constructor
   FernFilter(const int & width, const int & height, const int & numFerns,
              const int & featuresPerFern, const int & patchSize = 15,
-             const int & scaleMin = -10, const int & scaleMax = 11, const int & bbMin = 24);
+             const int & scaleMin = -10, const int & scaleMax = 11, const int & bbMin = 24,
+             const int & fernStore = FERN_STORE_HASH, const unsigned int & seed = 1);
   /// copy constructor
   FernFilter(const FernFilter & other);
   /// destructor
   ~FernFilter();
-  /// introduces new objects from a list of object boxes and returns negative training examples
-  const std::vector<Matrix> addObjects(const Matrix & image, const std::vector<ObjectBox>& boxes);
+  ///@brief introduces new objects from a list of object boxes and returns negative training examples.
+  /// @c groups assigns every box to an aspect ratio group (see getNumGroups()), a new group has
+  /// to be numbered getNumGroups() and gets a scan grid of its own box size (default: all group 0)
+  const std::vector<Matrix> addObjects(const Matrix & image, const std::vector<ObjectBox>& boxes,
+                                       const std::vector<int> & groups = std::vector<int>());
   /// scans fern structure for possible object matches using a sliding window approach
   const std::vector<FernDetection> scanPatch(const Matrix & image) const;
   /// updates the fern structure with information about the correct boxes
   const std::vector< Matrix > learn(const Matrix& image, const std::vector< ObjectBox >& boxes, bool onlyVariance = false);
   /// creates a FernFilter from binary stream (load procedure)
-  static FernFilter loadFromStream(std::ifstream & inputStream);
+  static FernFilter loadFromStream(std::ifstream & inputStream, const int & fernStore = FERN_STORE_HASH);
   /// writes FernFilter into binary stream (save procedure)
   void saveToStream(std::ofstream & outputStream) const;
   /// changes input image dimensions (has to be applied with applyPreferences())
@@ -121,43 +185,127 @@ public:
   void applyPreferences();
   /// changes settings for warping
   void changeWarpSettings(const WarpSettings & initSettings, const WarpSettings & updateSettings);
+  /// restarts the random number generator used for warping with the given seed
+  void changeSeed(const unsigned int & seed) { ivRandom.setSeed(seed); }
+  /// selects the type of summed area tables (FERN_SAT_INTEGER or FERN_SAT_FLOAT)
+  void changeSATMode(const int & satMode) { ivSATMode = satMode; }
+  /// selects how the scales are scanned (FERN_SCAN_PYRAMID or FERN_SCAN_INTEGRAL)
+  void changeScanMode(const int & scanMode) { ivScanMode = scanMode; }
+  /// returns the performance counters accumulated since the last resetScanStats()
+  const FernScanStats & getScanStats() const { return ivScanStats; }
+  /// resets the performance counters
+  void resetScanStats() { memset(&ivScanStats, 0, sizeof(FernScanStats)); }
+  ///@brief sets the distance of neighboring windows as a fraction of the window size (0 = every
+  /// position). If @c refine is set, the neighborhoods of windows passing the coarse filter are
+  /// scanned densely afterwards (at the same and the adjacent scales).
+  void changeScanStride(const float & stride, const bool & refine)
+  {
+    ivScanStride = MAX(1, (int)round(stride * ivPatchSize));
+    ivScanRefine = refine && ivScanStride > 1;
+  }
+  /// restricts the following scans to the given regions (an empty list means the whole frame)
+  void changeScanRegions(const std::vector<FernScanRegion> & regions) { ivScanRegions = regions; }
+  /// returns the number of scales (0 before the first object is added)
+  int getNumScales() const { return ivScans.size(); }
+  /// returns the scale (of the box's object group) whose window size is closest to the given box
+  int getScale(const ObjectBox & box) const;
+  /// returns the number of aspect ratio groups, each of them has its own scan grid
+  int getNumGroups() const { return ivGroupWidths.size(); }
+  /// returns the aspect ratio (width / height) of the windows of a group
+  float getGroupAspectRatio(const int & group) const { return ivGroupWidths[group] / (float)ivGroupHeights[group]; }
+  /// returns the group of an object
+  int getObjectGroup(const int & objId) const { return ivObjectGroups[objId]; }
+  /// returns the scales scaleBegin, ..., scaleEnd - 1 belonging to a group
+  void getGroupScales(const int & group, int & scaleBegin, int & scaleEnd) const
+  {
+    scaleBegin = ivGroupScales[group];
+    scaleEnd = ivGroupScales[group + 1];
+  }
+  /// returns the number of windows of a scale in the whole frame
+  int getNumWindows(const int & scale) const;
 
 private:
   // Methods for feature extraction / fern manipulation etc.
-  void createScaledMatrix(const Matrix& image, Matrix & scaled, float*& sat, float*& sat2, int scale) const;
-  void createScaledMatrices(const Matrix& image, Matrix*& scaled, float**& sats, float**& sat2s) const;
-  void varianceFilter(float * image, float * sat, float * sat2, int scale, std::vector<FernDetection> & acc) const;
+  template <class T, class T2>
+  const std::vector<FernDetection> scanPatchWithSAT(const Matrix & image, const bool & integral) const;
+  template <class T, class T2>
+  void createScaledMatrix(const Matrix& image, Matrix & scaled, T*& sat, T2*& sat2, int scale) const;
+  template <class T, class T2>
+  void createScaledMatrices(const Matrix& image, Matrix*& scaled, T**& sats, T2**& sat2s) const;
+  struct Candidates;
+  struct ScanSettings;
+  template <class T, class T2>
+  void varianceFilter(const T * sat, const T2 * sat2, int scale, Candidates & acc, const bool & integral = false) const;
+  void computeScanPlan(const bool & integral) const;
+  void computeRefinePlan(const bool & integral) const;
+  template <class T, class T2>
+#if USETBBP
+  void cascadeFilter(const T * sat, const T2 * sat2, int scale, Candidates & acc,
+                     const int & stride, const bool & integral = false) const;
+#else
+  void cascadeFilter(const T * sat, const T2 * sat2, const float * scaled, int scale, Candidates & acc,
+                     const int & stride, const bool & integral = false) const;
+#endif
+  template <class T, class T2>
+  int varianceRow(const T * sat, const T2 * sat2, const ScanSettings & ss, const int & y, const int & xBegin,
+                  const int & xEnd, const int & step, const bool & integral, const unsigned long long & bound,
+                  int * xs, float * variances) const;
+#if defined(__AVX2__)
+  int varianceRow(const unsigned int * sat, const unsigned int * sat2, const ScanSettings & ss, const int & y,
+                  const int & xBegin, const int & xEnd, const int & step, const bool & integral,
+                  const unsigned long long & bound, int * xs, float * variances) const;
+#endif
+  unsigned long long varianceBound(const long long & n) const;
+  float windowVariance(const float * sat, const float * sat2, int * indices, const long long & n) const;
+  template <class T2>
+  float windowVariance(const unsigned int * sat, const T2 * sat2, int * indices, const long long & n) const;
   std::vector< Matrix > retrieveHighVarianceSamples(const Matrix& image, const std::vector< ObjectBox >& boxes);
-  int* extractFeatures(const float * const imageOrSAT, int ** offsets) const;
-  void extractFeatures(FernDetection & det) const;
-  float calcMaxConfidence(int * features) const;
-  float * calcConfidences(int * features) const;
+  void extractPatchFeatures(const Matrix & patch, int * result) const;
+  template <class T>
+  void extractFeatures(const T * const imageOrSAT, int ** offsets, int * result) const;
+  void extractFeatureBatch(const float * const sat, int ** offsets, int * results) const;
+  void extractFeatureBatch(const unsigned int * const sat, int ** offsets, int * results) const;
+  void extractFeatureGather(const unsigned int * const sat, int ** offsets, const int * windows, int * results) const;
+  void extractFeatureWindows(const float * const sat, int ** offsets, const int * windows, const int & count,
+                             int * results) const;
+  void extractFeatureWindows(const unsigned int * const sat, int ** offsets, const int * windows, const int & count,
+                             int * results) const;
+  float calcMaxConfidence(const int * features) const;
+  float calcCoarseConfidence(const int * features, const float & threshold, long long & evaluated) const;
+  inline float leafMaxConfidence(const int & nFern, const int & feature) const;
+  inline bool isPositiveLeaf(const int & nFern, const int & feature) const;
+  void markPositiveLeaf(const int & nFern, const int & feature);
+  void updatePositiveLeaves();
+  void updateFernOrder();
+  void calcConfidences(const int * features, float * result) const;
+  /// size of the result buffer of calcConfidences() (ivNumObjects rounded up to a multiple of 32)
+  int confidenceStride() const { return (ivNumObjects + 31) / 32 * 32; }
+  unsigned int confidenceMask(const float * confidences, const float & threshold) const;
   void addPatch(const int & objId, const int * const featureData, const bool & pos);
   void addPatch(const Matrix& scaledImage, const int& objId, const bool& pos);
-  void addPatchWithWarps(const Matrix & image, const ObjectBox & box, const WarpSettings & ws,
-                         std::vector<Matrix> & op, const bool & pos, const bool & notOnlyVar = true);
-  void addWarpedPatches(const Matrix & image, const ObjectBox & box, const WarpSettings & ws,
-                        std::vector<Matrix> & op, const bool & pos);
+  void addPatchesWithWarps(const Matrix & image, const std::vector<ObjectBox> & boxes, const WarpSettings & ws,
+                           std::vector<Matrix> & op, const bool & pos, const bool & notOnlyVar = true);
+  void warpPatch(const Matrix & crop, const float & cx, const float & cy, const float * param, float * result) const;
+  void patchSummedAreaTable(const float * patch, float * sat) const;
+  void patchSummedAreaTable(const float * patch, unsigned int * sat) const;
   void clearLastDetections() const;
 
   // Methods for initialization
   int *** createFeatures();
   void initializeFerns();
   void computeOffsets();
+  void computeGroupOffsets(const int & group);
   int ** computeOffsets(int width);
+  void computeIntegralLayout(ScanSettings & ss);
   void addObjectToFerns();
 
   // Helper
+  int windowIndex(const ScanSettings & ss, const int & x, const int & y, const bool & integral) const;
   int calcTableSize() const;
   void debugOutput() const;
-  FernDetection copyFernDetection(const FernDetection & fd) const;
+  ObjectBox candidateBox(const int & scale, const int & x, const int & y) const;
 
-  struct Posteriors
-  {
-    int n;
-    int p;
-    float posterior;
-  };
+  typedef FernPosteriors Posteriors;
 
   struct Confidences
   {
@@ -167,6 +315,7 @@ private:
 
   struct ScanSettings
   {
+    int group;
     int width;
     int height;
     float boxw;
@@ -175,19 +324,109 @@ private:
     float pixh;
     int * varianceIndizes;
     int ** offsets;
+    // layout for scanning a single integral image of the frame (FERN_SCAN_INTEGRAL)
+    int fullBoxWidth;    // window size in pixels
+    int fullBoxHeight;
+    int fullRight;       // number of window columns / rows inside the frame
+    int fullBottom;
+    int * fullCols;      // pixel position of window column x / row y
+    int * fullRows;
+    int * fullVarianceIndizes;
+    int ** fullOffsets;
   };
 
-  #if DEBUG && TIMING
-  struct ScanTime
+  /// windows passing the detection cascade as struct of arrays (buffers are reused every frame)
+  struct Candidates
   {
-    int time0ScaledImages;
-    int time1Variance;
-    int time2GenFeatures;
-    int time3CoarseFilter;
-    int time4FineFilter;
-    int time5GenPatches;
+    // STEP 1: windows passing the coarse filter, per scale: thread buffer and range of its windows
+    std::vector<int> scale;
+    std::vector<int> x;
+    std::vector<int> y;
+    std::vector<float> variance;
+    std::vector<int> scaleThread;
+    std::vector<int> scaleBegin;
+    std::vector<int> scaleEnd;
+    // STEP 1: ivNumFerns fern codes per window and its maximum confidence
+    std::vector<int> codes;
+    std::vector<float> confidence;
+    long long scannedWindows;
+    long long varianceWindows;
+    long long evaluatedFerns;
+    // STEP 1 scratch: scanned intervals of the current row, windows passing the variance filter and their codes
+    std::vector<int> rowIntervals;
+    std::vector<int> rowX;
+    std::vector<float> rowVariance;
+    std::vector<int> rowCodes;
+    // STEP 2: windows passing the fine filter, a bitmask of their objects (words per window, see
+    // FernDetection::objects), their object confidences (ivNumObjects per window) and scratch
+    // buffer of the object confidences (see calcConfidences())
+    std::vector<int> fine;
+    std::vector<unsigned int> fineMask;
+    std::vector<float> fineConfidences;
+    std::vector<float> objectConfidences;
+
+    void clear()
+    {
+      scale.clear(); x.clear(); y.clear(); variance.clear(); codes.clear(); confidence.clear();
+      fine.clear(); fineMask.clear(); fineConfidences.clear();
+      scannedWindows = 0;
+      varianceWindows = 0;
+      evaluatedFerns = 0;
+    }
+    void add(const int & s, const int & px, const int & py, const float & var)
+    {
+      scale.push_back(s); x.push_back(px); y.push_back(py); variance.push_back(var);
+    }
+    void append(const Candidates & other, const int & begin, const int & end, const int & numFerns)
+    {
+      scale.insert(scale.end(), other.scale.begin() + begin, other.scale.begin() + end);
+      x.insert(x.end(), other.x.begin() + begin, other.x.begin() + end);
+      y.insert(y.end(), other.y.begin() + begin, other.y.begin() + end);
+      variance.insert(variance.end(), other.variance.begin() + begin, other.variance.begin() + end);
+      codes.insert(codes.end(), other.codes.begin() + begin * numFerns, other.codes.begin() + end * numFerns);
+      confidence.insert(confidence.end(), other.confidence.begin() + begin, other.confidence.begin() + end);
+    }
+    int size() const { return scale.size(); }
+    /// sorts the windows in (scale, y, x) order and removes duplicates
+    void sortUnique(const int & numFerns)
+    {
+      std::vector<int> order(size());
+      for (unsigned int i = 0; i < order.size(); ++i)
+        order[i] = i;
+      PositionLess less = {*this};
+      std::stable_sort(order.begin(), order.end(), less);
+      Candidates sorted;
+      for (unsigned int k = 0; k < order.size(); ++k)
+      {
+        const int i = order[k];
+        if (k > 0 && !less(order[k-1], i))
+          continue;
+        sorted.add(scale[i], x[i], y[i], variance[i]);
+        sorted.codes.insert(sorted.codes.end(), codes.begin() + i * numFerns, codes.begin() + (i + 1) * numFerns);
+        sorted.confidence.push_back(confidence[i]);
+      }
+      scale.swap(sorted.scale); x.swap(sorted.x); y.swap(sorted.y); variance.swap(sorted.variance);
+      codes.swap(sorted.codes); confidence.swap(sorted.confidence);
+    }
+
+    /// orders candidate indices by descending variance
+    struct VarianceBetter
+    {
+      const std::vector<float> & variance;
+      bool operator()(const int & a, const int & b) const { return variance[a] > variance[b]; }
+    };
+    /// orders candidate indices by (scale, y, x)
+    struct PositionLess
+    {
+      const Candidates & c;
+      bool operator()(const int & a, const int & b) const
+      {
+        if (c.scale[a] != c.scale[b]) return c.scale[a] < c.scale[b];
+        if (c.y[a] != c.y[b]) return c.y[a] < c.y[b];
+        return c.x[a] < c.x[b];
+      }
+    };
   };
-#endif
 
   // changeable input image dimensions
   int ivWidth;
@@ -211,10 +450,15 @@ private:
   WarpSettings ivInitWarpSettings;
   WarpSettings ivUpdateWarpSettings;
 
+  // random number generator for features and warps (drawn serially, see addPatchesWithWarps())
+  RandomGenerator ivRandom;
+
   // Fern Data
   int *** ivFeatures;
 #if USEMAP
+  int ivFernStore;
   std::map<int, Confidences> * ivFernForest;
+  FernHashTable * ivFernTables;
 #else
   std::vector<int**> ivNtable;
   std::vector<int**> ivPtable;
@@ -222,6 +466,12 @@ private:
   float **ivMaxTable;
 #endif
 
+  // coarse filter cascade: bitsets of leaves seen as positive (2^FERNPOSITIVEBITS bits per fern,
+  // addressed by a hash of the leaf), their number of set bits and the evaluation order of the ferns
+  std::vector<unsigned int> ivPositiveLeaves;
+  std::vector<int> ivPositiveCounts;
+  std::vector<int> ivFernOrder;
+
   // further instance variables
   int ivNumObjects;
   int ivScanNoZoom;
@@ -229,7 +479,23 @@ private:
   int ** ivPatchSizeOffsets;
   std::vector<ScanSettings> ivScans;
   std::vector<float> ivMinVariances;
+  // aspect ratio groups: box size of the scan grid (group 0: ivOriginalWidth / ivOriginalHeight),
+  // the group of every object and the first scale of every group (plus ivScans.size())
+  std::vector<int> ivGroupWidths;
+  std::vector<int> ivGroupHeights;
+  std::vector<int> ivObjectGroups;
+  std::vector<int> ivGroupScales;
   mutable std::vector<FernDetection> ivLastDetections;
+  mutable Candidates ivCandidates;
+  mutable std::vector<Candidates> ivThreadCandidates;
+  mutable FernScanStats ivScanStats;
+  int ivSATMode;
+  int ivScanMode;
+  std::vector<FernScanRegion> ivScanRegions;
+  int ivScanStride;
+  bool ivScanRefine;
+  // window rectangles (x0, y0, x1, y1 - exclusive) to be scanned per scale, see computeScanPlan()
+  mutable std::vector< std::vector<int> > ivScanPlan;
 
   // some default structures
   static const WarpSettings cDefaultInitWarpSettings;
@@ -246,7 +512,8 @@ const WarpSettings FernFilter::cDefaultUpdateWarpSettings = {10, 10, 5, 20, 0.2,
 
 FernFilter::FernFilter(const int & width, const int & height, const int & numFerns,
                        const int & featuresPerFern, const int & patchSize,
-                       const int & scaleMin, const int & scaleMax, const int & bbMin)
+                       const int & scaleMin, const int & scaleMax, const int & bbMin,
+                       const int & fernStore, const unsigned int & seed)
                       : ivWidth(width), ivHeight(height), ivNumFerns(numFerns),
                         ivFeaturesPerFern(featuresPerFern), ivPatchSize(patchSize),
                         ivPatchSizeMinusOne(patchSize-1),
@@ -254,13 +521,19 @@ FernFilter::FernFilter(const int & width, const int & height, const int & numFer
                         ivScaleMin(scaleMin), ivScaleMax(scaleMax), ivBBmin(bbMin),
                         ivInitWarpSettings(cDefaultInitWarpSettings),
                         ivUpdateWarpSettings(cDefaultUpdateWarpSettings),
-                        ivFeatures(createFeatures()), ivNumObjects(0),
-                        ivVarianceThreshold(255*255)
+                        ivRandom(seed), ivFeatures(createFeatures()),
+#if USEMAP
+                        ivFernStore(fernStore),
+#endif
+                        ivNumObjects(0), ivVarianceThreshold(255*255), ivSATMode(FERN_SAT_INTEGER),
+                        ivScanMode(FERN_SCAN_PYRAMID), ivScanStride(1), ivScanRefine(false)
 {
   initializeFerns();
+  resetScanStats();
 }
 
-const std::vector<Matrix> FernFilter::addObjects(const Matrix& image, const std::vector<ObjectBox>& boxes)
+const std::vector<Matrix> FernFilter::addObjects(const Matrix& image, const std::vector<ObjectBox>& boxes,
+                                                 const std::vector<int> & groups)
 {
   std::vector<Matrix> result;
   std::vector<Matrix> posResult; // IDEA: positive warps could also be returned
@@ -272,6 +545,8 @@ const std::vector<Matrix> FernFilter::addObjects(const Matrix& image, const std:
   {
     ivOriginalHeight = boxes[0].height;
     ivOriginalWidth = boxes[0].width;
+    ivGroupWidths.assign(1, ivOriginalWidth);
+    ivGroupHeights.assign(1, ivOriginalHeight);
     computeOffsets();
     //debugOutput();
   }
@@ -280,173 +555,284 @@ const std::vector<Matrix> FernFilter::addObjects(const Matrix& image, const std:
   {
     if (boxes[i].objectId != ivNumObjects + (int)i)
       std::cerr << "ERROR WRONG OBJECT ENUMERATION!" << std::endl;
+    int group = i < groups.size() ? groups[i] : 0;
+    if (group == getNumGroups())
+    {
+      ivGroupWidths.push_back(boxes[i].width);
+      ivGroupHeights.push_back(boxes[i].height);
+      computeGroupOffsets(group);
+    }
+    else if (group < 0 || group > getNumGroups())
+    {
+      std::cerr << "ERROR WRONG GROUP ENUMERATION!" << std::endl;
+      group = 0;
+    }
+    ivObjectGroups.push_back(group);
     ivMinVariances.push_back(100000);
     addObjectToFerns();
-    addPatchWithWarps(image, boxes[i], ivInitWarpSettings, posResult, true);
   }
+  addPatchesWithWarps(image, boxes, ivInitWarpSettings, posResult, true);
 
   if (ivNumObjects == 0)
     result = retrieveHighVarianceSamples(image, boxes);
 
   ivNumObjects += boxes.size();
+  updateFernOrder();
 
   return result;
 }
 
 const std::vector<FernDetection> FernFilter::scanPatch(const Matrix & image) const
 {
-  // Pipeline structure
-  std::vector<FernDetection> varianceFiltered;
-  std::vector<FernDetection> fernFiltered1;
+#if USETBBP
+  if (ivScanMode == FERN_SCAN_INTEGRAL)
+    return scanPatchWithSAT<unsigned int, unsigned long long>(image, true);
+#endif
+  if (ivSATMode == FERN_SAT_INTEGER)
+    return scanPatchWithSAT<unsigned int, unsigned int>(image, false);
+  else
+    return scanPatchWithSAT<float, float>(image, false);
+}
+
+/// @details If @c integral is set, all scales are evaluated on a single summed area table of
+///  @c image (see computeIntegralLayout()), otherwise on scaled copies of @c image.
+template <class T, class T2>
+const std::vector<FernDetection> FernFilter::scanPatchWithSAT(const Matrix & image, const bool & integral) const
+{
+  // Pipeline structure: candidate windows are only turned into FernDetections in the last step
+  Candidates & cand = ivCandidates;
   std::vector<FernDetection> result;
 
-  // scaled images, summed area tables
-  Matrix* scaled; float** sats; float** sat2s;
+  // scaled images, summed area tables (or a single table of the image)
+  Matrix* scaled = NULL; T** sats = NULL; T2** sat2s = NULL;
+  T* fullSat = NULL; T2* fullSat2 = NULL;
 
   clearLastDetections();
+  cand.clear();
 
   if (ivNumObjects == 0)
     return result;
 
-#if DEBUG && TIMING
-ScanTime st;
-#endif
+  computeScanPlan(integral);
+
+  // objects of every aspect ratio group as bitmask (see FernDetection::objects)
+  const int maskWords = (ivNumObjects + 31) / 32;
+  std::vector<unsigned int> groupMasks(getNumGroups() * maskWords, 0);
+  for (int nObject = 0; nObject < ivNumObjects; ++nObject)
+    groupMasks[ivObjectGroups[nObject] * maskWords + nObject / 32] |= 1u << (nObject % 32);
+
+  // timestamps of the pipeline steps
+  long long st[5];
 
 #pragma omp parallel
 {
 
-#if DEBUG && TIMING
   #pragma omp master
-  st.time0ScaledImages = getTime();
-#endif
+  st[0] = getTimeMicro();
 
   // Step 0 - Precalculate Scaled Images / Summed Area Tables
-  createScaledMatrices(image, scaled, sats, sat2s); // HIER
+  if (integral)
+  {
+#pragma omp single
+    image.createSummedAreaTable2(fullSat, fullSat2);
+  }
+  else
+    createScaledMatrices(image, scaled, sats, sat2s); // HIER
 
-#if DEBUG && TIMING
   #pragma omp master
-  st.time1Variance = getTime();
-#endif
+  st[1] = getTimeMicro();
 
-  // STEP 1 - Scan, Filter by Variance
+  // STEP 1 - Scan, Filter by Variance, Calculate Feature Data, Coarse filtering By Fern
+  //   fused per (scale, row): only windows passing the coarse filter are stored; every thread
+  //   collects its windows in its own buffer, these are merged in (scale, y, x) order.
+  //   With ivScanRefine a second pass scans the neighborhoods of the windows found densely.
+  for (int pass = 0; pass < (ivScanRefine ? 2 : 1); ++pass)
+  {
 #pragma omp barrier
+#pragma omp single
+    {
+      ivThreadCandidates.resize(getNumThreads());
+      for (unsigned int t = 0; t < ivThreadCandidates.size(); ++t)
+        ivThreadCandidates[t].clear();
+      cand.scaleThread.resize(ivScans.size());
+      cand.scaleBegin.resize(ivScans.size());
+      cand.scaleEnd.resize(ivScans.size());
+    }
+    Candidates & local = ivThreadCandidates[getThreadNum()];
 #pragma omp for schedule(dynamic)
-  for (unsigned int i = 0; i < ivScans.size(); ++i)
-    varianceFilter(scaled[i].data(), sats[i], sat2s[i], i, varianceFiltered);
-
-#if DEBUG && TIMING
-#pragma omp master
-  st.time2GenFeatures = getTime();
-#endif
-
-  // STEP 2 - Calculate Feature Data
-#pragma omp barrier
-#pragma omp for
-  for (unsigned int i = 0; i < varianceFiltered.size(); ++i)
-    extractFeatures(varianceFiltered[i]);
-
-#if DEBUG && TIMING
-#pragma omp master
-  st.time3CoarseFilter = getTime();
+    for (unsigned int i = 0; i < ivScans.size(); ++i)
+    {
+      cand.scaleThread[i] = getThreadNum();
+      cand.scaleBegin[i] = local.size();
+      const int stride = pass == 0 ? ivScanStride : 1;
+      if (ivScanPlan[i].empty())
+        ; // scale is not scanned
+#if USETBBP
+      else if (integral)
+        cascadeFilter(fullSat, fullSat2, i, local, stride, true);
+      else
+        cascadeFilter(sats[i], sat2s[i], i, local, stride);
+#else
+      else // the integral mode needs USETBBP
+        cascadeFilter(sats[i], sat2s[i], scaled[i].data(), i, local, stride);
 #endif
-
-  // STEP 3 - Coarse filtering By Fern
-#pragma omp barrier
-  float confidenceThreshold = CONFIDENCETHRESHOLD * ivNumFerns;
-#pragma omp for
-  for (unsigned int i = 0; i < varianceFiltered.size(); ++i)
-  {
-    FernDetection det = varianceFiltered[i];
-    det.confidence = calcMaxConfidence(det.featureData);
-    if (det.confidence >= confidenceThreshold)
-#pragma omp critical
-      fernFiltered1.push_back(det);
-    else
-      delete[] det.featureData;
+      cand.scaleEnd[i] = local.size();
+    }
+#pragma omp single
+    {
+      for (unsigned int i = 0; i < ivScans.size(); ++i)
+        cand.append(ivThreadCandidates[cand.scaleThread[i]], cand.scaleBegin[i], cand.scaleEnd[i], ivNumFerns);
+      for (unsigned int t = 0; t < ivThreadCandidates.size(); ++t)
+      {
+        cand.scannedWindows += ivThreadCandidates[t].scannedWindows;
+        cand.varianceWindows += ivThreadCandidates[t].varianceWindows;
+        cand.evaluatedFerns += ivThreadCandidates[t].evaluatedFerns;
+      }
+      if (pass == 0 && ivScanRefine)
+        computeRefinePlan(integral);
+      else if (pass == 1)
+        cand.sortUnique(ivNumFerns);
+    }
   }
+  Candidates & local = ivThreadCandidates[getThreadNum()];
 
-#if DEBUG && TIMING
-#pragma omp master
-  st.time4FineFilter = getTime();
-#endif
+  #pragma omp master
+  st[2] = getTimeMicro();
 
-  // STEP 4 - Fine filtering By Fern
+  // STEP 2 - Fine filtering By Fern
+  //   every window passing the fine filter of at least one object of its group is kept once,
+  //   together with a bitmask of these objects
 #pragma omp barrier
+  const float confidenceThreshold = CONFIDENCETHRESHOLD * ivNumFerns;
   if (ivNumObjects == 1)
   {
 #pragma omp single
-    result = fernFiltered1;
+    {
+      cand.fine.resize(cand.size());
+      for (int i = 0; i < cand.size(); ++i)
+        cand.fine[i] = i;
+      cand.fineMask.assign(cand.size(), 1);
+      cand.fineConfidences = cand.confidence; // the maximum is the confidence of the only object
+    }
   }
   else
   {
-#pragma omp for
-    for (unsigned int i = 0; i < fernFiltered1.size(); ++i)
+    local.objectConfidences.resize(confidenceStride());
+    // static scheduling: thread t processes the t-th contiguous chunk, so merging in thread order keeps the order
+#pragma omp for schedule(static)
+    for (int i = 0; i < cand.size(); ++i)
     {
-      FernDetection det = fernFiltered1[i];
-      float * confidences = calcConfidences(det.featureData);
-      int n = 0;
-      for (int nObject = 0; nObject < ivNumObjects; ++nObject)
+      calcConfidences(&cand.codes[i * ivNumFerns], &local.objectConfidences[0]);
+      const unsigned int * groupMask = &groupMasks[ivScans[cand.scale[i]].group * maskWords];
+      const int start = local.fineMask.size();
+      local.fineMask.resize(start + maskWords);
+      unsigned int any = 0;
+      for (int w = 0; w < maskWords; ++w)
       {
-        if (confidences[nObject] > confidenceThreshold)
-        {
-          FernDetection nDetection = copyFernDetection(det);
-          nDetection.box.objectId = nObject;
-#pragma omp critical
-          result.push_back(nDetection);
-          ++n;
-        }
+        unsigned int bits = confidenceMask(&local.objectConfidences[32 * w], confidenceThreshold) & groupMask[w];
+        local.fineMask[start + w] = bits;
+        any |= bits;
+      }
+      if (any)
+      {
+        local.fine.push_back(i);
+        local.fineConfidences.insert(local.fineConfidences.end(), local.objectConfidences.begin(),
+                                     local.objectConfidences.begin() + ivNumObjects);
       }
-      delete[] confidences;
-      delete[] det.featureData;
+      else
+        local.fineMask.resize(start);
+    }
+#pragma omp single
+    for (unsigned int t = 0; t < ivThreadCandidates.size(); ++t)
+    {
+      cand.fine.insert(cand.fine.end(), ivThreadCandidates[t].fine.begin(), ivThreadCandidates[t].fine.end());
+      cand.fineMask.insert(cand.fineMask.end(), ivThreadCandidates[t].fineMask.begin(),
+                           ivThreadCandidates[t].fineMask.end());
+      cand.fineConfidences.insert(cand.fineConfidences.end(), ivThreadCandidates[t].fineConfidences.begin(),
+                                  ivThreadCandidates[t].fineConfidences.end());
     }
   }
 
-#if DEBUG && TIMING
-#pragma omp master
-  st.time5GenPatches = getTime();
-#endif
+  #pragma omp master
+  st[3] = getTimeMicro();
 
-  // STEP 5 finally add patches
+  // STEP 3 finally create detections (including patches) of the remaining windows
 #pragma omp barrier
+#pragma omp single
+  result.resize(cand.fine.size());
 #pragma omp for
-  for (unsigned int i = 0; i < result.size(); ++i)
+  for (unsigned int d = 0; d < cand.fine.size(); ++d)
   {
-    result[i].patch.copyFromFloatArray(result[i].imageOffset,((ScanSettings*)(result[i].ss))->width,ivPatchSize,ivPatchSize);
+    const int i = cand.fine[d];
+    const int scale = cand.scale[i];
+    const ScanSettings & ss = ivScans[scale];
+    FernDetection & det = result[d];
+    det.box = candidateBox(scale, cand.x[i], cand.y[i]);
+    det.objects.assign(cand.fineMask.begin() + d * maskWords, cand.fineMask.begin() + (d + 1) * maskWords);
+    det.box.objectId = 0;
+    while (!det.hasObject(det.box.objectId))
+      det.box.objectId++;
+    det.confidence = cand.confidence[i];
+    det.objectConfidences.assign(cand.fineConfidences.begin() + d * ivNumObjects,
+                                 cand.fineConfidences.begin() + (d + 1) * ivNumObjects);
+    det.objectConfidence = det.objectConfidences[det.box.objectId];
+    det.featureData = new int[ivNumFerns];
+    memcpy(det.featureData, &cand.codes[i * ivNumFerns], ivNumFerns * sizeof(int));
+    det.ss = &(ivScans[scale]);
+    if (integral)
+    {
+      // crop the window from the image and scale it down to a patch
+      det.imageOffset = image.data() + ss.fullRows[cand.y[i]] * ivWidth + ss.fullCols[cand.x[i]];
+      det.patch.copyFromFloatArray(det.imageOffset, ivWidth, ss.fullBoxWidth, ss.fullBoxHeight);
+      det.patch.rescale(ivPatchSize, ivPatchSize);
+    }
+    else
+    {
+      det.imageOffset = scaled[scale].data() + cand.y[i] * ss.width + cand.x[i];
+      det.patch.copyFromFloatArray(det.imageOffset, ss.width, ivPatchSize, ivPatchSize);
+    }
   }
 }
 
 
-#if DEBUG && TIMING
-  int timefinished = getTime();
-#endif
+  st[4] = getTimeMicro();
 
-#if DEBUG && TIMING
-  // convert absolute time to relative time
-  st.time0ScaledImages = st.time1Variance     - st.time0ScaledImages;
-  st.time1Variance     = st.time2GenFeatures  - st.time1Variance;
-  st.time2GenFeatures  = st.time3CoarseFilter - st.time2GenFeatures;
-  st.time3CoarseFilter = st.time4FineFilter   - st.time3CoarseFilter;
-  st.time4FineFilter   = st.time5GenPatches   - st.time4FineFilter;
-  st.time5GenPatches   = timefinished         - st.time5GenPatches;
-#endif
+  // update performance counters
+  ivScanStats.frames++;
+  ivScanStats.scannedWindows += cand.scannedWindows;
+  ivScanStats.varianceWindows += cand.varianceWindows;
+  ivScanStats.evaluatedFerns += cand.evaluatedFerns;
+  ivScanStats.coarseWindows += cand.size();
+  ivScanStats.detections += result.size();
+  for (int i = 0; i < 4; ++i)
+    ivScanStats.time[i] += st[i+1] - st[i];
 
-  delete[] scaled;
-  for (unsigned int i = 0; i < ivScans.size(); ++i)
+  if (integral)
   {
-    delete[] sats[i];
-    delete[] sat2s[i];
+    delete[] fullSat;
+    delete[] fullSat2;
+  }
+  else
+  {
+    delete[] scaled;
+    for (unsigned int i = 0; i < ivScans.size(); ++i)
+    {
+      delete[] sats[i];
+      delete[] sat2s[i];
+    }
+    delete[] sats;
+    delete[] sat2s;
   }
-  delete[] sats;
-  delete[] sat2s;
 
   ivLastDetections = result;
 
 #if DEBUG
-  std::cout << "Patch Filterig Pipeline: " << varianceFiltered.size() << " >> " << fernFiltered1.size()
+  std::cout << "Patch Filterig Pipeline: " << cand.varianceWindows << " >> " << cand.size()
             << " >> " << result.size();
 #if TIMING
-  std::cout << " | Time: " << st.time0ScaledImages << ", " << st.time1Variance << ", " << st.time2GenFeatures
-            << ", " << st.time3CoarseFilter << ", " << st.time4FineFilter << ", " << st.time5GenPatches;
+  std::cout << " | Time:";
+  for (int i = 0; i < 4; ++i)
+    std::cout << (i ? ", " : " ") << (st[i+1] - st[i]) / 1000;
 #endif
   std::cout << std::endl;
 #endif
@@ -454,7 +840,6 @@ ScanTime st;
   return result;
 }
 
-// TODO: Multiprozessor
 const std::vector<Matrix> FernFilter::learn(const Matrix & image, const std::vector<ObjectBox>& boxes, bool onlyVariance)
 {
 #if DEBUG
@@ -478,8 +863,8 @@ const std::vector<Matrix> FernFilter::learn(const Matrix & image, const std::vec
   {
     valid[bi->objectId] = true;
     bx[bi->objectId] = *bi;
-    addPatchWithWarps(image, *bi, ivUpdateWarpSettings, result, true, !onlyVariance);
   }
+  addPatchesWithWarps(image, boxes, ivUpdateWarpSettings, result, true, !onlyVariance);
 
   // calculate final variance value
   for (int nObj = 0; nObj < ivNumObjects; ++nObj)
@@ -499,19 +884,22 @@ const std::vector<Matrix> FernFilter::learn(const Matrix & image, const std::vec
     for (std::vector<FernDetection>::iterator fd = ivLastDetections.begin();
   fd < ivLastDetections.end(); ++fd)
     {
-      int objId = fd->box.objectId;
-      if (valid[objId] && rectangleOverlap(fd->box, bx[objId]) < NEGOVERLAPTHRESHOLD)
+      for (int objId = 0; objId < ivNumObjects; ++objId)
       {
-  addPatch(objId, fd->featureData, false);
-  // negative patches don't have to be warped!
-  // addPatch(image, fd->box, ivUpdateWarpSettings, false);
-  ++del;
+        if (fd->hasObject(objId) && valid[objId] && rectangleOverlap(fd->box, bx[objId]) < NEGOVERLAPTHRESHOLD)
+        {
+          addPatch(objId, fd->featureData, false);
+          // negative patches don't have to be warped!
+          // addPatch(image, fd->box, ivUpdateWarpSettings, false);
+          ++del;
+        }
       }
     }
   }
   delete[] valid;
   delete[] bx;
   clearLastDetections();
+  updateFernOrder();
 
 #if DEBUG
   int tEnd = getTime();
@@ -545,9 +933,40 @@ void FernFilter::saveToStream(std::ofstream & outputStream) const
     for (int nFernFeature = 0; nFernFeature < ivFeaturesPerFern; ++nFernFeature)
       outputStream.write((char*)(ivFeatures[nFern][nFernFeature]), 4*sizeof(int));
 
-  // 3. fern structures
+  // 3. fern structures (same format for both stores)
 #if USEMAP
-  for (int nFern = 0; nFern < ivNumFerns; ++nFern)
+  for (int nFern = 0; nFern < ivNumFerns && ivFernStore == FERN_STORE_HASH; ++nFern)
+  {
+    const FernHashTable & table = ivFernTables[nFern];
+    std::vector<int> keys;
+    for (int slot = 0; slot < table.capacity(); ++slot)
+      if (table.keyAt(slot) >= 0)
+        keys.push_back(table.keyAt(slot));
+    std::sort(keys.begin(), keys.end());
+    int mapSize = keys.size();
+    outputStream.write((char*)&mapSize, sizeof(int));
+    for (std::vector<int>::const_iterator it = keys.begin(); it != keys.end(); ++it)
+    {
+      int slot = table.find(*it);
+      const Posteriors * posteriors = table.posteriorsAt(slot);
+      outputStream.write((char*)&(*it), sizeof(int));
+      outputStream.write((char*)&table.maxConfAt(slot), sizeof(float));
+      int entrySize = 0;
+      for (int nObject = 0; nObject < table.numObjects(); ++nObject)
+        if (posteriors[nObject].n + posteriors[nObject].p > 0)
+          ++entrySize;
+      outputStream.write((char*)&entrySize, sizeof(int));
+      for (int nObject = 0; nObject < table.numObjects(); ++nObject)
+      {
+        if (posteriors[nObject].n + posteriors[nObject].p > 0)
+        {
+          outputStream.write((char*)&nObject, sizeof(int));
+          outputStream.write((char*)(posteriors + nObject), sizeof(Posteriors));
+        }
+      }
+    }
+  }
+  for (int nFern = 0; nFern < ivNumFerns && ivFernStore == FERN_STORE_MAP; ++nFern)
   {
     int mapSize = ivFernForest[nFern].size();
     outputStream.write((char*)&mapSize, sizeof(int));
@@ -572,6 +991,23 @@ void FernFilter::saveToStream(std::ofstream & outputStream) const
   // 4. minVariance
   outputStream.write((char*)ivMinVariances.data(), ivNumObjects*sizeof(float));
 
+  // 5. aspect ratio groups (tagged, files without them end here)
+  const char * groupstring = "gRp!";
+  outputStream.write(groupstring, 4*sizeof(char));
+  int numGroups = getNumGroups();
+  outputStream.write((char*)&numGroups, sizeof(int));
+  outputStream.write((char*)ivGroupWidths.data(), numGroups*sizeof(int));
+  outputStream.write((char*)ivGroupHeights.data(), numGroups*sizeof(int));
+  outputStream.write((char*)ivObjectGroups.data(), ivNumObjects*sizeof(int));
+
+  // 6. detector modes and random number generator (tagged, files without them end here)
+  const char * modestring = "mOd!";
+  outputStream.write(modestring, 4*sizeof(char));
+  unsigned long long randomState = ivRandom.getState();
+  outputStream.write((char*)&ivSATMode, sizeof(int));
+  outputStream.write((char*)&ivScanMode, sizeof(int));
+  outputStream.write((char*)&randomState, sizeof(unsigned long long));
+
   /* DEBUGGING - print out instance variables
   std::cout << ivWidth << ", " << ivHeight << ", " << ivNumObjects << ", " << ivNumFerns
             << ", " << ivFeaturesPerFern << ", " << ivPatchSize << ", " << ivScaleMin
@@ -585,7 +1021,7 @@ void FernFilter::saveToStream(std::ofstream & outputStream) const
    */
 }
 
-FernFilter FernFilter::loadFromStream(std::ifstream & inputStream)
+FernFilter FernFilter::loadFromStream(std::ifstream & inputStream, const int & fernStore)
 {
   // 1. simple instance variables
   int width, height, numObjects, numFerns, featuresPerFern, patchSize, scaleMin, scaleMax,
@@ -621,7 +1057,17 @@ FernFilter FernFilter::loadFromStream(std::ifstream & inputStream)
 
   // 3. fern structures
 #if USEMAP
-  std::map<int, Confidences> * fernForest = new std::map<int, Confidences>[numFerns];
+  std::map<int, Confidences> * fernForest = NULL;
+  FernHashTable * fernTables = NULL;
+  if (fernStore == FERN_STORE_HASH)
+  {
+    fernTables = new FernHashTable[numFerns];
+    for (int nFern = 0; nFern < numFerns; ++nFern)
+      for (int nObject = 0; nObject < numObjects; ++nObject)
+        fernTables[nFern].addObject();
+  }
+  else
+    fernForest = new std::map<int, Confidences>[numFerns];
   for (int nFern = 0; nFern < numFerns; ++nFern)
   {
     int mapSize;
@@ -632,6 +1078,18 @@ FernFilter FernFilter::loadFromStream(std::ifstream & inputStream)
       inputStream.read((char*)&key, sizeof(int));
       inputStream.read((char*)&maxConf, sizeof(float));
       inputStream.read((char*)&entrySize, sizeof(int));
+      if (fernStore == FERN_STORE_HASH)
+      {
+        int slot = fernTables[nFern].insert(key);
+        fernTables[nFern].maxConfAt(slot) = maxConf;
+        for (int nEntry = 0; nEntry < entrySize; ++nEntry)
+        {
+          int nObject;
+          inputStream.read((char*)&nObject, sizeof(int));
+          inputStream.read((char*)(fernTables[nFern].posteriorsAt(slot) + nObject), sizeof(Posteriors));
+        }
+        continue;
+      }
       std::map<int, Posteriors> posteriors;
       for (int nEntry = 0; nEntry < entrySize; ++nEntry)
       {
@@ -650,12 +1108,75 @@ FernFilter FernFilter::loadFromStream(std::ifstream & inputStream)
   std::cerr << "Loading Not Yet implemented for Table" << std::endl;
 #endif
 
+#if USEMAP
+  for (int nFern = 0; nFern < numFerns && fernStore == FERN_STORE_HASH; ++nFern)
+    fernTables[nFern].updateValues();
+#endif
+
   // 4. minVariance
   std::vector<float> minVariances(numObjects);
   inputStream.read((char*)minVariances.data(), numObjects * sizeof(float));
 
+  // 5. aspect ratio groups (older files have a single group of the original box size)
+  std::vector<int> groupWidths(1, originalWidth), groupHeights(1, originalHeight), objectGroups(numObjects, 0);
+  char groupstring[4];
+  inputStream.read(groupstring, 4*sizeof(char));
+  if (groupstring[0] == 'g' && groupstring[1] == 'R' &&
+      groupstring[2] == 'p' && groupstring[3] == '!')
+  {
+    int numGroups;
+    inputStream.read((char*)&numGroups, sizeof(int));
+    bool valid = inputStream.good() && numGroups > 0 && numGroups <= std::max(numObjects, 1);
+    if (valid)
+    {
+      groupWidths.resize(numGroups);
+      groupHeights.resize(numGroups);
+      inputStream.read((char*)groupWidths.data(), numGroups * sizeof(int));
+      inputStream.read((char*)groupHeights.data(), numGroups * sizeof(int));
+      inputStream.read((char*)objectGroups.data(), numObjects * sizeof(int));
+      for (int i = 0; i < numGroups; ++i)
+        valid = valid && groupWidths[i] > 0 && groupHeights[i] > 0;
+      for (int i = 0; i < numObjects; ++i)
+        valid = valid && objectGroups[i] >= 0 && objectGroups[i] < numGroups;
+    }
+    if (!valid)
+    {
+      std::cerr << "Invalid aspect ratio groups, using the original box size!" << std::endl;
+      groupWidths.assign(1, originalWidth);
+      groupHeights.assign(1, originalHeight);
+      objectGroups.assign(numObjects, 0);
+    }
+  }
+  else
+  {
+    inputStream.clear();
+    inputStream.seekg(-4, std::ios::cur);
+  }
+
+  // 6. detector modes and random number generator (older files use the defaults)
+  int satMode = FERN_SAT_INTEGER, scanMode = FERN_SCAN_PYRAMID;
+  unsigned long long randomState = RandomGenerator().getState();
+  char modestring[4];
+  inputStream.read(modestring, 4*sizeof(char));
+  if (modestring[0] == 'm' && modestring[1] == 'O' &&
+      modestring[2] == 'd' && modestring[3] == '!')
+  {
+    inputStream.read((char*)&satMode, sizeof(int));
+    inputStream.read((char*)&scanMode, sizeof(int));
+    inputStream.read((char*)&randomState, sizeof(unsigned long long));
+    if (satMode != FERN_SAT_INTEGER && satMode != FERN_SAT_FLOAT)
+      satMode = FERN_SAT_INTEGER;
+    if (scanMode != FERN_SCAN_PYRAMID && scanMode != FERN_SCAN_INTEGRAL)
+      scanMode = FERN_SCAN_PYRAMID;
+  }
+  else
+  {
+    inputStream.clear();
+    inputStream.seekg(-4, std::ios::cur);
+  }
+
   // finally generate fern filter
-  FernFilter result(width, height, numFerns, featuresPerFern, patchSize, scaleMin, scaleMax, bbMin);
+  FernFilter result(width, height, numFerns, featuresPerFern, patchSize, scaleMin, scaleMax, bbMin, fernStore);
   result.ivNumObjects = numObjects;
   result.ivInitWarpSettings = initWarpSettings;
   result.ivUpdateWarpSettings = updateWarpSettings;
@@ -664,10 +1185,20 @@ FernFilter FernFilter::loadFromStream(std::ifstream & inputStream)
   result.ivOriginalHeight = originalHeight;
   result.ivFeatures = features;
 #if USEMAP
+  delete[] result.ivFernForest;
+  delete[] result.ivFernTables;
   result.ivFernForest = fernForest;
+  result.ivFernTables = fernTables;
 #endif
   result.ivMinVariances = minVariances;
+  result.ivGroupWidths = groupWidths;
+  result.ivGroupHeights = groupHeights;
+  result.ivObjectGroups = objectGroups;
+  result.ivSATMode = satMode;
+  result.ivScanMode = scanMode;
+  result.ivRandom.setState(randomState);
   result.computeOffsets();
+  result.updatePositiveLeaves();
   // result.debugOutput();
 
   /* DEBUGGING - print out loaded instance variables
@@ -697,10 +1228,19 @@ FernFilter::FernFilter(const FernFilter& source) :
   ivScaleMax(source.ivScaleMax), ivBBmin(source.ivBBmin),
   ivInitWarpSettings(source.ivInitWarpSettings),
   ivUpdateWarpSettings(source.ivUpdateWarpSettings),
+  ivRandom(source.ivRandom),
+#if USEMAP
+  ivFernStore(source.ivFernStore),
+#endif
   ivNumObjects(source.ivNumObjects),
   ivScanNoZoom(source.ivScanNoZoom),
   ivVarianceThreshold(source.ivVarianceThreshold),
-  ivMinVariances(source.ivMinVariances)
+  ivMinVariances(source.ivMinVariances),
+  ivGroupWidths(source.ivGroupWidths), ivGroupHeights(source.ivGroupHeights),
+  ivObjectGroups(source.ivObjectGroups), ivGroupScales(source.ivGroupScales),
+  ivScanStats(source.ivScanStats),
+  ivSATMode(source.ivSATMode), ivScanMode(source.ivScanMode), ivScanRegions(source.ivScanRegions),
+  ivScanStride(source.ivScanStride), ivScanRefine(source.ivScanRefine)
 {
   // copy ivFeatures
   ivFeatures = new int**[ivNumFerns];
@@ -716,14 +1256,20 @@ FernFilter::FernFilter(const FernFilter& source) :
 
   // copy fern data
 #if USEMAP
-  ivFernForest = new std::map<int, Confidences>[ivNumFerns];
+  initializeFerns();
   for (int nFern = 0; nFern < ivNumFerns; ++nFern)
   {
-    ivFernForest[nFern] = source.ivFernForest[nFern];
+    if (ivFernStore == FERN_STORE_HASH)
+      ivFernTables[nFern] = source.ivFernTables[nFern];
+    else
+      ivFernForest[nFern] = source.ivFernForest[nFern];
   }
 #else
   std::cerr << "COPY CONSTRUCTOR NOT YET IMPLEMENTED FOR LOOKUP TABLE!" << std::endl;
 #endif
+  ivPositiveLeaves = source.ivPositiveLeaves;
+  ivPositiveCounts = source.ivPositiveCounts;
+  ivFernOrder = source.ivFernOrder;
 
 #if USEMAP
   int offsetSize = 16*ivFeaturesPerFern;
@@ -747,6 +1293,7 @@ FernFilter::FernFilter(const FernFilter& source) :
       }
       ss.varianceIndizes = new int[4];
       memcpy(ss.varianceIndizes, it->varianceIndizes, 4 * sizeof(int));
+      computeIntegralLayout(ss);
       ivScans.push_back(ss);
     }
 
@@ -765,6 +1312,7 @@ FernFilter::~FernFilter()
   // Learned Data
 #if USEMAP
   delete [] ivFernForest;
+  delete [] ivFernTables;
 #else
   std::cerr << "Destructor not implemented for table lookup!" << std::endl;
 #endif
@@ -778,6 +1326,12 @@ FernFilter::~FernFilter()
       for (int nFern = 0; nFern < ivNumFerns; ++nFern)
   delete[] it->offsets[nFern];
       delete[] it->offsets;
+      delete[] it->fullCols;
+      delete[] it->fullRows;
+      delete[] it->fullVarianceIndizes;
+      for (int nFern = 0; nFern < ivNumFerns; ++nFern)
+        delete[] it->fullOffsets[nFern];
+      delete[] it->fullOffsets;
     }
     // Patch Size Offsets
     for (int nFern = 0; nFern < ivNumFerns; ++nFern)
@@ -813,6 +1367,13 @@ void FernFilter::changeScanBoxFormat(const int& width, const int& height)
 {
   ivOriginalWidth = width;
   ivOriginalHeight = height;
+  if (ivGroupWidths.empty())
+  {
+    ivGroupWidths.push_back(width);
+    ivGroupHeights.push_back(height);
+  }
+  ivGroupWidths[0] = width;
+  ivGroupHeights[0] = height;
 }
 
 void FernFilter::changeScanSettings(const int& scaleMin, const int& scaleMax, const int& bb_min)
@@ -839,176 +1400,513 @@ void FernFilter::changeWarpSettings(const WarpSettings& initSettings, const Warp
 *                         private accessible stuff                           *
 ******************************************************************************/
 
-inline void FernFilter::createScaledMatrix(const Matrix& image, Matrix& scaled, float*& sat, float*& sat2, int scale) const
+template <class T, class T2>
+inline void FernFilter::createScaledMatrix(const Matrix& image, Matrix& scaled, T*& sat, T2*& sat2, int scale) const
 {
   ScanSettings ss = ivScans[scale];
   scaled = image;
   scaled.rescale(ss.width, ss.height);
-  float ** saTables = scaled.createSummedAreaTable2();
-  sat  = saTables[0];
-  sat2 = saTables[1];
-  delete[] saTables;
+  scaled.createSummedAreaTable2(sat, sat2);
 }
 
-inline void FernFilter::createScaledMatrices(const Matrix& image, Matrix*& scaled, float**& sats, float**& sat2s) const
+template <class T, class T2>
+inline void FernFilter::createScaledMatrices(const Matrix& image, Matrix*& scaled, T**& sats, T2**& sat2s) const
 {
 #pragma omp master
 {
   const int numScans = ivScans.size();
   scaled = new Matrix[numScans];
-  sats   = new float*[numScans];
-  sat2s  = new float*[numScans];
+  sats   = new T*[numScans];
+  sat2s  = new T2*[numScans];
 }
 #pragma omp barrier
 #pragma omp for schedule(dynamic)
   for (unsigned int i = 0; i < ivScans.size(); ++i)
   {
-    createScaledMatrix(image, scaled[i], sats[i], sat2s[i], i);
+    sats[i] = NULL;
+    sat2s[i] = NULL;
+    if (!ivScanPlan[i].empty())
+      createScaledMatrix(image, scaled[i], sats[i], sat2s[i], i);
   }
 }
 
-inline void FernFilter::varianceFilter(float * image, float * sat, float * sat2, int scale, std::vector<FernDetection> & acc) const
+template <class T, class T2>
+inline void FernFilter::varianceFilter(const T * sat, const T2 * sat2, int scale, Candidates & acc, const bool & integral) const
 {
-  ScanSettings ss = ivScans[scale];
-  int right = ss.width - ivPatchSizeMinusOne;
-  int bottom = ss.height - ivPatchSizeMinusOne;
+  const ScanSettings & ss = ivScans[scale];
+  int right = integral ? ss.fullRight : ss.width - ivPatchSizeMinusOne;
+  int bottom = integral ? ss.fullBottom : ss.height - ivPatchSizeMinusOne;
+  int * varianceIndizes = integral ? ss.fullVarianceIndizes : ss.varianceIndizes;
+  const long long n = integral ? ss.fullBoxWidth * ss.fullBoxHeight : ivPatchSizeSquared;
 
   for (int y = 0; y < bottom; ++y)
   {
+    if (integral)
+    {
+      // window columns are not equidistant in the image
+      for (int x = 0; x < right; ++x)
+      {
+        int pos = windowIndex(ss, x, y, true);
+        float variance = windowVariance(sat + pos, sat2 + pos, varianceIndizes, n);
+        if (variance >= ivVarianceThreshold)
+          acc.add(scale, x, y, variance);
+      }
+      continue;
+    }
+
     int yDiff = y * (ss.width + 1);
-    float * satPos = sat + yDiff;
-    float * sat2Pos = sat2 + yDiff;
-    float * imgPos = image + y * ss.width;
+    const T * satPos = sat + yDiff;
+    const T2 * sat2Pos = sat2 + yDiff;
 
 #if USEFASTSCAN
     int fst = y % 2;
-    if (fst == 1) { imgPos++; satPos++; sat2Pos++; }
+    if (fst == 1) { satPos++; sat2Pos++; }
     int step = 2;
 #else
     int fst = 0;
     int step = 1;
 #endif
 
-    for (int x = fst; x < right; x += step, sat2Pos += step, satPos += step, imgPos += step) //, ++start
+    for (int x = fst; x < right; x += step, sat2Pos += step, satPos += step)
     {
-      float ex2 = summedTableArea(sat2Pos,ss.varianceIndizes)/ivPatchSizeSquared;
-      float ex = summedTableArea(satPos,ss.varianceIndizes)/ivPatchSizeSquared;
-      float variance = ex2 - ex*ex;
-
+      float variance = windowVariance(satPos, sat2Pos, varianceIndizes, n);
       if (variance >= ivVarianceThreshold)
-      {
-        FernDetection fd;
-        ObjectBox box = {x*ss.pixw, y*ss.pixh, ss.boxw, ss.boxh, 0, boost::circular_buffer<CvPoint>(CB_LEN)};
-        fd.imageOffset = imgPos;
-        fd.box = box;
-        fd.confidence = variance;
-        fd.ss = &(ivScans[scale]);
-
-#if USETBBP
-        fd.featureData = (int*)satPos;
-#else
-        fd.featureData = (int*)imgPos;
-#endif
-#pragma omp critical
-        acc.push_back(fd);
-      }
+        acc.add(scale, x, y, variance);
     }
   }
 }
 
-inline std::vector<Matrix> FernFilter::retrieveHighVarianceSamples(const Matrix& image, const std::vector<ObjectBox>& boxes)
+/// @details Converts the scan regions into rectangles of windows per scale (ivScanPlan). Without
+///  regions all windows are scanned, scales without rectangles are skipped completely.
+inline void FernFilter::computeScanPlan(const bool & integral) const
 {
-  std::vector<Matrix> result;
-
-  // generate Summed Area Tables
-  Matrix scaled;
-  float* sat;
-  float* sat2;
-  createScaledMatrix(image, scaled, sat, sat2, ivScanNoZoom);
-
-  // scan and order hits
-  std::vector<FernDetection> varianceDetections;
-  float ivVarTTmp = ivVarianceThreshold;
-  ivVarianceThreshold = VARIANCEMINTHRESHOLD;
-  varianceFilter(scaled.data(), sat, sat2, ivScanNoZoom, varianceDetections);
-  ivVarianceThreshold = ivVarTTmp;
-  std::sort(varianceDetections.begin(), varianceDetections.end(), FernDetection::fdBetter);
-
-  std::vector<ObjectBox> allBoxes = boxes;
-  for (unsigned int i = 0; i < varianceDetections.size() && result.size() < NUMNEGTRAININGEXAMPLES; ++i)
+  ivScanPlan.resize(ivScans.size());
+  for (unsigned int i = 0; i < ivScans.size(); ++i)
   {
-    bool good = true;
-    for (unsigned int j = 0; good && j < allBoxes.size(); ++j)
-      if (rectangleOverlap(varianceDetections[i].box, allBoxes[j]) > INITNEGOVERLAPTHRESHOLD)
-        good = false;
-    if (good)
+    const ScanSettings & ss = ivScans[i];
+    int right = integral ? ss.fullRight : ss.width - ivPatchSizeMinusOne;
+    int bottom = integral ? ss.fullBottom : ss.height - ivPatchSizeMinusOne;
+    std::vector<int> & plan = ivScanPlan[i];
+    plan.clear();
+    if (ivScanRegions.empty())
     {
-      allBoxes.push_back(varianceDetections[i].box);
-      Matrix m;
-      m.copyFromFloatArray(varianceDetections[i].imageOffset, ivScans[ivScanNoZoom].width, ivPatchSize, ivPatchSize);
-      result.push_back(m);
+      plan.push_back(0); plan.push_back(0); plan.push_back(right); plan.push_back(bottom);
+      continue;
+    }
+    for (unsigned int r = 0; r < ivScanRegions.size(); ++r)
+    {
+      const FernScanRegion & region = ivScanRegions[r];
+      if ((int)i < region.scaleBegin || (int)i >= region.scaleEnd)
+        continue;
+      // window (x, y) covers [x * pixw, x * pixw + boxw) x [y * pixh, y * pixh + boxh)
+      int x0 = MAX(0, (int)ceil(region.x / ss.pixw));
+      int y0 = MAX(0, (int)ceil(region.y / ss.pixh));
+      int x1 = MIN(right, (int)floor((region.x + region.width - ss.boxw) / ss.pixw) + 1);
+      int y1 = MIN(bottom, (int)floor((region.y + region.height - ss.boxh) / ss.pixh) + 1);
+      if (x0 < x1 && y0 < y1)
+      {
+        plan.push_back(x0); plan.push_back(y0); plan.push_back(x1); plan.push_back(y1);
+      }
     }
   }
-
-  delete[] sat;
-  delete[] sat2;
-
-  return result;
 }
 
-inline int*** FernFilter::createFeatures()
+/// @details Replaces the scan plan by the dense neighborhoods of the windows found by the sparse
+///  first pass (ivCandidates): for a window at scale s all positions closer than ivScanStride are
+///  scanned at scale s, the window center mapped to the scales s - 1 and s + 1 likewise. Only
+///  scales which were scanned in the first pass (and thus have summed area tables) are used.
+inline void FernFilter::computeRefinePlan(const bool & integral) const
 {
-  int *** result = new int**[ivNumFerns];
-  for (int nFern = 0; nFern < ivNumFerns; ++nFern)
+  std::vector<bool> active(ivScans.size());
+  for (unsigned int i = 0; i < ivScans.size(); ++i)
   {
-    result[nFern] = new int*[ivFeaturesPerFern];
-    for (int nFeature = 0; nFeature < ivFeaturesPerFern; ++nFeature)
+    active[i] = !ivScanPlan[i].empty();
+    ivScanPlan[i].clear();
+  }
+  const Candidates & cand = ivCandidates;
+  const int r = ivScanStride;
+  for (int c = 0; c < cand.size(); ++c)
+  {
+    const ScanSettings & src = ivScans[cand.scale[c]];
+    // center of the window in image coordinates
+    const float cx = cand.x[c] * src.pixw + src.boxw / 2;
+    const float cy = cand.y[c] * src.pixh + src.boxh / 2;
+    for (int t = MAX(0, cand.scale[c] - 1); t <= MIN((int)ivScans.size() - 1, cand.scale[c] + 1); ++t)
     {
-      result[nFern][nFeature] = new int[4];
-      result[nFern][nFeature][2] = randInt(2, ivPatchSize); // width
-      result[nFern][nFeature][3] = randInt(2, ivPatchSize); // height
-      result[nFern][nFeature][0] = randInt(0, ivPatchSize - result[nFern][nFeature][2]); // x position
-      result[nFern][nFeature][1] = randInt(0, ivPatchSize - result[nFern][nFeature][3]); // y position
+      if (!active[t] || ivScans[t].group != src.group)
+        continue;
+      const ScanSettings & ss = ivScans[t];
+      int right = integral ? ss.fullRight : ss.width - ivPatchSizeMinusOne;
+      int bottom = integral ? ss.fullBottom : ss.height - ivPatchSizeMinusOne;
+      int x = (int)round((cx - ss.boxw / 2) / ss.pixw);
+      int y = (int)round((cy - ss.boxh / 2) / ss.pixh);
+      int x0 = MAX(0, x - r + 1), y0 = MAX(0, y - r + 1);
+      int x1 = MIN(right, x + r), y1 = MIN(bottom, y + r);
+      if (x0 < x1 && y0 < y1)
+      {
+        std::vector<int> & plan = ivScanPlan[t];
+        plan.push_back(x0); plan.push_back(y0); plan.push_back(x1); plan.push_back(y1);
+      }
     }
   }
-  return result;
 }
 
-inline void FernFilter::initializeFerns()
-{
-#if USEMAP
-  ivFernForest = new std::map<int, Confidences>[ivNumFerns];
-
+/// @details Fused detection cascade of a single scale: every row is passed through the variance
+///  filter (see varianceRow()), the fern codes of its remaining windows are computed in batches of
+///  FERNBATCHSIZE and only windows passing the coarse filter are added to @c acc (including their
+///  codes and maximum confidence). Only rows and columns which are multiples of @c stride are
+///  scanned. Without USETBBP the features are compared on the scaled image @c scaled.
+template <class T, class T2>
+#if USETBBP
+inline void FernFilter::cascadeFilter(const T * sat, const T2 * sat2, int scale,
+                                      Candidates & acc, const int & stride, const bool & integral) const
 #else
-  int tableSize = calcTableSize();
-
-  ivMaxTable = new float*[ivNumFerns];
-  for (int nFern = 0; nFern < ivNumFerns; ++nFern)
-  {
-    ivMaxTable[nFern] = new float[tableSize];
-    memset(ivMaxTable[nFern], 0, tableSize * sizeof(float));
-  }
+inline void FernFilter::cascadeFilter(const T * sat, const T2 * sat2, const float * scaled, int scale,
+                                      Candidates & acc, const int & stride, const bool & integral) const
 #endif
-}
-
-inline void FernFilter::addObjectToFerns()
 {
-#if !USEMAP
-  int tableSize = calcTableSize();
-  int ** nTable = new int*[ivNumFerns];
-  int ** pTable = new int*[ivNumFerns];
-  float ** table = new float*[ivNumFerns];
-  for (int nFern = 0; nFern < ivNumFerns; ++nFern)
+  const ScanSettings & ss = ivScans[scale];
+  int right = integral ? ss.fullRight : ss.width - ivPatchSizeMinusOne;
+  int bottom = integral ? ss.fullBottom : ss.height - ivPatchSizeMinusOne;
+  int ** offsets = integral ? ss.fullOffsets : ss.offsets;
+  const unsigned long long bound = varianceBound(integral ? ss.fullBoxWidth * ss.fullBoxHeight : ivPatchSizeSquared);
+  const float confidenceThreshold = CONFIDENCETHRESHOLD * ivNumFerns;
+
+  acc.rowX.resize(MAX(right, 1));
+  acc.rowVariance.resize(MAX(right, 1));
+  acc.rowCodes.resize((MAX(right, 1) + FERNBATCHSIZE) * ivNumFerns);
+
+  // rows covered by the scan plan
+  const std::vector<int> & plan = ivScanPlan[scale];
+  int yBegin = bottom, yEnd = 0;
+  for (unsigned int r = 0; r < plan.size(); r += 4)
   {
-    nTable[nFern] = new int[tableSize];
-    memset(nTable[nFern], 0, tableSize*sizeof(int));
-    pTable[nFern] = new int[tableSize];
-    memset(pTable[nFern], 0, tableSize*sizeof(int));
-    table[nFern] = new float[tableSize];
-    memset(table[nFern], 0., tableSize*sizeof(int));
+    yBegin = MIN(yBegin, plan[r+1]);
+    yEnd = MAX(yEnd, plan[r+3]);
   }
-  ivNtable.push_back(nTable);
-  ivPtable.push_back(pTable);
+
+  for (int y = yBegin + (stride - yBegin % stride) % stride; y < yEnd; y += stride)
+  {
+    // merge the intervals of all rectangles covering this row
+    std::vector<int> & intervals = acc.rowIntervals;
+    intervals.clear();
+    for (unsigned int r = 0; r < plan.size(); r += 4)
+      if (plan[r+1] <= y && y < plan[r+3])
+      {
+        intervals.push_back(plan[r]);
+        intervals.push_back(plan[r+2]);
+      }
+    if (intervals.size() > 2)
+    {
+      for (unsigned int i = 2; i < intervals.size(); i += 2)
+        for (unsigned int j = i; j > 0 && intervals[j] < intervals[j-2]; j -= 2)
+        {
+          std::swap(intervals[j], intervals[j-2]);
+          std::swap(intervals[j+1], intervals[j-1]);
+        }
+      unsigned int merged = 0;
+      for (unsigned int i = 2; i < intervals.size(); i += 2)
+      {
+        if (intervals[i] <= intervals[merged+1])
+          intervals[merged+1] = MAX(intervals[merged+1], intervals[i+1]);
+        else
+        {
+          merged += 2;
+          intervals[merged] = intervals[i];
+          intervals[merged+1] = intervals[i+1];
+        }
+      }
+      intervals.resize(merged + 2);
+    }
+
+    int count = 0;
+    for (unsigned int i = 0; i < intervals.size(); i += 2)
+    {
+      const int xBegin = intervals[i] + (stride - intervals[i] % stride) % stride;
+      if (xBegin >= intervals[i+1])
+        continue;
+      acc.scannedWindows += (intervals[i+1] - xBegin + stride - 1) / stride;
+      count += varianceRow(sat, sat2, ss, y, xBegin, intervals[i+1], stride, integral, bound,
+                           &acc.rowX[count], &acc.rowVariance[count]);
+    }
+    acc.varianceWindows += count;
+
+    for (int k = 0; k < count; k += FERNBATCHSIZE)
+    {
+      const int m = MIN(FERNBATCHSIZE, count - k);
+      int * codes = &acc.rowCodes[k * ivNumFerns];
+      int windows[FERNBATCHSIZE];
+      bool contiguous = m == FERNBATCHSIZE;
+      for (int j = 0; j < FERNBATCHSIZE; ++j)
+      {
+        windows[j] = windowIndex(ss, acc.rowX[k + MIN(j, m - 1)], y, integral);
+        // in integral mode the columns are rounded, so every step has to be checked
+        contiguous = contiguous && (j == 0 || windows[j] == windows[j-1] + 1);
+      }
+#if USETBBP
+      if (contiguous)
+        extractFeatureBatch(sat + windows[0], offsets, codes);
+      else
+        extractFeatureWindows(sat, offsets, windows, m, codes);
+#else
+      for (int j = 0; j < m; ++j)
+        extractFeatures(scaled + y * ss.width + acc.rowX[k+j], offsets, codes + j * ivNumFerns);
+#endif
+    }
+
+    for (int j = 0; j < count; ++j)
+    {
+      const int * windowCodes = &acc.rowCodes[j * ivNumFerns];
+      float confidence = calcCoarseConfidence(windowCodes, confidenceThreshold, acc.evaluatedFerns);
+      if (confidence >= confidenceThreshold)
+      {
+        acc.add(scale, acc.rowX[j], y, acc.rowVariance[j]);
+        acc.codes.insert(acc.codes.end(), windowCodes, windowCodes + ivNumFerns);
+        acc.confidence.push_back(confidence);
+      }
+    }
+  }
+}
+
+/// @details Writes the columns (and variances) of the windows x = xBegin + k * step < xEnd in row
+///  @c y passing the variance filter to @c xs (and @c variances) and returns their number.
+///  The threshold @c bound is only needed by the integer version (see below).
+template <class T, class T2>
+inline int FernFilter::varianceRow(const T * sat, const T2 * sat2, const ScanSettings & ss, const int & y,
+                                   const int & xBegin, const int & xEnd, const int & step, const bool & integral,
+                                   const unsigned long long & /*bound*/, int * xs, float * variances) const
+{
+  int * varianceIndizes = integral ? ss.fullVarianceIndizes : ss.varianceIndizes;
+  const long long n = integral ? ss.fullBoxWidth * ss.fullBoxHeight : ivPatchSizeSquared;
+  int count = 0;
+
+#if USEFASTSCAN
+  const bool fast = !integral && step == 1;
+  int fst = fast ? xBegin + ((xBegin + y) & 1) : xBegin;
+  int inc = fast ? 2 : step;
+#else
+  int fst = xBegin;
+  int inc = step;
+#endif
+
+  for (int x = fst; x < xEnd; x += inc)
+  {
+    // window columns are not equidistant in the image in integral mode
+    int pos = windowIndex(ss, x, y, integral);
+    float variance = windowVariance(sat + pos, sat2 + pos, varianceIndizes, n);
+    if (variance >= ivVarianceThreshold)
+    {
+      xs[count] = x;
+      variances[count++] = variance;
+    }
+  }
+  return count;
+}
+
+#if defined(__AVX2__)
+/// @details Integer version of varianceRow() testing 8 windows at once: the filter is evaluated
+///  as n * sum(x^2) - sum(x)^2 >= @c bound (see varianceBound()), which is exact in 32 bits for
+///  patches of up to 16x16 pixels. The survivors are compacted from the comparison mask.
+inline int FernFilter::varianceRow(const unsigned int * sat, const unsigned int * sat2, const ScanSettings & ss,
+                                   const int & y, const int & xBegin, const int & xEnd, const int & step,
+                                   const bool & integral, const unsigned long long & bound,
+                                   int * xs, float * variances) const
+{
+  const long long n = ivPatchSizeSquared;
+  if (integral || USEFASTSCAN || step != 1 || n * n * 255 * 255 >= (1LL << 32))
+    return varianceRow<unsigned int, unsigned int>(sat, sat2, ss, y, xBegin, xEnd, step, integral, bound,
+                                                   xs, variances);
+
+  int * vi = ss.varianceIndizes;
+  const unsigned int * satPos = sat + y * (ss.width + 1);
+  const unsigned int * sat2Pos = sat2 + y * (ss.width + 1);
+  int count = 0;
+  int x = xBegin;
+
+  if (bound > 0xFFFFFFFFull)
+    return 0; // no window can pass the filter
+
+  const __m256i nv = _mm256_set1_epi32((int)n);
+  const __m256i bv = _mm256_set1_epi32((int)(unsigned int)bound);
+  #define FERN_AREA(p) _mm256_add_epi32(_mm256_sub_epi32(_mm256_sub_epi32( \
+      _mm256_loadu_si256((const __m256i*)(p + x + vi[0])), _mm256_loadu_si256((const __m256i*)(p + x + vi[1]))), \
+      _mm256_loadu_si256((const __m256i*)(p + x + vi[2]))), _mm256_loadu_si256((const __m256i*)(p + x + vi[3])))
+  for (; x + 8 <= xEnd; x += 8)
+  {
+    __m256i sum = FERN_AREA(satPos);
+    __m256i sum2 = FERN_AREA(sat2Pos);
+    __m256i d = _mm256_sub_epi32(_mm256_mullo_epi32(nv, sum2), _mm256_mullo_epi32(sum, sum));
+    // unsigned d >= bound
+    int mask = _mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpeq_epi32(_mm256_max_epu32(d, bv), d)));
+    for (int k = 0; mask; ++k, mask >>= 1)
+    {
+      if (mask & 1)
+      {
+        xs[count] = x + k;
+        variances[count++] = windowVariance(satPos + x + k, sat2Pos + x + k, vi, n);
+      }
+    }
+  }
+  #undef FERN_AREA
+
+  for (; x < xEnd; ++x)
+  {
+    float variance = windowVariance(satPos + x, sat2Pos + x, vi, n);
+    if (variance >= ivVarianceThreshold)
+    {
+      xs[count] = x;
+      variances[count++] = variance;
+    }
+  }
+  return count;
+}
+#endif
+
+/// @details Returns the smallest n * sum(x^2) - sum(x)^2 of a window with @c n pixels for which
+///  windowVariance() reaches the variance threshold (2^32 if there is none below 2^32).
+inline unsigned long long FernFilter::varianceBound(const long long & n) const
+{
+  unsigned long long lo = 0, hi = 1ULL << 32;
+  while (lo < hi)
+  {
+    unsigned long long mid = (lo + hi) / 2;
+    if ((float)((double)mid / (n * n)) >= ivVarianceThreshold)
+      hi = mid;
+    else
+      lo = mid + 1;
+  }
+  return lo;
+}
+
+inline float FernFilter::windowVariance(const float * sat, const float * sat2, int * indices, const long long & n) const
+{
+  float ex2 = summedTableArea(sat2,indices)/(int)n;
+  float ex = summedTableArea(sat,indices)/(int)n;
+  return ex2 - ex*ex;
+}
+
+/// @details exact: n * sum(x^2) - sum(x)^2 is computed in integers and divided by n^2 only once
+template <class T2>
+inline float FernFilter::windowVariance(const unsigned int * sat, const T2 * sat2, int * indices, const long long & n) const
+{
+  long long sum = summedTableArea(sat, indices);
+  long long sum2 = summedTableArea(sat2, indices);
+  return (double)(n * sum2 - sum * sum) / (n * n);
+}
+
+inline std::vector<Matrix> FernFilter::retrieveHighVarianceSamples(const Matrix& image, const std::vector<ObjectBox>& boxes)
+{
+  std::vector<Matrix> result;
+
+  // generate Summed Area Tables
+  Matrix scaled;
+  float* sat;
+  float* sat2;
+  createScaledMatrix<float, float>(image, scaled, sat, sat2, ivScanNoZoom);
+
+  // scan and order hits
+  Candidates candidates;
+  float ivVarTTmp = ivVarianceThreshold;
+  ivVarianceThreshold = VARIANCEMINTHRESHOLD;
+  varianceFilter(sat, sat2, ivScanNoZoom, candidates);
+  ivVarianceThreshold = ivVarTTmp;
+  std::vector<int> order(candidates.size());
+  for (unsigned int i = 0; i < order.size(); ++i)
+    order[i] = i;
+  Candidates::VarianceBetter better = {candidates.variance};
+  std::sort(order.begin(), order.end(), better);
+
+  const int width = ivScans[ivScanNoZoom].width;
+  std::vector<ObjectBox> allBoxes = boxes;
+  for (unsigned int o = 0; o < order.size() && result.size() < NUMNEGTRAININGEXAMPLES; ++o)
+  {
+    const int i = order[o];
+    ObjectBox box = candidateBox(ivScanNoZoom, candidates.x[i], candidates.y[i]);
+    bool good = true;
+    for (unsigned int j = 0; good && j < allBoxes.size(); ++j)
+      if (rectangleOverlap(box, allBoxes[j]) > INITNEGOVERLAPTHRESHOLD)
+        good = false;
+    if (good)
+    {
+      allBoxes.push_back(box);
+      Matrix m;
+      m.copyFromFloatArray(scaled.data() + candidates.y[i] * width + candidates.x[i], width, ivPatchSize, ivPatchSize);
+      result.push_back(m);
+    }
+  }
+
+  delete[] sat;
+  delete[] sat2;
+
+  return result;
+}
+
+inline int*** FernFilter::createFeatures()
+{
+  int *** result = new int**[ivNumFerns];
+  for (int nFern = 0; nFern < ivNumFerns; ++nFern)
+  {
+    result[nFern] = new int*[ivFeaturesPerFern];
+    for (int nFeature = 0; nFeature < ivFeaturesPerFern; ++nFeature)
+    {
+      result[nFern][nFeature] = new int[4];
+      result[nFern][nFeature][2] = ivRandom.randInt(2, ivPatchSize); // width
+      result[nFern][nFeature][3] = ivRandom.randInt(2, ivPatchSize); // height
+      result[nFern][nFeature][0] = ivRandom.randInt(0, ivPatchSize - result[nFern][nFeature][2]); // x position
+      result[nFern][nFeature][1] = ivRandom.randInt(0, ivPatchSize - result[nFern][nFeature][3]); // y position
+    }
+  }
+  return result;
+}
+
+inline void FernFilter::initializeFerns()
+{
+  ivPositiveLeaves.assign(ivNumFerns << (FERNPOSITIVEBITS - 5), 0);
+  ivPositiveCounts.assign(ivNumFerns, 0);
+  ivFernOrder.resize(ivNumFerns);
+  for (int nFern = 0; nFern < ivNumFerns; ++nFern)
+    ivFernOrder[nFern] = nFern;
+#if USEMAP
+  ivFernForest = NULL;
+  ivFernTables = NULL;
+  if (ivFernStore == FERN_STORE_HASH)
+    ivFernTables = new FernHashTable[ivNumFerns];
+  else
+    ivFernForest = new std::map<int, Confidences>[ivNumFerns];
+#else
+  int tableSize = calcTableSize();
+
+  ivMaxTable = new float*[ivNumFerns];
+  for (int nFern = 0; nFern < ivNumFerns; ++nFern)
+  {
+    ivMaxTable[nFern] = new float[tableSize];
+    memset(ivMaxTable[nFern], 0, tableSize * sizeof(float));
+  }
+#endif
+}
+
+inline void FernFilter::addObjectToFerns()
+{
+#if USEMAP
+  if (ivFernStore == FERN_STORE_HASH)
+    for (int nFern = 0; nFern < ivNumFerns; ++nFern)
+      ivFernTables[nFern].addObject();
+#else
+  int tableSize = calcTableSize();
+  int ** nTable = new int*[ivNumFerns];
+  int ** pTable = new int*[ivNumFerns];
+  float ** table = new float*[ivNumFerns];
+  for (int nFern = 0; nFern < ivNumFerns; ++nFern)
+  {
+    nTable[nFern] = new int[tableSize];
+    memset(nTable[nFern], 0, tableSize*sizeof(int));
+    pTable[nFern] = new int[tableSize];
+    memset(pTable[nFern], 0, tableSize*sizeof(int));
+    table[nFern] = new float[tableSize];
+    memset(table[nFern], 0., tableSize*sizeof(int));
+  }
+  ivNtable.push_back(nTable);
+  ivPtable.push_back(pTable);
   ivTable.push_back(table);
 #endif
 }
@@ -1017,15 +1915,35 @@ inline void FernFilter::computeOffsets()
 {
   ivScans.clear();
   ivScanNoZoom  = 0;
+  ivGroupScales.assign(1, 0);
+  if (ivGroupWidths.empty())
+  {
+    ivGroupWidths.push_back(ivOriginalWidth);
+    ivGroupHeights.push_back(ivOriginalHeight);
+  }
+
+  for (int group = 0; group < getNumGroups(); ++group)
+    computeGroupOffsets(group);
+
+  ivPatchSizeOffsets = computeOffsets(ivPatchSize);
+}
 
+/// @details Appends the scales of an aspect ratio group to ivScans (groups are stored in order).
+///  Every scan stretches its windows to patchSize x patchSize pixels, so scans of groups with
+///  different aspect ratios never have the same scaled image size: without FERN_SCAN_INTEGRAL each
+///  group rescales the frame and builds the summed area tables for its own scales, so n groups take
+///  up to n times the time of Step 0 of scanPatch(). FERN_SCAN_INTEGRAL shares a single table.
+inline void FernFilter::computeGroupOffsets(const int & group)
+{
   for (int scli = ivScaleMin; scli < ivScaleMax; ++scli)
   {
     ScanSettings ss;
 
     float scale = pow(1.2, scli);
 
-    ss.boxw = ivOriginalWidth * scale;
-    ss.boxh = ivOriginalHeight * scale;
+    ss.group = group;
+    ss.boxw = ivGroupWidths[group] * scale;
+    ss.boxh = ivGroupHeights[group] * scale;
 
     if (ss.boxw < ivBBmin || ss.boxh < ivBBmin || ss.boxw > ivWidth || ss.boxh > ivHeight)
       continue;
@@ -1038,14 +1956,15 @@ inline void FernFilter::computeOffsets()
 
     ss.varianceIndizes = getSATIndices(ss.width, ivPatchSize, ivPatchSize);
     ss.offsets = computeOffsets(ss.width);
+    computeIntegralLayout(ss);
 
-    if (scli == 0)
+    if (scli == 0 && group == 0)
       ivScanNoZoom = ivScans.size();
 
     ivScans.push_back(ss);
   }
-
-  ivPatchSizeOffsets = computeOffsets(ivPatchSize);
+  ivGroupScales.resize(group + 1);
+  ivGroupScales.push_back(ivScans.size());
 }
 
 inline int ** FernFilter::computeOffsets(int width)
@@ -1099,6 +2018,62 @@ inline int ** FernFilter::computeOffsets(int width)
 #endif
 }
 
+/// @details Maps the windows of a scale to the original frame: window column x starts at pixel
+///  round(x * pixw). The feature rectangles are mapped the same way, but both halves of a feature
+///  get the same size (in pixels), so their sums stay comparable.
+inline void FernFilter::computeIntegralLayout(ScanSettings & ss)
+{
+  const int width = ivWidth;
+  ss.fullBoxWidth = MIN((int)round(ivPatchSize * ss.pixw), ivWidth);
+  ss.fullBoxHeight = MIN((int)round(ivPatchSize * ss.pixh), ivHeight);
+
+  const int numCols = ss.width - ivPatchSizeMinusOne;
+  const int numRows = ss.height - ivPatchSizeMinusOne;
+  ss.fullCols = new int[MAX(numCols, 1)];
+  ss.fullRows = new int[MAX(numRows, 1)];
+  ss.fullRight = ss.fullBottom = 0;
+  for (int x = 0; x < numCols && round(x * ss.pixw) + ss.fullBoxWidth <= ivWidth; ++x)
+    ss.fullCols[ss.fullRight++] = round(x * ss.pixw);
+  for (int y = 0; y < numRows && round(y * ss.pixh) + ss.fullBoxHeight <= ivHeight; ++y)
+    ss.fullRows[ss.fullBottom++] = round(y * ss.pixh);
+
+  ss.fullVarianceIndizes = getSATIndices(width, ss.fullBoxWidth, ss.fullBoxHeight);
+
+  ss.fullOffsets = new int*[ivNumFerns];
+  for (int nFern = 0; nFern < ivNumFerns; ++nFern)
+  {
+    int * fernOffsets = new int[ivFeaturesPerFern*16];
+    for (int nFeature = 0; nFeature < ivFeaturesPerFern; ++nFeature)
+    {
+      int * feature = ivFeatures[nFern][nFeature];
+      int * currentPos = fernOffsets + 16 * nFeature;
+      int left = round(feature[0] * ss.pixw);
+      int right = round((feature[0] + feature[2]) * ss.pixw) - 1;
+      int hpix = MIN(MAX((int)round((feature[2] >> 1) * ss.pixw), 1), right - left + 1);
+      int centerl = left + hpix - 1;
+      int centerr = right - hpix + 1;
+
+      int top = round(feature[1] * ss.pixh);
+      int bottom = round((feature[1] + feature[3]) * ss.pixh) - 1;
+      int vpix = MIN(MAX((int)round((feature[3] >> 1) * ss.pixh), 1), bottom - top + 1);
+      int middlet = top + vpix - 1;
+      int middleb = bottom - vpix + 1;
+
+      getSATIndices(currentPos     , width, left   ,     top,   right, middlet);
+      getSATIndices(currentPos +  4, width, left   , middleb,   right,  bottom);
+      getSATIndices(currentPos +  8, width, left   ,     top, centerl,  bottom);
+      getSATIndices(currentPos + 12, width, centerr,     top,   right,  bottom);
+    }
+    ss.fullOffsets[nFern] = fernOffsets;
+  }
+}
+
+/// returns the position of window (x, y) of a scale in its summed area table
+inline int FernFilter::windowIndex(const ScanSettings & ss, const int & x, const int & y, const bool & integral) const
+{
+  return integral ? ss.fullRows[y] * (ivWidth + 1) + ss.fullCols[x] : y * (ss.width + 1) + x;
+}
+
 inline int FernFilter::calcTableSize() const
 {
   int result = 1 << ivFeaturesPerFern;
@@ -1138,32 +2113,140 @@ inline void FernFilter::debugOutput() const
 
 }
 
-inline float FernFilter::calcMaxConfidence(int* featureData) const
+inline float FernFilter::calcMaxConfidence(const int * featureData) const
 {
   float result = 0;
   for (int nFern = 0; nFern < ivNumFerns; ++nFern)
+    result += leafMaxConfidence(nFern, featureData[nFern]);
+  return result;
+}
+
+/// @details Early exit version of calcMaxConfidence() for the coarse filter: the ferns are
+///  evaluated in the order ivFernOrder and the window is rejected as soon as the remaining ferns
+///  (each contributing at most 1) cannot lift it to @c threshold. Leaves never seen as positive
+///  are skipped without accessing the fern store. Windows that may pass get the exact result of
+///  calcMaxConfidence(), rejected ones a value below @c threshold. The number of evaluated ferns
+///  is added to @c evaluated.
+inline float FernFilter::calcCoarseConfidence(const int * featureData, const float & threshold,
+                                              long long & evaluated) const
+{
+  // the margin covers rounding differences due to the changed order of summation
+  const float rejectBelow = threshold - 1e-3f;
+  float partial = 0;
+  for (int i = 0; i < ivNumFerns; ++i)
   {
+    if (partial + (ivNumFerns - i) < rejectBelow)
+    {
+      evaluated += i;
+      return partial;
+    }
+    const int nFern = ivFernOrder[i];
+    if (isPositiveLeaf(nFern, featureData[nFern]))
+      partial += leafMaxConfidence(nFern, featureData[nFern]);
+  }
+  evaluated += ivNumFerns;
+  return calcMaxConfidence(featureData);
+}
+
+/// returns the maximum confidence (over all objects) stored in a leaf (0 if it does not exist)
+inline float FernFilter::leafMaxConfidence(const int & nFern, const int & feature) const
+{
 #if USEMAP
-      std::map<int, Confidences>::const_iterator found =
-        ivFernForest[nFern].find(featureData[nFern]);
-      if (found != ivFernForest[nFern].end())
-      {
-        result += found->second.maxConf;
-      }
+  if (ivFernStore == FERN_STORE_HASH)
+    return ivFernTables[nFern].maxConf(feature);
+  std::map<int, Confidences>::const_iterator found = ivFernForest[nFern].find(feature);
+  return found != ivFernForest[nFern].end() ? found->second.maxConf : 0;
 #else
-      int f = featureData[nFern];
-      result += ivMaxTable[nFern][f];
+  return ivMaxTable[nFern][feature];
 #endif
+}
+
+/// @details False if the leaf has never been updated with a positive example (i.e. its maximum
+///  confidence is 0), true otherwise or in case of hash collisions.
+inline bool FernFilter::isPositiveLeaf(const int & nFern, const int & feature) const
+{
+  unsigned int bit = (unsigned int)feature * 2654435761u >> (32 - FERNPOSITIVEBITS);
+  return (ivPositiveLeaves[(nFern << (FERNPOSITIVEBITS - 5)) + (bit >> 5)] >> (bit & 31)) & 1;
+}
+
+inline void FernFilter::markPositiveLeaf(const int & nFern, const int & feature)
+{
+  unsigned int bit = (unsigned int)feature * 2654435761u >> (32 - FERNPOSITIVEBITS);
+  unsigned int & word = ivPositiveLeaves[(nFern << (FERNPOSITIVEBITS - 5)) + (bit >> 5)];
+  if (!((word >> (bit & 31)) & 1))
+  {
+    word |= 1u << (bit & 31);
+    ivPositiveCounts[nFern]++;
   }
-  return result;
 }
 
-inline float * FernFilter::calcConfidences(int* features) const
+/// rebuilds the positive leaf bitsets from the fern store (after loading)
+inline void FernFilter::updatePositiveLeaves()
 {
-  float * result = new float[ivNumObjects];
-  memset(result, 0, ivNumObjects * sizeof(float));
-#if USEMAP
+  ivPositiveLeaves.assign(ivNumFerns << (FERNPOSITIVEBITS - 5), 0);
+  ivPositiveCounts.assign(ivNumFerns, 0);
   for (int nFern = 0; nFern < ivNumFerns; ++nFern)
+  {
+#if USEMAP
+    if (ivFernStore == FERN_STORE_HASH)
+    {
+      const FernHashTable & table = ivFernTables[nFern];
+      for (int slot = 0; slot < table.capacity(); ++slot)
+        if (table.keyAt(slot) >= 0 && table.maxConfAt(slot) > 0)
+          markPositiveLeaf(nFern, table.keyAt(slot));
+      continue;
+    }
+    for (std::map<int, Confidences>::const_iterator it = ivFernForest[nFern].begin();
+         it != ivFernForest[nFern].end(); ++it)
+      if (it->second.maxConf > 0)
+        markPositiveLeaf(nFern, it->first);
+#else
+    for (int feature = 0; feature < calcTableSize(); ++feature)
+      if (ivMaxTable[nFern][feature] > 0)
+        markPositiveLeaf(nFern, feature);
+#endif
+  }
+  updateFernOrder();
+}
+
+/// @details Orders the ferns for the coarse filter cascade: ferns with fewer positive leaves
+///  give a background window a confidence of 0 more often, so they are evaluated first.
+inline void FernFilter::updateFernOrder()
+{
+  for (int i = 1; i < ivNumFerns; ++i)
+    for (int j = i; j > 0 && ivPositiveCounts[ivFernOrder[j]] < ivPositiveCounts[ivFernOrder[j-1]]; --j)
+      std::swap(ivFernOrder[j], ivFernOrder[j-1]);
+}
+
+/// @details Writes the confidences of all objects to @c result, which has to hold
+///  confidenceStride() values (the padding is set to zero). With the hash store the dense
+///  posterior values of a leaf are added FERN_VALUE_ALIGN objects at a time.
+inline void FernFilter::calcConfidences(const int * features, float * result) const
+{
+  memset(result, 0, confidenceStride() * sizeof(float));
+#if USEMAP
+  for (int nFern = 0; nFern < ivNumFerns && ivFernStore == FERN_STORE_HASH; ++nFern)
+  {
+    const FernHashTable & table = ivFernTables[nFern];
+    int slot = table.find(features[nFern]);
+    if (slot >= 0)
+    {
+      const float * values = table.valuesAt(slot);
+      const int stride = table.valueStride();
+#if defined(__AVX2__)
+      for (int nObject = 0; nObject < stride; nObject += 8)
+        _mm256_storeu_ps(result + nObject, _mm256_add_ps(_mm256_loadu_ps(result + nObject),
+                                                         _mm256_load_ps(values + nObject)));
+#elif defined(__SSE2__)
+      for (int nObject = 0; nObject < stride; nObject += 4)
+        _mm_storeu_ps(result + nObject, _mm_add_ps(_mm_loadu_ps(result + nObject), _mm_load_ps(values + nObject)));
+#else
+      for (int nObject = 0; nObject < stride; ++nObject)
+        result[nObject] += values[nObject];
+#endif
+    }
+  }
+  for (int nFern = 0; nFern < ivNumFerns && ivFernStore == FERN_STORE_MAP; ++nFern)
   {
     std::map<int, Confidences>::const_iterator found =
       ivFernForest[nFern].find(features[nFern]);
@@ -1185,18 +2268,55 @@ inline float * FernFilter::calcConfidences(int* features) const
       result[nObject] += table[nFern][features[nFern]];
     }
   }
+#endif
+}
+
+/// @details Returns a bitmask of the (32) confidences exceeding @c threshold.
+inline unsigned int FernFilter::confidenceMask(const float * confidences, const float & threshold) const
+{
+  unsigned int result = 0;
+#if defined(__AVX2__)
+  const __m256 t = _mm256_set1_ps(threshold);
+  for (int k = 0; k < 32; k += 8)
+    result |= (unsigned int)_mm256_movemask_ps(_mm256_cmp_ps(_mm256_loadu_ps(confidences + k), t, _CMP_GT_OQ)) << k;
+#elif defined(__SSE2__)
+  const __m128 t = _mm_set1_ps(threshold);
+  for (int k = 0; k < 32; k += 4)
+    result |= (unsigned int)_mm_movemask_ps(_mm_cmpgt_ps(_mm_loadu_ps(confidences + k), t)) << k;
+#else
+  for (int k = 0; k < 32; ++k)
+    result |= (unsigned int)(confidences[k] > threshold) << k;
 #endif
   return result;
 }
 
-inline void FernFilter::extractFeatures(FernDetection& det) const
+/// @details Computes the fern codes of a patch of size ivPatchSize x ivPatchSize using the
+///  same kind of summed area table as scanPatch()
+inline void FernFilter::extractPatchFeatures(const Matrix & patch, int * result) const
 {
-  det.featureData = extractFeatures((float*)det.featureData, ((ScanSettings*)(det.ss))->offsets);
+#if USETBBP
+  if (ivSATMode == FERN_SAT_INTEGER)
+  {
+    unsigned int * sat;
+    patch.createSummedAreaTable(sat);
+    extractFeatures(sat, ivPatchSizeOffsets, result);
+    delete[] sat;
+  }
+  else
+  {
+    float * sat;
+    patch.createSummedAreaTable(sat);
+    extractFeatures(sat, ivPatchSizeOffsets, result);
+    delete[] sat;
+  }
+#else
+  extractFeatures(patch.data(), ivPatchSizeOffsets, result);
+#endif
 }
 
-inline int * FernFilter::extractFeatures(const float * const imgOrSAT, int ** offsets) const
+template <class T>
+inline void FernFilter::extractFeatures(const T * const imgOrSAT, int ** offsets, int * result) const
 {
-  int * result = new int[ivNumFerns];
   for(int nFern = 0; nFern < ivNumFerns; ++nFern)
   {
     int * foffsets = offsets[nFern];
@@ -1225,7 +2345,199 @@ inline int * FernFilter::extractFeatures(const float * const imgOrSAT, int ** of
 #endif
     result[nFern] = fernClass;
   }
-  return result;
+}
+
+/// @details Computes the fern codes of FERNBATCHSIZE horizontally adjacent windows whose top left
+///  corners start at @c sat in the summed area table (written to @c results with stride
+///  ivNumFerns). The result equals extractFeatures() for each window (areas are computed in
+///  float with the same order of operations as summedTableArea()). The four areas of a feature
+///  share four of their corners, so only 12 values are loaded.
+inline void FernFilter::extractFeatureBatch(const float * const sat, int ** offsets, int * results) const
+{
+#if USETBBP && (defined(__AVX2__) || defined(__SSE2__))
+  for (int nFern = 0; nFern < ivNumFerns; ++nFern)
+  {
+    const int * foffsets = offsets[nFern];
+#if defined(__AVX2__)
+    __m256i fernClass = _mm256_setzero_si256();
+    const __m256i one = _mm256_set1_epi32(1), two = _mm256_set1_epi32(2);
+    #define FERN_LOAD(o) _mm256_loadu_ps(sat + (o))
+    #define FERN_AREA(a, b, c, d) _mm256_add_ps(_mm256_sub_ps(_mm256_sub_ps(a, b), c), d)
+#else
+    __m128i fernClass[2] = {_mm_setzero_si128(), _mm_setzero_si128()};
+    const __m128i one = _mm_set1_epi32(1), two = _mm_set1_epi32(2);
+    #define FERN_LOAD(o) _mm_loadu_ps(sat + (o) + h)
+    #define FERN_AREA(a, b, c, d) _mm_add_ps(_mm_sub_ps(_mm_sub_ps(a, b), c), d)
+#endif
+    for (int nFeature = 0; nFeature < ivFeaturesPerFern; ++nFeature)
+    {
+      const int * fo = foffsets + 16 * nFeature;
+#if defined(__AVX2__)
+      // shared corners: left[2] == bottom[2], left[3] == top[3], right[0] == bottom[0], right[1] == top[1]
+      __m256 t0 = FERN_LOAD(fo[0]), t1 = FERN_LOAD(fo[1]), t2 = FERN_LOAD(fo[2]), t3 = FERN_LOAD(fo[3]);
+      __m256 b0 = FERN_LOAD(fo[4]), b1 = FERN_LOAD(fo[5]), b2 = FERN_LOAD(fo[6]), b3 = FERN_LOAD(fo[7]);
+      __m256 l0 = FERN_LOAD(fo[8]), l1 = FERN_LOAD(fo[9]);
+      __m256 r2 = FERN_LOAD(fo[14]), r3 = FERN_LOAD(fo[15]);
+      __m256i vf = _mm256_castps_si256(_mm256_cmp_ps(FERN_AREA(t0, t1, t2, t3), FERN_AREA(b0, b1, b2, b3), _CMP_LT_OQ));
+      __m256i hf = _mm256_castps_si256(_mm256_cmp_ps(FERN_AREA(l0, l1, b2, t3), FERN_AREA(b0, t1, r2, r3), _CMP_LT_OQ));
+      fernClass = _mm256_or_si256(_mm256_slli_epi32(fernClass, 2),
+                                  _mm256_or_si256(_mm256_and_si256(vf, two), _mm256_and_si256(hf, one)));
+#else
+      for (int q = 0; q < 2; ++q)
+      {
+        const int h = 4 * q;
+        __m128 t0 = FERN_LOAD(fo[0]), t1 = FERN_LOAD(fo[1]), t2 = FERN_LOAD(fo[2]), t3 = FERN_LOAD(fo[3]);
+        __m128 b0 = FERN_LOAD(fo[4]), b1 = FERN_LOAD(fo[5]), b2 = FERN_LOAD(fo[6]), b3 = FERN_LOAD(fo[7]);
+        __m128 l0 = FERN_LOAD(fo[8]), l1 = FERN_LOAD(fo[9]);
+        __m128 r2 = FERN_LOAD(fo[14]), r3 = FERN_LOAD(fo[15]);
+        __m128i vf = _mm_castps_si128(_mm_cmplt_ps(FERN_AREA(t0, t1, t2, t3), FERN_AREA(b0, b1, b2, b3)));
+        __m128i hf = _mm_castps_si128(_mm_cmplt_ps(FERN_AREA(l0, l1, b2, t3), FERN_AREA(b0, t1, r2, r3)));
+        fernClass[q] = _mm_or_si128(_mm_slli_epi32(fernClass[q], 2),
+                                    _mm_or_si128(_mm_and_si128(vf, two), _mm_and_si128(hf, one)));
+      }
+#endif
+    }
+    #undef FERN_LOAD
+    #undef FERN_AREA
+    int codes[FERNBATCHSIZE];
+#if defined(__AVX2__)
+    _mm256_storeu_si256((__m256i*)codes, fernClass);
+#else
+    _mm_storeu_si128((__m128i*)codes, fernClass[0]);
+    _mm_storeu_si128((__m128i*)(codes + 4), fernClass[1]);
+#endif
+    for (int k = 0; k < FERNBATCHSIZE; ++k)
+      results[k * ivNumFerns + nFern] = codes[k];
+  }
+#else
+  for (int k = 0; k < FERNBATCHSIZE; ++k)
+    extractFeatures(sat + k, offsets, results + k * ivNumFerns);
+#endif
+}
+
+/// @details Integer version of extractFeatureBatch(), areas are exact (see Matrix::createSummedAreaTable2())
+inline void FernFilter::extractFeatureBatch(const unsigned int * const sat, int ** offsets, int * results) const
+{
+#if USETBBP && (defined(__AVX2__) || defined(__SSE2__))
+  for (int nFern = 0; nFern < ivNumFerns; ++nFern)
+  {
+    const int * foffsets = offsets[nFern];
+    int codes[FERNBATCHSIZE];
+#if defined(__AVX2__)
+    __m256i fernClass = _mm256_setzero_si256();
+    const __m256i one = _mm256_set1_epi32(1), two = _mm256_set1_epi32(2);
+    #define FERN_LOAD(o) _mm256_loadu_si256((const __m256i*)(sat + (o)))
+    #define FERN_AREA(a, b, c, d) _mm256_add_epi32(_mm256_sub_epi32(_mm256_sub_epi32(a, b), c), d)
+    for (int nFeature = 0; nFeature < ivFeaturesPerFern; ++nFeature)
+    {
+      const int * fo = foffsets + 16 * nFeature;
+      // shared corners: left[2] == bottom[2], left[3] == top[3], right[0] == bottom[0], right[1] == top[1]
+      __m256i t0 = FERN_LOAD(fo[0]), t1 = FERN_LOAD(fo[1]), t2 = FERN_LOAD(fo[2]), t3 = FERN_LOAD(fo[3]);
+      __m256i b0 = FERN_LOAD(fo[4]), b1 = FERN_LOAD(fo[5]), b2 = FERN_LOAD(fo[6]), b3 = FERN_LOAD(fo[7]);
+      __m256i l0 = FERN_LOAD(fo[8]), l1 = FERN_LOAD(fo[9]);
+      __m256i r2 = FERN_LOAD(fo[14]), r3 = FERN_LOAD(fo[15]);
+      // areas are below 2^31, so the signed comparison is correct
+      __m256i vf = _mm256_cmpgt_epi32(FERN_AREA(b0, b1, b2, b3), FERN_AREA(t0, t1, t2, t3));
+      __m256i hf = _mm256_cmpgt_epi32(FERN_AREA(b0, t1, r2, r3), FERN_AREA(l0, l1, b2, t3));
+      fernClass = _mm256_or_si256(_mm256_slli_epi32(fernClass, 2),
+                                  _mm256_or_si256(_mm256_and_si256(vf, two), _mm256_and_si256(hf, one)));
+    }
+    _mm256_storeu_si256((__m256i*)codes, fernClass);
+#else
+    const __m128i one = _mm_set1_epi32(1), two = _mm_set1_epi32(2);
+    #define FERN_LOAD(o) _mm_loadu_si128((const __m128i*)(sat + (o) + h))
+    #define FERN_AREA(a, b, c, d) _mm_add_epi32(_mm_sub_epi32(_mm_sub_epi32(a, b), c), d)
+    for (int h = 0; h < FERNBATCHSIZE; h += 4)
+    {
+      __m128i fernClass = _mm_setzero_si128();
+      for (int nFeature = 0; nFeature < ivFeaturesPerFern; ++nFeature)
+      {
+        const int * fo = foffsets + 16 * nFeature;
+        __m128i t0 = FERN_LOAD(fo[0]), t1 = FERN_LOAD(fo[1]), t2 = FERN_LOAD(fo[2]), t3 = FERN_LOAD(fo[3]);
+        __m128i b0 = FERN_LOAD(fo[4]), b1 = FERN_LOAD(fo[5]), b2 = FERN_LOAD(fo[6]), b3 = FERN_LOAD(fo[7]);
+        __m128i l0 = FERN_LOAD(fo[8]), l1 = FERN_LOAD(fo[9]);
+        __m128i r2 = FERN_LOAD(fo[14]), r3 = FERN_LOAD(fo[15]);
+        __m128i vf = _mm_cmpgt_epi32(FERN_AREA(b0, b1, b2, b3), FERN_AREA(t0, t1, t2, t3));
+        __m128i hf = _mm_cmpgt_epi32(FERN_AREA(b0, t1, r2, r3), FERN_AREA(l0, l1, b2, t3));
+        fernClass = _mm_or_si128(_mm_slli_epi32(fernClass, 2),
+                                 _mm_or_si128(_mm_and_si128(vf, two), _mm_and_si128(hf, one)));
+      }
+      _mm_storeu_si128((__m128i*)(codes + h), fernClass);
+    }
+#endif
+    #undef FERN_LOAD
+    #undef FERN_AREA
+    for (int k = 0; k < FERNBATCHSIZE; ++k)
+      results[k * ivNumFerns + nFern] = codes[k];
+  }
+#else
+  for (int k = 0; k < FERNBATCHSIZE; ++k)
+    extractFeatures(sat + k, offsets, results + k * ivNumFerns);
+#endif
+}
+
+/// @details Computes the fern codes of FERNBATCHSIZE arbitrary windows of one scale (@c windows
+///  holds their positions in @c sat) using AVX2 gather instructions (scalar without AVX2).
+inline void FernFilter::extractFeatureGather(const unsigned int * const sat, int ** offsets,
+                                             const int * windows, int * results) const
+{
+#if defined(__AVX2__)
+  const __m256i base = _mm256_loadu_si256((const __m256i*)windows);
+  const __m256i one = _mm256_set1_epi32(1), two = _mm256_set1_epi32(2);
+  #define FERN_LOAD(o) _mm256_i32gather_epi32((const int*)sat, _mm256_add_epi32(base, _mm256_set1_epi32(o)), 4)
+  #define FERN_AREA(a, b, c, d) _mm256_add_epi32(_mm256_sub_epi32(_mm256_sub_epi32(a, b), c), d)
+  for (int nFern = 0; nFern < ivNumFerns; ++nFern)
+  {
+    const int * foffsets = offsets[nFern];
+    __m256i fernClass = _mm256_setzero_si256();
+    for (int nFeature = 0; nFeature < ivFeaturesPerFern; ++nFeature)
+    {
+      const int * fo = foffsets + 16 * nFeature;
+      __m256i t0 = FERN_LOAD(fo[0]), t1 = FERN_LOAD(fo[1]), t2 = FERN_LOAD(fo[2]), t3 = FERN_LOAD(fo[3]);
+      __m256i b0 = FERN_LOAD(fo[4]), b1 = FERN_LOAD(fo[5]), b2 = FERN_LOAD(fo[6]), b3 = FERN_LOAD(fo[7]);
+      __m256i l0 = FERN_LOAD(fo[8]), l1 = FERN_LOAD(fo[9]);
+      __m256i r2 = FERN_LOAD(fo[14]), r3 = FERN_LOAD(fo[15]);
+      __m256i vf = _mm256_cmpgt_epi32(FERN_AREA(b0, b1, b2, b3), FERN_AREA(t0, t1, t2, t3));
+      __m256i hf = _mm256_cmpgt_epi32(FERN_AREA(b0, t1, r2, r3), FERN_AREA(l0, l1, b2, t3));
+      fernClass = _mm256_or_si256(_mm256_slli_epi32(fernClass, 2),
+                                  _mm256_or_si256(_mm256_and_si256(vf, two), _mm256_and_si256(hf, one)));
+    }
+    int codes[FERNBATCHSIZE];
+    _mm256_storeu_si256((__m256i*)codes, fernClass);
+    for (int k = 0; k < FERNBATCHSIZE; ++k)
+      results[k * ivNumFerns + nFern] = codes[k];
+  }
+  #undef FERN_LOAD
+  #undef FERN_AREA
+#else
+  for (int k = 0; k < FERNBATCHSIZE; ++k)
+    extractFeatures(sat + windows[k], offsets, results + k * ivNumFerns);
+#endif
+}
+
+/// @details Computes the fern codes of @c count <= FERNBATCHSIZE arbitrary windows (@c windows holds
+///  FERNBATCHSIZE positions in @c sat, padded by repetition), gathered for integer tables if
+///  possible (then codes of FERNBATCHSIZE windows are written, unless @c count is 1) and one by one
+///  otherwise.
+inline void FernFilter::extractFeatureWindows(const float * const sat, int ** offsets, const int * windows,
+                                              const int & count, int * results) const
+{
+  for (int k = 0; k < count; ++k)
+    extractFeatures(sat + windows[k], offsets, results + k * ivNumFerns);
+}
+
+inline void FernFilter::extractFeatureWindows(const unsigned int * const sat, int ** offsets, const int * windows,
+                                              const int & count, int * results) const
+{
+#if defined(__AVX2__)
+  if (count == 1)
+    extractFeatures(sat + windows[0], offsets, results); // a gather of 8 windows does not pay off
+  else
+    extractFeatureGather(sat, offsets, windows, results);
+#else
+  for (int k = 0; k < count; ++k)
+    extractFeatures(sat + windows[k], offsets, results + k * ivNumFerns);
+#endif
 }
 
 inline void FernFilter::addPatch(const int & objId, const int * const featureData, const bool & pos)
@@ -1239,7 +2551,39 @@ inline void FernFilter::addPatch(const int & objId, const int * const featureDat
   {
     // TODO: nFern ausgliedern?
     int feature = featureData[nFern];
+    if (pos)
+      markPositiveLeaf(nFern, feature);
 #if USEMAP
+    if (ivFernStore == FERN_STORE_HASH)
+    {
+      FernHashTable & table = ivFernTables[nFern];
+      int slot = table.insert(feature);
+      Posteriors * posteriors = table.posteriorsAt(slot);
+      Posteriors & found = posteriors[objId];
+      if (found.n + found.p > 0)
+      {
+        bool isPos = found.p >= CONFIDENCETHRESHOLD;
+        if (pos != isPos)
+        {
+          (pos ? found.p : found.n) += 1;
+          found.posterior = (float)found.p / (found.p + found.n);
+          table.valuesAt(slot)[objId] = found.posterior;
+          float & maxConf = table.maxConfAt(slot);
+          maxConf = 0;
+          for (int nObject = 0; nObject < table.numObjects(); ++nObject)
+            maxConf = MAX(maxConf, posteriors[nObject].posterior);
+        }
+      }
+      else
+      {
+        found.n = pos ? 0 : 1;
+        found.p = pos ? 1 : 0;
+        found.posterior = pos ? 1.f : 0.f;
+        table.valuesAt(slot)[objId] = found.posterior;
+        table.maxConfAt(slot) = MAX(table.maxConfAt(slot), found.posterior);
+      }
+      continue;
+    }
     std::map<int, Confidences>::iterator found =
         ivFernForest[nFern].find(feature);
     if (found != ivFernForest[nFern].end())
@@ -1296,115 +2640,261 @@ inline void FernFilter::addPatch(const int & objId, const int * const featureDat
 
 inline void FernFilter::addPatch(const Matrix& scaledImage, const int& objId, const bool& pos)
 {
-#if USETBBP
-  float * sat = scaledImage.createSummedAreaTable();
-  int * features = extractFeatures(sat, ivPatchSizeOffsets);
-  delete[] sat;
-#else
-  int * features = extractFeatures(scaledImage.data(), ivPatchSizeOffsets);
-#endif
-  addPatch(objId, features, pos);
-  delete[] features;
+  std::vector<int> features(ivNumFerns);
+  extractPatchFeatures(scaledImage, &features[0]);
+  addPatch(objId, &features[0], pos);
 }
 
-inline void FernFilter::addPatchWithWarps(const Matrix& image, const ObjectBox& box, const WarpSettings& ws,
-                                          std::vector<Matrix> & op, const bool& pos, const bool& notOnlyVar)
+/// @details Learns the patches of several boxes including two default warps and ws.num_warps
+///  random affine warps per box. The random warp parameters are drawn first (in the same order
+///  as a serial implementation would draw them). Then for each box only the region that the
+///  warps can reach is cropped from the image (already scaled such that the box becomes a patch),
+///  all warps are sampled from this crop directly into patch sized buffers (see warpPatch()) and
+///  the features of all patches are extracted in one batch. Cropping, warping and feature
+///  extraction run in parallel and do not depend on the size of the image. Finally the
+///  posteriors are updated serially in box and warp order, so the result does not depend on
+///  the number of threads.
+inline void FernFilter::addPatchesWithWarps(const Matrix& image, const std::vector<ObjectBox>& boxes,
+                                            const WarpSettings& ws, std::vector<Matrix> & op,
+                                            const bool& pos, const bool& notOnlyVar)
 {
-  float factX = box.width / ivPatchSize;
-  float factY = box.height / ivPatchSize;
-  float width = image.xSize() / factX;
-  float height = image.ySize() / factY;
-
-  Matrix scaled = image; scaled.rescale(round(width), round(height));
-  ObjectBox newB = {box.x / factX, box.y / factY, (float)ivPatchSize, (float)ivPatchSize};
-  newB.objectId = box.objectId;
+  const int nBoxes = boxes.size();
+  // per box: the patch itself, two default warps and the random warps
+  const int nPatches = notOnlyVar ? 3 + ws.num_warps : 1;
+  const int nPixels = ivPatchSize * ivPatchSize;
+  if (nBoxes == 0)
+    return;
 
-  Matrix pt(box.width,box.height);
-  pt.copyFromFloatArray(scaled.data(), width, height, round(newB.x), round(newB.y), round(newB.width), round(newB.height));
-  pt.rescale(ivPatchSize,ivPatchSize);
+  // warp parameters (angle, scale, shift x, shift y), default warps first
+  std::vector<float> params(nBoxes * (nPatches - 1) * 4);
+  for (int b = 0; b < nBoxes; ++b)
+    for (int i = 1; i < nPatches; ++i)
+    {
+      float * param = &params[(b * (nPatches - 1) + i - 1) * 4];
+      if (i <= 2)
+      {
+        param[0] = i == 1 ? 0.2 : -0.2;
+        param[1] = 1;
+        param[2] = param[3] = 0;
+        continue;
+      }
+      param[0] = (PI / 180) * ws.angle * ivRandom.randFloat(-0.5, 0.5);
+      param[1] = 1 - ws.scale * ivRandom.randFloat(-0.5, 0.5);
+      param[2] = ws.shift * ivPatchSize * ivRandom.randFloat(-0.5, 0.5);
+      param[3] = ws.shift * ivPatchSize * ivRandom.randFloat(-0.5, 0.5);
+    }
 
-  float ** sats = pt.createSummedAreaTable2();
-  const int index = (ivPatchSize+1)*(ivPatchSize+1)-1;
-  const int nPixels = ivPatchSize * ivPatchSize;
-  const float ex2 = sats[1][index] / nPixels;
-  const float ex = sats[0][index] / nPixels;
-  const float exex = ex * ex;
-  const float variance = ex2 - exex;
+  std::vector<Matrix> crops(nBoxes);
+  std::vector<float> centers(2 * nBoxes);
+  std::vector<float> variances(nBoxes);
+  float * patches = alignedNew<float>(nBoxes * nPatches * nPixels);
+  std::vector<int> codes(nBoxes * nPatches * ivNumFerns);
 
-  ivMinVariances[box.objectId] = MIN(ivMinVariances[box.objectId], variance);
-  ivVarianceThreshold = MIN(ivVarianceThreshold, variance);
+#pragma omp parallel
+{
+  // crop the region reachable by the warps from the scaled image, copy the patch itself
+#pragma omp for schedule(dynamic)
+  for (int b = 0; b < nBoxes; ++b)
+  {
+    const ObjectBox & box = boxes[b];
+    float factX = box.width / ivPatchSize;
+    float factY = box.height / ivPatchSize;
+    const int width = round(image.xSize() / factX);
+    const int height = round(image.ySize() / factY);
+    const float cx = box.x / factX + 0.5 * (ivPatchSize - 1);
+    const float cy = box.y / factY + 0.5 * (ivPatchSize - 1);
+
+    // a warped pixel is at most radius pixels away from the center (plus one for interpolation)
+    float radius = 0.5 * (ivPatchSize - 1);
+    for (int i = 1; i < nPatches; ++i)
+    {
+      const float * param = &params[(b * (nPatches - 1) + i - 1) * 4];
+      radius = MAX(radius, 0.5 * (ivPatchSize - 1) * sqrt(2.) / param[1] + fabs(param[2]) + fabs(param[3]));
+    }
+    const int x1 = MAX(0, (int)floor(cx - radius) - 1), x2 = MIN(width - 1, (int)ceil(cx + radius) + 1);
+    const int y1 = MAX(0, (int)floor(cy - radius) - 1), y2 = MIN(height - 1, (int)ceil(cy + radius) + 1);
+    image.rescaleRegion(crops[b], width, height, x1, y1, x2 - x1 + 1, y2 - y1 + 1);
+    centers[2 * b] = cx - x1;
+    centers[2 * b + 1] = cy - y1;
+
+    const Matrix & crop = crops[b];
+    const int px = round(box.x / factX) - x1, py = round(box.y / factY) - y1;
+    float * patch = patches + b * nPatches * nPixels;
+    float sum = 0, sum2 = 0;
+    for (int dy = 0; dy < ivPatchSize; ++dy)
+      for (int dx = 0; dx < ivPatchSize; ++dx)
+      {
+        const float value = crop(MAX(0, MIN(crop.xSize() - 1, px + dx)), MAX(0, MIN(crop.ySize() - 1, py + dy)));
+        patch[dy * ivPatchSize + dx] = value;
+        sum += value;
+        sum2 += value * value;
+      }
+    const float ex2 = sum2 / nPixels;
+    const float ex = sum / nPixels;
+    variances[b] = ex2 - ex * ex;
+  }
 
   if (notOnlyVar)
   {
+    // warp the patches
+#pragma omp for schedule(dynamic)
+    for (int t = 0; t < nBoxes * (nPatches - 1); ++t)
+    {
+      const int b = t / (nPatches - 1), i = t % (nPatches - 1) + 1;
+      warpPatch(crops[b], centers[2 * b], centers[2 * b + 1], &params[t * 4],
+                patches + (b * nPatches + i) * nPixels);
+    }
+
+    // extract the features of all patches
+#if USETBBP
+    unsigned int * isat = ivSATMode == FERN_SAT_INTEGER ? new unsigned int[(ivPatchSize+1)*(ivPatchSize+1)] : NULL;
+    float * fsat = ivSATMode == FERN_SAT_INTEGER ? NULL : new float[(ivPatchSize+1)*(ivPatchSize+1)];
+#endif
+#pragma omp for schedule(static)
+    for (int p = 0; p < nBoxes * nPatches; ++p)
+    {
 #if USETBBP
-    float * img = sats[0];
+      if (isat != NULL)
+      {
+        patchSummedAreaTable(patches + p * nPixels, isat);
+        extractFeatures(isat, ivPatchSizeOffsets, &codes[p * ivNumFerns]);
+      }
+      else
+      {
+        patchSummedAreaTable(patches + p * nPixels, fsat);
+        extractFeatures(fsat, ivPatchSizeOffsets, &codes[p * ivNumFerns]);
+      }
 #else
-    float * img = pt.data();
+      extractFeatures(patches + p * nPixels, ivPatchSizeOffsets, &codes[p * ivNumFerns]);
 #endif
-    const int * data = extractFeatures(img, ivPatchSizeOffsets);
-    addPatch(box.objectId, data, pos);
-    addWarpedPatches(scaled, newB, ws, op, pos);
-    delete[] data;
-  }
-
-  delete[] sats[0];
-  delete[] sats[1];
-  delete[] sats;
-}
-
-inline void FernFilter::addWarpedPatches(const Matrix& image, const ObjectBox& box, const WarpSettings& ws,
-                                         std::vector<Matrix> & op, const bool& pos)
-{
-
-  // Default Warps!
-  Matrix defWl = Matrix::createWarpMatrix( 0.2, 1);
-  //Matrix defWn = createWarpMatrix(   0, 1);
-  Matrix defWr = Matrix::createWarpMatrix(-0.2, 1);
-
-  Matrix imgWarpL = image.affineWarp(defWl, box, false);
-  //Matrix imgWarpN = image.affineWarp(defWn, box, false);
-  Matrix imgWarpR = image.affineWarp(defWr, box, false);
-
-  /* DEBUGGING - print affine warps
-  static int x = 0;
-  char filenameL[255];
-  char filenameN[255];
-  char filenameR[255];
-  sprintf(filenameL, "output/warped_pic%03d_obj%d_l.pgm",x, box.objectId);
-  sprintf(filenameN, "output/warped_pic%03d_obj%d_n.pgm",x, box.objectId);
-  sprintf(filenameR, "output/warped_pic%03d_obj%d_r.pgm",x, box.objectId);
-  imgWarpL.writeToPGM(filenameL);
-  imgWarpN.writeToPGM(filenameN);
-  imgWarpR.writeToPGM(filenameR);
-  ++x;
-  */
-
-
-  imgWarpL.rescale(ivPatchSize, ivPatchSize);
-  imgWarpR.rescale(ivPatchSize, ivPatchSize);
-  addPatch(imgWarpL, box.objectId, pos);
-  addPatch(imgWarpR, box.objectId, pos);
-  op.push_back(imgWarpL);
-  op.push_back(imgWarpR);
+    }
+#if USETBBP
+    delete[] isat;
+    delete[] fsat;
+#endif
+  }
+}
 
-  for (int i = 0; i < ws.num_warps; ++i)
+  // update variances and posteriors in box / warp order
+  for (int b = 0; b < nBoxes; ++b)
   {
-    float angle = (PI / 180) * ws.angle * randFloat(-0.5, 0.5);
-    float scale = 1 - ws.scale * randFloat(-0.5, 0.5);
-    Matrix warpMatrix = Matrix::createWarpMatrix(angle, scale);
-
-    float shX = ws.shift * box.width * randFloat(-0.5, 0.5);
-    float shY = ws.shift * box.height * randFloat(-0.5, 0.5);
-    ObjectBox shiftedBox = {box.x + shX, box.y + shY, box.width, box.height};
+    const int objId = boxes[b].objectId;
+    ivMinVariances[objId] = MIN(ivMinVariances[objId], variances[b]);
+    ivVarianceThreshold = MIN(ivVarianceThreshold, variances[b]);
+    if (!notOnlyVar)
+      continue;
+    for (int i = 0; i < nPatches; ++i)
+      addPatch(objId, &codes[(b * nPatches + i) * ivNumFerns], pos);
+    for (int i = 1; i <= 2; ++i)
+    {
+      Matrix warped;
+      warped.copyFromFloatArray(patches + (b * nPatches + i) * nPixels, ivPatchSize, ivPatchSize, ivPatchSize);
+      op.push_back(warped);
+    }
+  }
+  alignedDelete(patches);
+}
 
-    Matrix warped = image.affineWarp(warpMatrix, shiftedBox, true);
+/// @details Samples a patch of size ivPatchSize x ivPatchSize centered at (cx, cy) from crop,
+///  rotated by param[0], scaled by param[1] and shifted by (param[2], param[3]), with bilinear
+///  interpolation (the same mapping as Matrix::affineWarp() with Matrix::createWarpMatrix()).
+///  Coordinates outside of crop are clamped to its border. With AVX2 eight pixels of a row are
+///  sampled at once.
+inline void FernFilter::warpPatch(const Matrix & crop, const float & cx, const float & cy, const float * param,
+                                  float * result) const
+{
+  // inverse transformation: patch offset from the center -> crop coordinates
+  const float ca = cos(param[0]) / param[1];
+  const float sa = sin(param[0]) / param[1];
+  const float half = 0.5 * (ivPatchSize - 1);
+  const float u0 = cx + param[2] - ca * half + sa * half;
+  const float v0 = cy + param[3] - sa * half - ca * half;
+  const int width = crop.xSize(), height = crop.ySize();
+  const float maxX = width - 1, maxY = height - 1;
+  const float * data = crop.data();
+  for (int dy = 0; dy < ivPatchSize; ++dy)
+  {
+    const float uRow = u0 - sa * dy;
+    const float vRow = v0 + ca * dy;
+    float * row = result + dy * ivPatchSize;
+    int dx = 0;
+#if defined(__AVX2__)
+    const __m256i ramp = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+    const __m256 zero = _mm256_setzero_ps(), one = _mm256_set1_ps(1);
+    const __m256i lastX = _mm256_set1_epi32(width - 1), lastY = _mm256_set1_epi32(height - 1);
+    const __m256i stride = _mm256_set1_epi32(width);
+    for (; dx < ivPatchSize; dx += 8)
+    {
+      const __m256 x = _mm256_cvtepi32_ps(_mm256_add_epi32(_mm256_set1_epi32(dx), ramp));
+      __m256 u = _mm256_add_ps(_mm256_set1_ps(uRow), _mm256_mul_ps(_mm256_set1_ps(ca), x));
+      __m256 v = _mm256_add_ps(_mm256_set1_ps(vRow), _mm256_mul_ps(_mm256_set1_ps(sa), x));
+      u = _mm256_min_ps(_mm256_max_ps(u, zero), _mm256_set1_ps(maxX));
+      v = _mm256_min_ps(_mm256_max_ps(v, zero), _mm256_set1_ps(maxY));
+      const __m256i ix1 = _mm256_cvttps_epi32(u), iy1 = _mm256_cvttps_epi32(v);
+      const __m256 ax = _mm256_sub_ps(u, _mm256_cvtepi32_ps(ix1));
+      const __m256 ay = _mm256_sub_ps(v, _mm256_cvtepi32_ps(iy1));
+      const __m256i ix2 = _mm256_min_epi32(_mm256_add_epi32(ix1, _mm256_set1_epi32(1)), lastX);
+      const __m256i iy2 = _mm256_min_epi32(_mm256_add_epi32(iy1, _mm256_set1_epi32(1)), lastY);
+      const __m256i o1 = _mm256_mullo_epi32(iy1, stride), o2 = _mm256_mullo_epi32(iy2, stride);
+      const __m256 p11 = _mm256_i32gather_ps(data, _mm256_add_epi32(o1, ix1), 4);
+      const __m256 p12 = _mm256_i32gather_ps(data, _mm256_add_epi32(o2, ix1), 4);
+      const __m256 p21 = _mm256_i32gather_ps(data, _mm256_add_epi32(o1, ix2), 4);
+      const __m256 p22 = _mm256_i32gather_ps(data, _mm256_add_epi32(o2, ix2), 4);
+      const __m256 ay1 = _mm256_sub_ps(one, ay);
+      const __m256 left = _mm256_add_ps(_mm256_mul_ps(ay1, p11), _mm256_mul_ps(ay, p12));
+      const __m256 right = _mm256_add_ps(_mm256_mul_ps(ay1, p21), _mm256_mul_ps(ay, p22));
+      const __m256 value = _mm256_add_ps(_mm256_mul_ps(_mm256_sub_ps(one, ax), left), _mm256_mul_ps(ax, right));
+      const __m256i mask = _mm256_cmpgt_epi32(_mm256_set1_epi32(ivPatchSize - dx), ramp);
+      _mm256_maskstore_ps(row + dx, mask, value);
+    }
+#endif
+    for (; dx < ivPatchSize; ++dx)
+    {
+      const float u = MAX(0, MIN(maxX, uRow + ca * (float)dx));
+      const float v = MAX(0, MIN(maxY, vRow + sa * (float)dx));
+      const int x1 = (int)u, y1 = (int)v;
+      const int x2 = MIN(x1 + 1, width - 1), y2 = MIN(y1 + 1, height - 1);
+      const float ax = u - x1, ay = v - y1;
+      row[dx] = (1 - ax) * ((1 - ay) * data[y1 * width + x1] + ay * data[y2 * width + x1])
+                    + ax * ((1 - ay) * data[y1 * width + x2] + ay * data[y2 * width + x2]);
+    }
+  }
+}
 
-    /*char filename[255];
-    sprintf(filename, "output/warped2_pic%03d_obj%d_%d.pgm", x, box.objectId, i);
-    warped.writeToPGM(filename);*/
+/// @details Summed area table of a patch of size ivPatchSize x ivPatchSize (same values as
+///  Matrix::createSummedAreaTable(), but into a preallocated buffer)
+inline void FernFilter::patchSummedAreaTable(const float * patch, float * sat) const
+{
+  const int width = ivPatchSize + 1;
+  for (int x = 0; x < width; ++x)
+    sat[x] = 0;
+  for (int y = 1; y < width; ++y)
+  {
+    const int yoffset = y * width;
+    sat[yoffset] = 0;
+    for (int x = 1; x < width; ++x)
+    {
+      const int offset = yoffset + x;
+      sat[offset] = *patch++ + sat[offset-1] + sat[offset-width] - sat[offset-width-1];
+    }
+  }
+}
 
-    warped.rescale(ivPatchSize,ivPatchSize);
-    addPatch(warped, box.objectId, pos);
+/// @details Integer version (values rounded to the nearest integer)
+inline void FernFilter::patchSummedAreaTable(const float * patch, unsigned int * sat) const
+{
+  const int width = ivPatchSize + 1;
+  memset(sat, 0, width * sizeof(unsigned int));
+  for (int y = 1; y < width; ++y)
+  {
+    unsigned int * row = sat + y * width;
+    unsigned int sum = 0;
+    row[0] = 0;
+    for (int x = 1; x < width; ++x)
+    {
+      sum += (unsigned int)(*patch++ + 0.5f);
+      row[x] = row[x - width] + sum;
+    }
   }
 }
 
@@ -1417,12 +2907,43 @@ inline void FernFilter::clearLastDetections() const
   ivLastDetections.clear();
 }
 
-inline FernDetection FernFilter::copyFernDetection(const FernDetection & fd) const
+int FernFilter::getScale(const ObjectBox & box) const
 {
-  FernDetection result = fd;
-  result.featureData = new int[ivNumFerns];
-  memcpy(result.featureData, fd.featureData, ivNumFerns*sizeof(int));
+  int result = 0;
+  float bestDiff = -1;
+  int begin = 0, end = ivScans.size();
+  if (box.objectId >= 0 && box.objectId < (int)ivObjectGroups.size())
+    getGroupScales(ivObjectGroups[box.objectId], begin, end);
+  if (begin == end)
+  {
+    begin = 0;
+    end = ivScans.size();
+  }
+  for (int i = begin; i < end; ++i)
+  {
+    float diff = fabs(log(ivScans[i].boxw / box.width));
+    if (bestDiff < 0 || diff < bestDiff)
+    {
+      bestDiff = diff;
+      result = i;
+    }
+  }
   return result;
 }
 
+int FernFilter::getNumWindows(const int & scale) const
+{
+  const ScanSettings & ss = ivScans[scale];
+  if (ivScanMode == FERN_SCAN_INTEGRAL && USETBBP)
+    return ss.fullRight * ss.fullBottom;
+  return (ss.width - ivPatchSizeMinusOne) * (ss.height - ivPatchSizeMinusOne);
+}
+
+inline ObjectBox FernFilter::candidateBox(const int & scale, const int & x, const int & y) const
+{
+  const ScanSettings & ss = ivScans[scale];
+  ObjectBox box = {x*ss.pixw, y*ss.pixh, ss.boxw, ss.boxh, 0, boost::circular_buffer<CvPoint>(CB_LEN)};
+  return box;
+}
+
 #endif //FERNCLASSIFIER_H
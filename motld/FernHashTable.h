@@ -0,0 +1,312 @@
+/* Copyright (C) 2012 Christian Lutz, Thorsten Engesser
+ *
+ * This file is part of motld
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef FERNHASHTABLE_H
+#define FERNHASHTABLE_H
+
+#include <cstring>
+#include "Utils.h"
+
+/// number of leaves stored in one (cache line sized) bucket
+#define FERN_BUCKET_SLOTS 8
+/// the dense posteriors of a slot are padded to a multiple of this number of objects
+#define FERN_VALUE_ALIGN 8
+/// the table is enlarged as soon as more than 3/4 of all slots are used
+#define FERN_MAX_LOAD_NUM 3
+#define FERN_MAX_LOAD_DEN 4
+
+/// posterior counts of a single object within a fern leaf
+struct FernPosteriors
+{
+  /// number of negative examples
+  int n;
+  /// number of positive examples
+  int p;
+  /// p / (n + p)
+  float posterior;
+};
+
+/** @brief Open addressing hash table storing the leaves of a single fern.
+ * @details Leaves are addressed by their fern code. Keys and maximum confidences of 8 leaves share
+ *  a single cache line, so the coarse filter (maxConf()) usually touches only one line per fern.
+ *  The posteriors of all objects are stored inline in one flat array with a fixed stride of
+ *  numObjects() entries per slot. A leaf does not exist for an object as long as n + p == 0.
+ *  Additionally the posterior values are kept densely (valueStride() floats per slot, zero padded),
+ *  so the confidences of all objects can be accumulated with vector instructions.
+ */
+class FernHashTable
+{
+public:
+  /// Constructor (empty table without objects)
+  FernHashTable();
+  /// Copy constructor
+  FernHashTable(const FernHashTable & other);
+  /// Destructor
+  ~FernHashTable();
+  /// Copy operator
+  FernHashTable& operator=(const FernHashTable & other);
+
+  /// Adds a new object (i.e. widens the posterior stride by one)
+  void addObject();
+  /// Returns the slot of the leaf with the given code or -1 if it does not exist
+  inline int find(const int key) const;
+  /// Returns the slot of the leaf with the given code, creates it if necessary
+  int insert(const int key);
+  /// Returns the maximum confidence of the leaf with the given code (0 if it does not exist)
+  inline float maxConf(const int key) const;
+  /// Gives access to the maximum confidence stored in a slot
+  inline float & maxConfAt(const int slot) const;
+  /// Gives access to the posteriors (one per object) stored in a slot
+  inline FernPosteriors * posteriorsAt(const int slot) const;
+  ///@brief Gives access to the dense posterior values (valueStride() per slot) stored in a slot.
+  /// They have to be kept equal to posteriorsAt(slot)[i].posterior (see updateValues()).
+  inline float * valuesAt(const int slot) const;
+  /// Copies all posteriors into the dense posterior values
+  void updateValues();
+  /// Returns the code stored in a slot or -1 if the slot is empty
+  inline int keyAt(const int slot) const;
+  /// Returns the number of slots (including empty ones)
+  int capacity() const { return ivNumBuckets * FERN_BUCKET_SLOTS; }
+  /// Returns the number of leaves
+  int size() const { return ivSize; }
+  /// Returns the number of objects
+  int numObjects() const { return ivNumObjects; }
+  /// Returns the number of dense posterior values per slot (numObjects() rounded up to FERN_VALUE_ALIGN)
+  int valueStride() const { return (ivNumObjects + FERN_VALUE_ALIGN - 1) / FERN_VALUE_ALIGN * FERN_VALUE_ALIGN; }
+
+private:
+  struct Bucket
+  {
+    int keys[FERN_BUCKET_SLOTS];
+    float maxConfs[FERN_BUCKET_SLOTS];
+  };
+
+  int ivNumBuckets;
+  int ivShift;
+  int ivSize;
+  int ivNumObjects;
+  Bucket * ivBuckets;
+  FernPosteriors * ivPosteriors;
+  float * ivValues;
+
+  inline int bucketIndex(const int key) const;
+  void rehash(const int numBuckets, const int numObjects);
+  void copyFrom(const FernHashTable & other);
+};
+
+/**************************************************************************************************
+ * IMPLEMENTATION                                                                                 *
+ **************************************************************************************************/
+
+FernHashTable::FernHashTable()
+  : ivNumBuckets(0), ivShift(32), ivSize(0), ivNumObjects(0), ivBuckets(NULL), ivPosteriors(NULL),
+    ivValues(NULL)
+{
+}
+
+FernHashTable::FernHashTable(const FernHashTable & other)
+  : ivNumBuckets(0), ivShift(32), ivSize(0), ivNumObjects(0), ivBuckets(NULL), ivPosteriors(NULL),
+    ivValues(NULL)
+{
+  copyFrom(other);
+}
+
+FernHashTable::~FernHashTable()
+{
+  alignedDelete(ivBuckets);
+  delete[] ivPosteriors;
+  alignedDelete(ivValues);
+}
+
+FernHashTable& FernHashTable::operator=(const FernHashTable & other)
+{
+  if (this != &other)
+  {
+    alignedDelete(ivBuckets);
+    delete[] ivPosteriors;
+    alignedDelete(ivValues);
+    copyFrom(other);
+  }
+  return *this;
+}
+
+void FernHashTable::addObject()
+{
+  rehash(ivNumBuckets, ivNumObjects + 1);
+}
+
+inline int FernHashTable::bucketIndex(const int key) const
+{
+  // multiplicative (Fibonacci) hashing, ivNumBuckets = 2^(32 - ivShift)
+  return (unsigned int)key * 2654435761u >> ivShift;
+}
+
+inline int FernHashTable::find(const int key) const
+{
+  if (ivNumBuckets == 0)
+    return -1;
+  int b = bucketIndex(key);
+  while (true)
+  {
+    const Bucket & bucket = ivBuckets[b];
+    for (int i = 0; i < FERN_BUCKET_SLOTS; ++i)
+    {
+      if (bucket.keys[i] == key)
+        return b * FERN_BUCKET_SLOTS + i;
+      if (bucket.keys[i] < 0)
+        return -1;
+    }
+    b = (b + 1) & (ivNumBuckets - 1);
+  }
+}
+
+int FernHashTable::insert(const int key)
+{
+  int slot = find(key);
+  if (slot >= 0)
+    return slot;
+
+  if ((ivSize + 1) * FERN_MAX_LOAD_DEN > capacity() * FERN_MAX_LOAD_NUM)
+    rehash(ivNumBuckets == 0 ? 16 : 2 * ivNumBuckets, ivNumObjects);
+
+  int b = bucketIndex(key);
+  while (true)
+  {
+    Bucket & bucket = ivBuckets[b];
+    for (int i = 0; i < FERN_BUCKET_SLOTS; ++i)
+    {
+      if (bucket.keys[i] < 0)
+      {
+        bucket.keys[i] = key;
+        bucket.maxConfs[i] = 0;
+        ++ivSize;
+        return b * FERN_BUCKET_SLOTS + i;
+      }
+    }
+    b = (b + 1) & (ivNumBuckets - 1);
+  }
+}
+
+inline float FernHashTable::maxConf(const int key) const
+{
+  int slot = find(key);
+  return slot < 0 ? 0 : ivBuckets[slot / FERN_BUCKET_SLOTS].maxConfs[slot % FERN_BUCKET_SLOTS];
+}
+
+inline float & FernHashTable::maxConfAt(const int slot) const
+{
+  return ivBuckets[slot / FERN_BUCKET_SLOTS].maxConfs[slot % FERN_BUCKET_SLOTS];
+}
+
+inline FernPosteriors * FernHashTable::posteriorsAt(const int slot) const
+{
+  return ivPosteriors + slot * ivNumObjects;
+}
+
+inline float * FernHashTable::valuesAt(const int slot) const
+{
+  return ivValues + slot * valueStride();
+}
+
+void FernHashTable::updateValues()
+{
+  for (int slot = 0; slot < capacity(); ++slot)
+    for (int nObject = 0; nObject < ivNumObjects; ++nObject)
+      valuesAt(slot)[nObject] = posteriorsAt(slot)[nObject].posterior;
+}
+
+inline int FernHashTable::keyAt(const int slot) const
+{
+  return ivBuckets[slot / FERN_BUCKET_SLOTS].keys[slot % FERN_BUCKET_SLOTS];
+}
+
+/// @details Reinserts all leaves into a table with @c numBuckets buckets while widening the
+///  posterior stride to @c numObjects (new posteriors are initialized with zero).
+void FernHashTable::rehash(const int numBuckets, const int numObjects)
+{
+  Bucket * oldBuckets = ivBuckets;
+  FernPosteriors * oldPosteriors = ivPosteriors;
+  float * oldValues = ivValues;
+  int oldNumBuckets = ivNumBuckets, oldNumObjects = ivNumObjects, oldStride = valueStride();
+
+  ivNumBuckets = numBuckets;
+  ivNumObjects = numObjects;
+  for (ivShift = 32; (1 << (32 - ivShift)) < numBuckets; --ivShift);
+  ivSize = 0;
+  ivBuckets = NULL;
+  ivPosteriors = NULL;
+  ivValues = NULL;
+  if (numBuckets > 0)
+  {
+    ivBuckets = alignedNew<Bucket>(numBuckets);
+    for (int b = 0; b < numBuckets; ++b)
+      for (int i = 0; i < FERN_BUCKET_SLOTS; ++i)
+        ivBuckets[b].keys[i] = -1;
+    if (numObjects > 0)
+    {
+      ivPosteriors = new FernPosteriors[capacity() * numObjects];
+      memset(ivPosteriors, 0, capacity() * numObjects * sizeof(FernPosteriors));
+      ivValues = alignedNew<float>(capacity() * valueStride());
+      memset(ivValues, 0, capacity() * valueStride() * sizeof(float));
+    }
+  }
+
+  for (int slot = 0; slot < oldNumBuckets * FERN_BUCKET_SLOTS; ++slot)
+  {
+    int key = oldBuckets[slot / FERN_BUCKET_SLOTS].keys[slot % FERN_BUCKET_SLOTS];
+    if (key < 0)
+      continue;
+    int newSlot = insert(key);
+    maxConfAt(newSlot) = oldBuckets[slot / FERN_BUCKET_SLOTS].maxConfs[slot % FERN_BUCKET_SLOTS];
+    if (oldNumObjects > 0)
+    {
+      memcpy(posteriorsAt(newSlot), oldPosteriors + slot * oldNumObjects,
+             oldNumObjects * sizeof(FernPosteriors));
+      memcpy(valuesAt(newSlot), oldValues + slot * oldStride, oldNumObjects * sizeof(float));
+    }
+  }
+
+  alignedDelete(oldBuckets);
+  delete[] oldPosteriors;
+  alignedDelete(oldValues);
+}
+
+void FernHashTable::copyFrom(const FernHashTable & other)
+{
+  ivNumBuckets = other.ivNumBuckets;
+  ivShift = other.ivShift;
+  ivSize = other.ivSize;
+  ivNumObjects = other.ivNumObjects;
+  ivBuckets = NULL;
+  ivPosteriors = NULL;
+  ivValues = NULL;
+  if (ivNumBuckets > 0)
+  {
+    ivBuckets = alignedNew<Bucket>(ivNumBuckets);
+    memcpy(ivBuckets, other.ivBuckets, ivNumBuckets * sizeof(Bucket));
+    if (ivNumObjects > 0)
+    {
+      ivPosteriors = new FernPosteriors[capacity() * ivNumObjects];
+      memcpy(ivPosteriors, other.ivPosteriors, capacity() * ivNumObjects * sizeof(FernPosteriors));
+      ivValues = alignedNew<float>(capacity() * valueStride());
+      memcpy(ivValues, other.ivValues, capacity() * valueStride() * sizeof(float));
+    }
+  }
+}
+
+#endif // FERNHASHTABLE_H
@@ -110,7 +110,8 @@ Histogram::Histogram()
 Histogram::~Histogram()
 {
   delete [] ivLookupRGB;
-  delete ivInstance;
+  if (ivInstance == this)
+    ivInstance = NULL;
 }
 
 float * Histogram::getColorDistribution(const unsigned char * const rgb, const int & size) const
@@ -23,10 +23,17 @@
 #include <vector>
 #include <algorithm>
 #include <math.h>
+#ifdef __SSE2__
+  #include <emmintrin.h>
+#endif
 
+/// default half size of the window around each tracking point (see LKSettings::kernelWidth)
 #define KERNEL_WIDTH 2
+/// largest supported half size of the window
+#define LK_MAX_KERNEL_WIDTH 7
+/// default number of the coarsest pyramid level (see LKSettings::pyramidLevel)
 #define MAX_PYRAMID_LEVEL 5
-/// number of iterations in each pyramid level
+/// default maximum number of iterations in each pyramid level
 #define LK_ITERATIONS 30
 /// number of tracking points in the uniform grid
 #define GRID_SIZE_X 10
@@ -39,17 +46,57 @@
 /// absolute padding (used for cornerness points only)
 #define GRID_MARGIN 3
 #define KERNEL_SIZE ((KERNEL_WIDTH*2+1)*(KERNEL_WIDTH*2+1))
+/// maximum number of tracking points per object
+#define LK_MAX_POINTS (N_CORNERNESS_POINTS + GRID_SIZE_X*GRID_SIZE_Y)
+/// size of the patches compared by normalized cross correlation to filter tracking points
+#define LK_NCC_SIZE 10
+/// row length of the template windows (a multiple of 4 >= LK_MAX_KERNEL_WIDTH*2+1)
+#define LK_WINDOW_STRIDE ((LK_MAX_KERNEL_WIDTH*2+4) / 4 * 4)
+/// size of the template windows
+#define LK_WINDOW_SIZE ((LK_MAX_KERNEL_WIDTH*2+1) * LK_WINDOW_STRIDE)
+
+/// Lucas-Kanade kernels (see LKTracker::setKernel())
+#define LK_KERNEL_WINDOW 0
+#define LK_KERNEL_REFERENCE 1
+
+/// Configuration of the Lucas-Kanade tracker (see MOTLDSettings::lkSettings)
+struct LKSettings
+{
+  /// maximum number of iterations in each pyramid level (default: LK_ITERATIONS = 30)
+  int iterations;
+  ///@brief the iterations of a point in a pyramid level stop as soon as its update is shorter than
+  /// epsilon pixels of this level, e.g. 0.01 (default: 0 = always run all iterations)
+  float epsilon;
+  /// half size of the window around each point, 1 to LK_MAX_KERNEL_WIDTH (default: KERNEL_WIDTH = 2)
+  int kernelWidth;
+  ///@brief number of the coarsest pyramid level (default: MAX_PYRAMID_LEVEL = 5). It is limited to
+  /// the smallest level with at least 2*kernelWidth+3 pixels in both directions. The depth is only
+  /// derived from the frame size if set to -1, which always uses this level (e.g. 6 for 640x480)
+  int pyramidLevel;
+  /// kernel computing the flow of a point in a pyramid level, see LKTracker::setKernel() (default: LK_KERNEL_WINDOW)
+  int kernel;
+
+  /// Constructor setting default configuration
+  LKSettings()
+  {
+    iterations = LK_ITERATIONS;
+    epsilon = 0;
+    kernelWidth = KERNEL_WIDTH;
+    pyramidLevel = MAX_PYRAMID_LEVEL;
+    kernel = LK_KERNEL_WINDOW;
+  }
+};
 
 /** @brief This class contains the "short term tracking" part of the algorithm.
+ * @details The image pyramids of the previous and the current frame and all temporary buffers
+ *  are kept between frames, so processFrame() does not allocate memory once the buffers
+ *  reached their size.
  */
 class LKTracker
 {
 public:
   /// Constructor
-  LKTracker(int width, int height) : ivWidth(width), ivHeight(height),
-      ivPrevPyramid(NULL), ivIndex(1) {};
-  /// Destructor
-  ~LKTracker() {delete ivPrevPyramid;};
+  LKTracker(int width, int height, const LKSettings& settings = LKSettings());
   /// Sets up the internal image pyramid
   void initFirstFrame(unsigned char * img);
   /// Sets up the internal image pyramid
@@ -64,6 +111,18 @@ public:
   bool processFrame(const Matrix& curImage, ObjectBox& bbox, bool dotracking = true);
   /// A list of points [x0,y0,...,xn,yn] that where considered as inliers in the last iteration
   const std::vector<int> * getDebugPoints() const { return &ivDebugPoints; };
+  ///@brief Sets the kernel computing the optical flow of a point on one pyramid level:
+  /// LK_KERNEL_WINDOW (default) interpolates the window of the previous frame and its gradients once
+  /// and samples the current frame with SSE in each iteration, LK_KERNEL_REFERENCE interpolates
+  /// everything in each iteration (the original implementation, for comparison)
+  void setKernel(int kernel) { ivSettings.kernel = kernel; };
+  /// Returns the kernel used (see setKernel())
+  int getKernel() const { return ivSettings.kernel; };
+  /// Returns the settings (with the pyramid level actually used)
+  const LKSettings & getSettings() const { return ivSettings; };
+  ///@brief Returns the number of iterations computed so far and the number of points they belong to
+  /// (each point tracked forward or backward counts once, with the iterations of all pyramid levels)
+  void getIterationStats(long long & iterations, long long & points) const { iterations = ivIterations; points = ivPoints; };
 
 private:
   /// Internal representation for an image pyramid
@@ -82,25 +141,48 @@ private:
   {
       float x, y;
   };
+  /// Interpolated values of a window (kernelWidth*2+1 rows of LK_WINDOW_STRIDE values, 16 byte aligned)
+  union LKWindow
+  {
+    float v[LK_WINDOW_SIZE];
+    #ifdef __SSE2__
+    __m128 m[LK_WINDOW_SIZE / 4];
+    #endif
+  };
   int ivWidth;
   int ivHeight;
-  LKPyramid* ivPrevPyramid;
+  LKPyramid ivPyramids[2];  // pyramids of the previous and the current frame (used alternately)
+  int ivPrev;               // index of the pyramid of the previous frame (-1 before the first frame)
   int ivIndex;
   std::vector<int> ivDebugPoints;
-  /** Computes median of a vector
-   * @note changes order of vector-elements! */
-  inline float median(std::vector<float> * vec, bool compSqrt = false) const;
-  /** Computes normalized cross correlation
+  std::vector<Matrix> ivTempX, ivTempY, ivTempHalf;  // buffers of the pyramid levels
+  std::vector<float> ivPairs;  // elongation factors of all pairs of points
+  LKSettings ivSettings;
+  long long ivIterations;
+  long long ivPoints;
+  /// Computes the image pyramid (including derivatives) of img
+  void buildPyramid(const Matrix& img, LKPyramid& pyramid);
+  /** Computes median of n values
+   * @note changes order of the values! */
+  inline float median(float * values, int n, bool compSqrt = false) const;
+  /** Computes normalized cross correlation of two patches of n values
    * @details defined as: @f[NCC(A,B):=\frac{\sum_{x,y}(A(x,y)-\bar{A})(B(x,y)-\bar{B})}
     *    {\sqrt{\sum_{x,y}(A(x,y)-\bar{A})^2\sum_{x,y}(B(x,y)-\bar{B})^2}} @f]
    */
-  inline double NCC(const Matrix& aMatrix, const Matrix& bMatrix) const;
+  inline double NCC(const float * a, const float * b, int n) const;
   /** Computes optical flow for each tracking point.
    * @details Based on the technical report "Pyramidal Implementation of the
    *  Lucas Kanade Feature Tracker: Description of the algorithm" by Jean-Yves Bouguet */
   inline void pyramidLK(const LKPyramid *prevPyramid, const LKPyramid *curPyramid,
                         const Point2D *prevPts, Point2D *nextPts,
-                        char *status, int count) const;
+                        char *status, int count);
+  /// Interpolates the window of img around (x0+ax, y0+ay) (x0, y0 integer, 0 <= ax, ay < 1)
+  inline void interpolateWindow(const Matrix& img, int x0, int y0, float ax, float ay, LKWindow& window) const;
+  /** Computes the image mismatch vector b = [bx; by] of the template window and its gradients
+   *  and the window of img at (x0+ax, y0+ay) */
+  inline void windowMismatch(const LKWindow& tpl, const LKWindow& tplX, const LKWindow& tplY,
+                             const Matrix& img, int x0, int y0, float ax, float ay,
+                             float& bx, float& by) const;
 };
 
 
@@ -108,6 +190,33 @@ private:
 /**************************************************************************************************
  * IMPLEMENTATION                                                                                 *
  **************************************************************************************************/
+LKTracker::LKTracker(int width, int height, const LKSettings& settings)
+  : ivWidth(width), ivHeight(height), ivPrev(-1), ivIndex(1),
+    ivPairs(LK_MAX_POINTS * (LK_MAX_POINTS-1) / 2), ivSettings(settings), ivIterations(0), ivPoints(0)
+{
+  if (ivSettings.kernelWidth < 1 || ivSettings.kernelWidth > LK_MAX_KERNEL_WIDTH)
+  {
+    std::cerr << "LKTracker: kernel width must be between 1 and " << LK_MAX_KERNEL_WIDTH << "!" << std::endl;
+    ivSettings.kernelWidth = std::max(1, std::min(LK_MAX_KERNEL_WIDTH, ivSettings.kernelWidth));
+  }
+  if (ivSettings.iterations < 1)
+    ivSettings.iterations = 1;
+  // halve the frame as long as the next level still holds a window and its neighbors
+  const int minSize = 2 * ivSettings.kernelWidth + 3;
+  int w = width, h = height, maxLevel = 0;
+  while (((w+1) >> 1) >= minSize && ((h+1) >> 1) >= minSize)
+  {
+    w = (w+1) >> 1;
+    h = (h+1) >> 1;
+    maxLevel++;
+  }
+  if (ivSettings.pyramidLevel < 0 || ivSettings.pyramidLevel > maxLevel)
+    ivSettings.pyramidLevel = maxLevel;
+  ivTempX.resize(ivSettings.pyramidLevel + 1);
+  ivTempY.resize(ivSettings.pyramidLevel + 1);
+  ivTempHalf.resize(ivSettings.pyramidLevel + 1);
+}
+
 void LKTracker::initFirstFrame(unsigned char * img)
 {
   Matrix curImage(ivWidth, ivHeight);
@@ -116,20 +225,8 @@ void LKTracker::initFirstFrame(unsigned char * img)
 }
 void LKTracker::initFirstFrame(const Matrix& img)
 {
-  ivPrevPyramid = new LKPyramid(MAX_PYRAMID_LEVEL+1);
-  ivPrevPyramid->I[0] = img;
-  for (int i = 0; i <= MAX_PYRAMID_LEVEL; ++i)
-  {
-    ivPrevPyramid->I[i].scharrDerivativeX(ivPrevPyramid->Ix[i]);
-    ivPrevPyramid->I[i].scharrDerivativeY(ivPrevPyramid->Iy[i]);
-    if (i < MAX_PYRAMID_LEVEL)
-      ivPrevPyramid->I[i].halfSizeImage(ivPrevPyramid->I[i+1]);
-    #if DEBUG > 1
-    char filename[255];
-    sprintf(filename, "output/img%05d-%d.ppm", 0, i);
-    ivPrevPyramid->I[i].writeToPGM(filename);
-    #endif
-  }
+  buildPyramid(img, ivPyramids[0]);
+  ivPrev = 0;
   #if DEBUG
   std::cout << "#1 LKTracker: initialized, image size = (" << img.xSize() << "," << img.ySize() << ")" << std::endl;
   #endif
@@ -146,24 +243,19 @@ bool LKTracker::processFrame(const Matrix& curImage, ObjectBox& bbox, bool dotra
   return isDefined[0];
 }
 
-void LKTracker::processFrame(const Matrix& curImage, std::vector<ObjectBox>& bbox, std::vector<bool>& isDefined)
+/// @details The levels are reused, so after the first frames no memory is allocated.
+void LKTracker::buildPyramid(const Matrix& img, LKPyramid& pyramid)
 {
-  int nobs = bbox.size();
-  if (nobs > 0 && !ivPrevPyramid)
-    initFirstFrame(curImage);
-  #if DEBUG
-  std::cout << "#" << (ivIndex+1) << " LKTracker: ";
-  #endif
-  ivDebugPoints.clear();
-  LKPyramid* curPyramid = new LKPyramid(MAX_PYRAMID_LEVEL+1);
-  curPyramid->I[0] = curImage;
-  for (int i = 0; i < MAX_PYRAMID_LEVEL; ++i)
+  if (pyramid.I.empty())
+    pyramid = LKPyramid(ivSettings.pyramidLevel+1);
+  pyramid.I[0] = img;
+  for (int i = 0; i < ivSettings.pyramidLevel; ++i)
   {
-    curPyramid->I[i].halfSizeImage(curPyramid->I[i+1]);
+    pyramid.I[i].halfSizeImage(pyramid.I[i+1], ivTempHalf[i]);
     #if DEBUG > 1
     char filename[255];
-    sprintf(filename, "output/img%05d-%d.ppm", ivIndex, i);
-    curPyramid->I[i].writeToPGM(filename);
+    sprintf(filename, "output/img%05d-%d.ppm", ivPrev < 0 ? 0 : ivIndex, i);
+    pyramid.I[i].writeToPGM(filename);
     #endif
   }
 
@@ -172,16 +264,33 @@ void LKTracker::processFrame(const Matrix& curImage, std::vector<ObjectBox>& bbo
     #pragma omp section
     {
       //#pragma omp parallel for
-      for (int i = 0; i <= MAX_PYRAMID_LEVEL; ++i)
-        curPyramid->I[i].scharrDerivativeX(curPyramid->Ix[i]);
+      for (int i = 0; i <= ivSettings.pyramidLevel; ++i)
+        pyramid.I[i].scharrDerivativeX(pyramid.Ix[i], ivTempX[i]);
     }
     #pragma omp section
     {
       //#pragma omp parallel for
-      for (int i = 0; i <= MAX_PYRAMID_LEVEL; ++i)
-        curPyramid->I[i].scharrDerivativeY(curPyramid->Iy[i]);
+      for (int i = 0; i <= ivSettings.pyramidLevel; ++i)
+        pyramid.I[i].scharrDerivativeY(pyramid.Iy[i], ivTempY[i]);
     }
   }
+}
+
+void LKTracker::processFrame(const Matrix& curImage, std::vector<ObjectBox>& bbox, std::vector<bool>& isDefined)
+{
+  int nobs = bbox.size();
+  if (nobs > 0 && ivPrev < 0)
+    initFirstFrame(curImage);
+  #if DEBUG
+  std::cout << "#" << (ivIndex+1) << " LKTracker: ";
+  #endif
+  ivDebugPoints.clear();
+  ivDebugPoints.reserve(2 * LK_MAX_POINTS * nobs);
+  // (without objects there is no previous pyramid in the first frame)
+  const int cur = ivPrev < 0 ? 0 : 1 - ivPrev;
+  LKPyramid* curPyramid = &ivPyramids[cur];
+  LKPyramid* prevPyramid = &ivPyramids[1 - cur];
+  buildPyramid(curImage, *curPyramid);
 
   #if DEBUG > 1
   Matrix debugFlow(ivWidth, ivHeight, 0);
@@ -200,12 +309,13 @@ void LKTracker::processFrame(const Matrix& curImage, std::vector<ObjectBox>& bbo
             oldcenterx = bbox[obj].x + oldwidth*0.5,
             oldcentery = bbox[obj].y + oldheight*0.5;
 
-      Point2D points0[N_CORNERNESS_POINTS + GRID_SIZE_X*GRID_SIZE_Y]; // points to be tracked
-      Point2D points1[N_CORNERNESS_POINTS + GRID_SIZE_X*GRID_SIZE_Y]; // result of forward step
-      Point2D points2[N_CORNERNESS_POINTS + GRID_SIZE_X*GRID_SIZE_Y]; // result of backward step
-      char status[N_CORNERNESS_POINTS + GRID_SIZE_X*GRID_SIZE_Y];
-      float fb[N_CORNERNESS_POINTS + GRID_SIZE_X*GRID_SIZE_Y];
-      float ncc[N_CORNERNESS_POINTS + GRID_SIZE_X*GRID_SIZE_Y];
+      Point2D points0[LK_MAX_POINTS]; // points to be tracked
+      Point2D points1[LK_MAX_POINTS]; // result of forward step
+      Point2D points2[LK_MAX_POINTS]; // result of backward step
+      char status[LK_MAX_POINTS];
+      float fb[LK_MAX_POINTS];
+      float ncc[LK_MAX_POINTS];
+      float values0[LK_MAX_POINTS], values1[LK_MAX_POINTS]; // values for the medians
       int count = 0;
 
       // take points on a regular grid
@@ -235,9 +345,9 @@ void LKTracker::processFrame(const Matrix& curImage, std::vector<ObjectBox>& bbo
       for (int y = ystart; y < yend; y++)
         for (int x = xstart; x < xend; x++)
         {
-          Ix2(x-xstart,y-ystart)  = ivPrevPyramid->Ix[0](x,y) * ivPrevPyramid->Ix[0](x,y);
-          IxIy(x-xstart,y-ystart) = ivPrevPyramid->Ix[0](x,y) * ivPrevPyramid->Iy[0](x,y);
-          Iy2(x-xstart,y-ystart)  = ivPrevPyramid->Iy[0](x,y) * ivPrevPyramid->Iy[0](x,y);
+          Ix2(x-xstart,y-ystart)  = prevPyramid->Ix[0](x,y) * prevPyramid->Ix[0](x,y);
+          IxIy(x-xstart,y-ystart) = prevPyramid->Ix[0](x,y) * prevPyramid->Iy[0](x,y);
+          Iy2(x-xstart,y-ystart)  = prevPyramid->Iy[0](x,y) * prevPyramid->Iy[0](x,y);
         }
       Ix2.gaussianSmooth(2.0, 3);
       IxIy.gaussianSmooth(2.0, 3);
@@ -273,7 +383,7 @@ void LKTracker::processFrame(const Matrix& curImage, std::vector<ObjectBox>& bbo
       #endif //N_CORNERNESS_POINTS > 0
 
       // Track points forward
-      pyramidLK(ivPrevPyramid, curPyramid, points0, points1, status, count);
+      pyramidLK(prevPyramid, curPyramid, points0, points1, status, count);
 
       #if DEBUG > 1
       int nfwd = 0;
@@ -284,10 +394,9 @@ void LKTracker::processFrame(const Matrix& curImage, std::vector<ObjectBox>& bbo
       #endif
 
       // Track remaining points backward
-      pyramidLK(curPyramid, ivPrevPyramid, points1, points2, status, count);
+      pyramidLK(curPyramid, prevPyramid, points1, points2, status, count);
 
-      // Compute FB-error and NCC
-      std::vector<float> fbs, nccs;
+      // Compute FB-error and NCC (of patches sampled from the finest pyramid levels)
       int nbwd = 0;
       //#pragma omp parallel for reduction(+:nbwd)
       for (int i = 0; i < count; ++i)
@@ -296,19 +405,18 @@ void LKTracker::processFrame(const Matrix& curImage, std::vector<ObjectBox>& bbo
         {
           fb[i] = sqrt((points2[i].x - points0[i].x) * (points2[i].x - points0[i].x)
                      + (points2[i].y - points0[i].y) * (points2[i].y - points0[i].y));
-          //#pragma omp critical
-          fbs.push_back(fb[i]);
-          Matrix mA = ivPrevPyramid->I[0].getRectSubPix(points0[i].x, points0[i].y, 10, 10);
-          Matrix mB = curImage.getRectSubPix(points2[i].x, points2[i].y, 10, 10);
-          ncc[i] = NCC(mA, mB);
-          //#pragma omp critical
-          nccs.push_back(ncc[i]);
+          float patchA[LK_NCC_SIZE*LK_NCC_SIZE], patchB[LK_NCC_SIZE*LK_NCC_SIZE];
+          prevPyramid->I[0].getRectSubPix(points0[i].x, points0[i].y, LK_NCC_SIZE, LK_NCC_SIZE, patchA);
+          curPyramid->I[0].getRectSubPix(points2[i].x, points2[i].y, LK_NCC_SIZE, LK_NCC_SIZE, patchB);
+          ncc[i] = NCC(patchA, patchB, LK_NCC_SIZE*LK_NCC_SIZE);
+          values0[nbwd] = fb[i];
+          values1[nbwd] = ncc[i];
           ++nbwd;
         }
       }
 
-      float medFB = median(&fbs),
-            medNCC = median(&nccs);
+      float medFB = median(values0, nbwd),
+            medNCC = median(values1, nbwd);
 
       #if DEBUG > 1
       std::cout << ", #bwd=" << nbwd;
@@ -332,15 +440,13 @@ void LKTracker::processFrame(const Matrix& curImage, std::vector<ObjectBox>& bbo
       }
 
       // Compute median flow
-      std::vector<float> deltax;
-      std::vector<float> deltay;
       int num = 0;
       for (int i = 0; i < count; ++i)
       {
         if (status[i] > 0)
         {
-          deltax.push_back(points1[i].x - points0[i].x);
-          deltay.push_back(points1[i].y - points0[i].y);
+          values0[num] = points1[i].x - points0[i].x;
+          values1[num] = points1[i].y - points0[i].y;
           ++num;
           #if DEBUG > 1
           debugFlow.drawLine(points0[i].x, points0[i].y, points1[i].x, points1[i].y, 255);
@@ -358,8 +464,8 @@ void LKTracker::processFrame(const Matrix& curImage, std::vector<ObjectBox>& bbo
       }
       //else
 
-      float dx = median(&deltax),
-            dy = median(&deltay);
+      float dx = median(values0, num),
+            dy = median(values1, num);
 
       // Remove outliers
       /*
@@ -376,7 +482,7 @@ void LKTracker::processFrame(const Matrix& curImage, std::vector<ObjectBox>& bbo
       // Resize bounding box (compute median elongation factor)
       float s = 1;
       if (num >= 16){
-        std::vector<float> d2;
+        int nPairs = 0;
         float dpx,dpy,ddx,ddy;
         for (int i = 0; i < count; ++i)
           if (status[i] > 0)
@@ -387,12 +493,12 @@ void LKTracker::processFrame(const Matrix& curImage, std::vector<ObjectBox>& bbo
                 ddy = points0[i].y - points0[j].y;
                 dpx = points1[i].x - points1[j].x;
                 dpy = points1[i].y - points1[j].y;
-                d2.push_back((dpx*dpx + dpy*dpy) / (ddx*ddx + ddy*ddy));
+                ivPairs[nPairs++] = (dpx*dpx + dpy*dpy) / (ddx*ddx + ddy*ddy);
               }
 
-        if (!d2.empty())
+        if (nPairs > 0)
         {
-          s = median(&d2, true);
+          s = median(&ivPairs[0], nPairs, true);
           //upper bound for enlargement
           //s = std::min(1.1, s);
         }
@@ -423,19 +529,23 @@ void LKTracker::processFrame(const Matrix& curImage, std::vector<ObjectBox>& bbo
   #if DEBUG > 1
   char filename[255];
   sprintf(filename, "output/flow%05d.ppm", ivIndex);
-  writePPM(filename, ivPrevPyramid->I[0], curImage, debugFlow);
+  writePPM(filename, prevPyramid->I[0], curImage, debugFlow);
   #endif
 
-  delete ivPrevPyramid;
-  ivPrevPyramid = curPyramid;
+  ivPrev = cur;
   ++ivIndex;
 }
 
 inline void LKTracker::pyramidLK(const LKPyramid *prevPyramid, const LKPyramid *curPyramid,
                           const Point2D *prevPts, Point2D *nextPts,
-                          char *status, int count) const
+                          char *status, int count)
 {
-  for (int l = MAX_PYRAMID_LEVEL; l >= 0; --l)
+  const int kw = ivSettings.kernelWidth, topLevel = ivSettings.pyramidLevel;
+  const float epsilon2 = ivSettings.epsilon * ivSettings.epsilon;
+  long long iterations = 0;
+  for (int i = 0; i < count; i++)
+    ivPoints += status[i] > 0;
+  for (int l = topLevel; l >= 0; --l)
   {
     int xSize = prevPyramid->I[l].xSize(),
         ySize = prevPyramid->I[l].ySize();
@@ -443,13 +553,13 @@ inline void LKTracker::pyramidLK(const LKPyramid *prevPyramid, const LKPyramid *
     std::cout << "l=" << l << ", Size=(" << xSize << "," << ySize << ")" << std::endl;
     #endif
 
-    #pragma omp parallel for default(shared)
+    #pragma omp parallel for default(shared) reduction(+:iterations)
     for (int i = 0; i < count; i++)
     {
       if (status[i] > 0)
       {
         //initial guess from previous iteration
-        if (l == MAX_PYRAMID_LEVEL)
+        if (l == topLevel)
         {
           nextPts[i].x = prevPts[i].x;
           nextPts[i].y = prevPts[i].y;
@@ -463,10 +573,10 @@ inline void LKTracker::pyramidLK(const LKPyramid *prevPyramid, const LKPyramid *
         #if DEBUG > 2
         std::cout << "  p=(" << px0 << "+" << pxa << ", " << py0 << "+" << pya  << ")" << std::endl;
         #endif
-        if (px < KERNEL_WIDTH || py < KERNEL_WIDTH || px >= xSize-KERNEL_WIDTH-1
-              || py >= ySize-KERNEL_WIDTH-1)
+        if (px < kw || py < kw || px >= xSize-kw-1
+              || py >= ySize-kw-1)
         {
-          if (l >= MAX_PYRAMID_LEVEL-1){
+          if (l >= topLevel-1){
             // Give it another try one level above
             nextPts[i].x = px;
             nextPts[i].y = py;
@@ -477,12 +587,12 @@ inline void LKTracker::pyramidLK(const LKPyramid *prevPyramid, const LKPyramid *
         }else{ //omp parallel for does not like continues...
           // Compute components of spatial gradient Matrix G = [Gx2 Gxy; Gxy Gy2]
           float Gx2 = 0, Gxy = 0, Gy2 = 0;
-          for (int x = px0-KERNEL_WIDTH; x <= px0+KERNEL_WIDTH+1; ++x)
+          for (int x = px0-kw; x <= px0+kw+1; ++x)
           {
-            float factor = (x == px0-KERNEL_WIDTH ? (1-pxa) : (x == px0+KERNEL_WIDTH+1 ? pxa : 1));
-            for (int y = py0-KERNEL_WIDTH; y <= py0+KERNEL_WIDTH+1; ++y)
+            float factor = (x == px0-kw ? (1-pxa) : (x == px0+kw+1 ? pxa : 1));
+            for (int y = py0-kw; y <= py0+kw+1; ++y)
             {
-              factor *= (y == py0-KERNEL_WIDTH ? (1-pya) : (y == py0+KERNEL_WIDTH+1 ? pya : 1));
+              factor *= (y == py0-kw ? (1-pya) : (y == py0+kw+1 ? pya : 1));
               Gx2 += factor * prevPyramid->Ix[l](x,y)*prevPyramid->Ix[l](x,y); //Ix2(x,y)
               Gxy += factor * prevPyramid->Ix[l](x,y)*prevPyramid->Iy[l](x,y); //IxIy(x,y)
               Gy2 += factor * prevPyramid->Iy[l](x,y)*prevPyramid->Iy[l](x,y); //Iy2(x,y)
@@ -497,14 +607,23 @@ inline void LKTracker::pyramidLK(const LKPyramid *prevPyramid, const LKPyramid *
             status[i] = 0;
             //continue;
           }else{
+            // the window of the previous frame does not change during the iterations
+            LKWindow tpl, tplX, tplY;
+            if (ivSettings.kernel == LK_KERNEL_WINDOW)
+            {
+              interpolateWindow(prevPyramid->I[l], px0-kw, py0-kw, pxa, pya, tpl);
+              interpolateWindow(prevPyramid->Ix[l], px0-kw, py0-kw, pxa, pya, tplX);
+              interpolateWindow(prevPyramid->Iy[l], px0-kw, py0-kw, pxa, pya, tplY);
+            }
             //iteratively compute additional flow on this pyramid level
-            for (int k = 1; k <= LK_ITERATIONS; k++)
+            for (int k = 1; k <= ivSettings.iterations; k++)
             {
+              iterations++;
               //float qx = px + tp->fx, qy = py + tp->fy;
               float qx = nextPts[i].x, qy = nextPts[i].y;
-              if (qx < KERNEL_WIDTH || qy < KERNEL_WIDTH || qx >= xSize-KERNEL_WIDTH-1 || qy >= ySize-KERNEL_WIDTH-1)
+              if (qx < kw || qy < kw || qx >= xSize-kw-1 || qy >= ySize-kw-1)
               {  //lost tracking point
-                if (l >= MAX_PYRAMID_LEVEL-1){
+                if (l >= topLevel-1){
                   //give it another try one level above
                   nextPts[i].x = px;
                   nextPts[i].y = py;
@@ -518,18 +637,23 @@ inline void LKTracker::pyramidLK(const LKPyramid *prevPyramid, const LKPyramid *
 
               //compute image missmatch vector b = [bx; by]
               float bx = 0, by = 0;
-              for (int x = px0 - KERNEL_WIDTH; x <= px0 + KERNEL_WIDTH; ++x)
-              {
-                for (int y = py0 - KERNEL_WIDTH; y <= py0 + KERNEL_WIDTH; ++y)
+              if (ivSettings.kernel == LK_KERNEL_WINDOW)
+                windowMismatch(tpl, tplX, tplY, curPyramid->I[l], px0+vx0-kw, py0+vy0-kw,
+                               vxa, vya, bx, by);
+              else{
+                for (int x = px0 - kw; x <= px0 + kw; ++x)
                 {
-                  float dIk = (1-pxa) * ((1-pya)*prevPyramid->I[l](x, y) + pya*prevPyramid->I[l](x, y+1))
-                              + pxa * ((1-pya)*prevPyramid->I[l](x+1, y) + pya*prevPyramid->I[l](x+1, y+1))
-                              - (1-vxa) * ((1-vya)*curPyramid->I[l](x+vx0, y+vy0) + vya*curPyramid->I[l](x+vx0, y+vy0+1))
-                              - vxa * ((1-vya)*curPyramid->I[l](x+vx0+1, y+vy0) + vya*curPyramid->I[l](x+vx0+1, y+vy0+1));
-                  bx += dIk * ((1-pxa) * ((1-pya)*prevPyramid->Ix[l](x, y) + pya*prevPyramid->Ix[l](x, y+1))
-                                  + pxa * ((1-pya)*prevPyramid->Ix[l](x+1, y) + pya*prevPyramid->Ix[l](x+1, y+1)));
-                  by += dIk * ((1-pxa) * ((1-pya)*prevPyramid->Iy[l](x, y) + pya*prevPyramid->Iy[l](x, y+1))
-                                  + pxa * ((1-pya)*prevPyramid->Iy[l](x+1, y) + pya*prevPyramid->Iy[l](x+1, y+1)));
+                  for (int y = py0 - kw; y <= py0 + kw; ++y)
+                  {
+                    float dIk = (1-pxa) * ((1-pya)*prevPyramid->I[l](x, y) + pya*prevPyramid->I[l](x, y+1))
+                                + pxa * ((1-pya)*prevPyramid->I[l](x+1, y) + pya*prevPyramid->I[l](x+1, y+1))
+                                - (1-vxa) * ((1-vya)*curPyramid->I[l](x+vx0, y+vy0) + vya*curPyramid->I[l](x+vx0, y+vy0+1))
+                                - vxa * ((1-vya)*curPyramid->I[l](x+vx0+1, y+vy0) + vya*curPyramid->I[l](x+vx0+1, y+vy0+1));
+                    bx += dIk * ((1-pxa) * ((1-pya)*prevPyramid->Ix[l](x, y) + pya*prevPyramid->Ix[l](x, y+1))
+                                    + pxa * ((1-pya)*prevPyramid->Ix[l](x+1, y) + pya*prevPyramid->Ix[l](x+1, y+1)));
+                    by += dIk * ((1-pxa) * ((1-pya)*prevPyramid->Iy[l](x, y) + pya*prevPyramid->Iy[l](x, y+1))
+                                    + pxa * ((1-pya)*prevPyramid->Iy[l](x+1, y) + pya*prevPyramid->Iy[l](x+1, y+1)));
+                  }
                 }
               }
               float dx = (bx*Gy2 - by*Gxy) / denom,
@@ -550,48 +674,118 @@ inline void LKTracker::pyramidLK(const LKPyramid *prevPyramid, const LKPyramid *
                 }
                 break;
               }
+              if (dx*dx + dy*dy < epsilon2)  //converged
+                break;
             } //end for k
           }
         }
       } //end if (status > 0)
     } //end for each tp
   } //end for l
+  ivIterations += iterations;
 }
 
-//compute median of a vector
-//side effect: changes order of vector-elements!
-inline float LKTracker::median(std::vector<float> * vec, bool compSqrt) const
+inline void LKTracker::interpolateWindow(const Matrix& img, int x0, int y0, float ax, float ay,
+                                         LKWindow& window) const
+{
+  const int kw = ivSettings.kernelWidth;
+  for (int y = 0; y <= 2*kw; ++y)
+  {
+    for (int x = 0; x <= 2*kw; ++x)
+      window.v[x + y*LK_WINDOW_STRIDE] = (1-ax) * ((1-ay)*img(x0+x, y0+y) + ay*img(x0+x, y0+y+1))
+                                           + ax * ((1-ay)*img(x0+x+1, y0+y) + ay*img(x0+x+1, y0+y+1));
+    for (int x = 2*kw+1; x < LK_WINDOW_STRIDE; ++x)
+      window.v[x + y*LK_WINDOW_STRIDE] = 0;
+  }
+}
+
+/// @details With SSE four values of a row are sampled at once, the remaining ones separately
+///  (reading whole blocks of four could leave the image).
+inline void LKTracker::windowMismatch(const LKWindow& tpl, const LKWindow& tplX, const LKWindow& tplY,
+                                      const Matrix& img, int x0, int y0, float ax, float ay,
+                                      float& bx, float& by) const
+{
+  const int kw = ivSettings.kernelWidth;
+  const int width = img.xSize();
+  const float * data = img.data() + x0 + y0*width;
+  int start = 0;
+  #ifdef __SSE2__
+  start = (2*kw+1) / 4 * 4;
+  const __m128 w00 = _mm_set1_ps((1-ax)*(1-ay)), w01 = _mm_set1_ps((1-ax)*ay),
+               w10 = _mm_set1_ps(ax*(1-ay)), w11 = _mm_set1_ps(ax*ay);
+  __m128 accX = _mm_setzero_ps(), accY = _mm_setzero_ps();
+  for (int y = 0; y <= 2*kw; ++y)
+  {
+    const float * row = data + y*width;
+    for (int x = 0; x < start; x += 4)
+    {
+      const int i = (x + y*LK_WINDOW_STRIDE) / 4;
+      __m128 cur = _mm_add_ps(_mm_add_ps(_mm_mul_ps(w00, _mm_loadu_ps(row + x)),
+                                         _mm_mul_ps(w01, _mm_loadu_ps(row + x + width))),
+                              _mm_add_ps(_mm_mul_ps(w10, _mm_loadu_ps(row + x + 1)),
+                                         _mm_mul_ps(w11, _mm_loadu_ps(row + x + width + 1))));
+      __m128 dIk = _mm_sub_ps(tpl.m[i], cur);
+      accX = _mm_add_ps(accX, _mm_mul_ps(dIk, tplX.m[i]));
+      accY = _mm_add_ps(accY, _mm_mul_ps(dIk, tplY.m[i]));
+    }
+  }
+  // horizontal sums
+  accX = _mm_add_ps(accX, _mm_movehl_ps(accX, accX));
+  accY = _mm_add_ps(accY, _mm_movehl_ps(accY, accY));
+  bx = _mm_cvtss_f32(_mm_add_ss(accX, _mm_shuffle_ps(accX, accX, 1)));
+  by = _mm_cvtss_f32(_mm_add_ss(accY, _mm_shuffle_ps(accY, accY, 1)));
+  #else
+  bx = by = 0;
+  #endif
+  for (int y = 0; y <= 2*kw; ++y)
+  {
+    const float * row = data + y*width;
+    for (int x = start; x <= 2*kw; ++x)
+    {
+      const int i = x + y*LK_WINDOW_STRIDE;
+      float dIk = tpl.v[i] - (1-ax) * ((1-ay)*row[x] + ay*row[x + width])
+                           - ax * ((1-ay)*row[x + 1] + ay*row[x + width + 1]);
+      bx += dIk * tplX.v[i];
+      by += dIk * tplY.v[i];
+    }
+  }
+}
+
+//compute median of n values
+//side effect: changes order of the values!
+inline float LKTracker::median(float * values, int n, bool compSqrt) const
 {
-  int n = vec->size();
   if (n == 0)
     return 0;
   if (n % 2) //odd: return (sqrt of) middle element
   {
-    std::nth_element(vec->begin(), vec->begin() + n/2, vec->end());
-    return compSqrt ? sqrt(*(vec->begin() + n/2)) : *(vec->begin() + n/2);
+    std::nth_element(values, values + n/2, values + n);
+    return compSqrt ? sqrt(values[n/2]) : values[n/2];
   }else{     //even: return average (sqrt) of the two middle elements
-    std::nth_element(vec->begin(), vec->begin() + (n/2-1), vec->end());
-    float tmp = (compSqrt ? sqrt(*(vec->begin() + (n/2-1))) : *(vec->begin() + (n/2-1)));
-    std::nth_element(vec->begin() + n/2, vec->begin() + n/2, vec->end());
-    return 0.5 * (tmp + (compSqrt ? sqrt(*(vec->begin() + n/2)) : *(vec->begin() + n/2)));
+    std::nth_element(values, values + (n/2-1), values + n);
+    float tmp = (compSqrt ? sqrt(values[n/2-1]) : values[n/2-1]);
+    std::nth_element(values + n/2, values + n/2, values + n);
+    return 0.5 * (tmp + (compSqrt ? sqrt(values[n/2]) : values[n/2]));
   }
   return 0;
 }
 
-inline double LKTracker::NCC(const Matrix& aMatrix, const Matrix& bMatrix) const
+inline double LKTracker::NCC(const float * a, const float * b, int n) const
 {
-  int size = aMatrix.size();
-  if (size != bMatrix.size()){
-    std::cerr << "ncc called for matrices with unequal size!" << std::endl;
-    return 0;
+  float aMean = 0, bMean = 0;
+  for (int i = 0; i < n; ++i)
+  {
+    aMean += a[i];
+    bMean += b[i];
   }
-  float aMean = aMatrix.avg(), bMean = bMatrix.avg();
+  aMean /= n;
+  bMean /= n;
   double sumA = 0, sumB = 0, sumDiff = 0;
-  for (int i = 0; i < size; ++i)
+  for (int i = 0; i < n; ++i)
   {
-    sumA += (aMatrix.data()[i] - aMean) * (aMatrix.data()[i] - aMean);
-    sumB += (bMatrix.data()[i] - bMean) * (bMatrix.data()[i] - bMean);
-    sumDiff += (aMatrix.data()[i] - aMean) * (bMatrix.data()[i] - bMean);
+    sumA += (a[i] - aMean) * (a[i] - aMean);
+    sumB += (b[i] - bMean) * (b[i] - bMean);
+    sumDiff += (a[i] - aMean) * (b[i] - bMean);
   }
   if (sumA == 0 || sumB == 0)
     return 0;
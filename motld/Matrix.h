@@ -40,6 +40,9 @@
 #else
   #include <sstream>
 #endif
+#ifdef __SSE2__
+  #include <emmintrin.h>
+#endif
 
 #ifndef PI
 #define PI 3.1415926536
@@ -104,8 +107,12 @@ public:
   void derivativeY(Matrix& result) const;
   /// Applies 3x3 Scharr filter in x direction (result will be in result)
   void scharrDerivativeX(Matrix& result) const;
+  /// Applies 3x3 Scharr filter in x direction, temp is used as buffer (no allocation if its size fits)
+  void scharrDerivativeX(Matrix& result, Matrix& temp) const;
   /// Applies 3x3 Scharr filter in y direction (result will be in result)
   void scharrDerivativeY(Matrix& result) const;
+  /// Applies 3x3 Scharr filter in y direction, temp is used as buffer (no allocation if its size fits)
+  void scharrDerivativeY(Matrix& result, Matrix& temp) const;
   /// Applies 3x3 Sobel filter in x direction (result will be in result)
   void sobelDerivativeX(Matrix& result) const;
   /// Applies 3x3 Sobel filter in y direction (result will be in result)
@@ -116,11 +123,15 @@ public:
   void writeToPGM(const char *filename) const;
   /// Returns a patch around the central point using bilinear interpolation
   Matrix getRectSubPix(float centerx, float centery, int width, int height) const;
+  /// Writes a patch around the central point (width x height values) to result
+  void getRectSubPix(float centerx, float centery, int width, int height, float* result) const;
 
   /// Changes the size of the matrix, data will be lost
   void setSize(int width, int height);
   /// Downsamples image to half of its size (result will be in result)
   void halfSizeImage(Matrix& result) const;
+  /// Downsamples image to half of its size, temp is used as buffer (no allocation if its size fits)
+  void halfSizeImage(Matrix& result, Matrix& temp) const;
   /// Downsamples the matrix
   void downsample(int newWidth, int newHeight);
   /// Downsamples the matrix using bilinear interpolation
@@ -131,6 +142,9 @@ public:
   void upsampleBilinear(int newWidth, int newHeight);
   /// Scales the matrix (includes upsampling and downsampling)
   void rescale(int newWidth, int newHeight);
+  /// Computes the region (x, y, width, height) of the matrix scaled to newWidth x newHeight
+  /// (like rescale() and cut(), but without scaling the rest of the matrix)
+  void rescaleRegion(Matrix& result, int newWidth, int newHeight, int x, int y, int width, int height) const;
 
   /// Fills the matrix with the value value (see also operator =)
   void fill(const float value);
@@ -189,6 +203,16 @@ public:
   float* createSummedAreaTable() const;
   /// Creates an Integral Image and an Integral Image of squared values
   float** createSummedAreaTable2() const;
+  /// Creates an Integral Image (overload for generic code, see createSummedAreaTable())
+  void createSummedAreaTable(float *& sat) const;
+  /// Creates an Integral Image and an Integral Image of squared values (see createSummedAreaTable2())
+  void createSummedAreaTable2(float *& sat, float *& sat2) const;
+  /// Creates an Integral Image of the values rounded to integers
+  void createSummedAreaTable(unsigned int *& sat) const;
+  /// Creates an Integral Image and an Integral Image of squared values of the values rounded to integers
+  void createSummedAreaTable2(unsigned int *& sat, unsigned int *& sat2) const;
+  /// Same as above but with a 64 bit table of squared values (exact for arbitrarily large areas)
+  void createSummedAreaTable2(unsigned int *& sat, unsigned long long *& sat2) const;
 
 protected:
   int ivWidth, ivHeight;
@@ -327,8 +351,14 @@ void Matrix::derivativeY(Matrix& result) const
 /// @details Applied filter: [-3,0,3; -10,0,10; -3,0,3] = [-1,0,1] x [3;10;3]
 void Matrix::scharrDerivativeX(Matrix& result) const
 {
-  if(ivWidth * ivHeight == 0)return;
   Matrix tmp;
+  scharrDerivativeX(result, tmp);
+}
+
+/// @see scharrDerivativeX()
+void Matrix::scharrDerivativeX(Matrix& result, Matrix& tmp) const
+{
+  if(ivWidth * ivHeight == 0)return;
   this->derivativeX(tmp); //apply [-1,0,1]
   result.setSize(ivWidth, ivHeight);
   //apply [3;10;3]
@@ -346,8 +376,14 @@ void Matrix::scharrDerivativeX(Matrix& result) const
 /// @see scharrDerivativeX()
 void Matrix::scharrDerivativeY(Matrix& result) const
 {
-  if(ivWidth * ivHeight == 0)return;
   Matrix tmp;
+  scharrDerivativeY(result, tmp);
+}
+
+/// @see scharrDerivativeX()
+void Matrix::scharrDerivativeY(Matrix& result, Matrix& tmp) const
+{
+  if(ivWidth * ivHeight == 0)return;
   this->derivativeY(tmp);
   result.setSize(ivWidth, ivHeight);
   for(int y = 0; y < ivHeight; ++y)
@@ -437,9 +473,16 @@ void Matrix::gaussianSmooth(const float sigma, const int filterSize)
 /// @details Applies the filter [1/4 1/2 1/4]^2
 //maybe use [1/16 1/4 3/8 1/4 1/16]^2 instead
 void Matrix::halfSizeImage(Matrix& result) const
+{
+  Matrix temp;
+  halfSizeImage(result, temp);
+}
+
+/// @see halfSizeImage()
+void Matrix::halfSizeImage(Matrix& result, Matrix& temp) const
 {
   //downsample in x-direction
-  Matrix temp((ivWidth+1)>>1, ivHeight);
+  temp.setSize((ivWidth+1)>>1, ivHeight);
   for (int y = 0; y < ivHeight; ++y)
   {
     temp(0,y) = 0.75 * ivData[0 + y*ivWidth] + 0.25 * ivData[1 + y*ivWidth];
@@ -479,6 +522,13 @@ void Matrix::writeToPGM(const char *filename) const
 Matrix Matrix::getRectSubPix(float centerx, float centery, int width, int height) const
 {
   Matrix result(width, height);
+  getRectSubPix(centerx, centery, width, height, result.data());
+  return result;
+}
+
+/// @details Pixels outside of the image get the average value of the image.
+void Matrix::getRectSubPix(float centerx, float centery, int width, int height, float* result) const
+{
   float cx = centerx - (width-1)*0.5f, cy = centery - (height-1)*0.5f;
   int srcx = floor(cx), srcy = floor(cy);
   float a = cx - srcx, b = cy - srcy,
@@ -492,7 +542,7 @@ Matrix Matrix::getRectSubPix(float centerx, float centery, int width, int height
     {
       for(int x=0; x<width; ++x)
       {
-        result(x,y) = a11*operator()(srcx+x,srcy+y)
+        result[x + y*width] = a11*operator()(srcx+x,srcy+y)
                     + a12*operator()(srcx+x+1,srcy+y)
                     + a21*operator()(srcx+x,srcy+y+1)
                     + a22*operator()(srcx+x+1,srcy+y+1);
@@ -505,22 +555,21 @@ Matrix Matrix::getRectSubPix(float centerx, float centery, int width, int height
       for(int x=0; x<width; ++x)
       {
         if(srcx+x<0 || srcx+x+1>=ivWidth || srcy+y<0 || srcy+y+1>=ivHeight)
-          result(x,y) = avgValue;
+          result[x + y*width] = avgValue;
         else
-          result(x,y) = a11*operator()(srcx+x,srcy+y)
+          result[x + y*width] = a11*operator()(srcx+x,srcy+y)
                       + a12*operator()(srcx+x+1,srcy+y)
                       + a21*operator()(srcx+x,srcy+y+1)
                       + a22*operator()(srcx+x+1,srcy+y+1);
         /*
         // copy from border (not very efficient)
-        result(x,y) = a11*operator()(MAX(0,MIN(ivWidth-1,srcx+x)),MAX(0,MIN(ivHeight-1,srcy+y)))
+        result[x + y*width] = a11*operator()(MAX(0,MIN(ivWidth-1,srcx+x)),MAX(0,MIN(ivHeight-1,srcy+y)))
                     + a12*operator()(MAX(0,MIN(ivWidth-1,srcx+x+1)),MAX(0,MIN(ivHeight-1,srcy+y)))
                     + a21*operator()(MAX(0,MIN(ivWidth-1,srcx+x)),MAX(0,MIN(ivHeight-1,srcy+y+1)))
                     + a22*operator()(MAX(0,MIN(ivWidth-1,srcx+x+1)),MAX(0,MIN(ivHeight-1,srcy+y+1)));  */
       }
     }
   }
-  return result;
 }
 
 void Matrix::setSize(int width, int height)
@@ -804,6 +853,74 @@ void Matrix::rescale(int newWidth, int newHeight)
   }
 }
 
+/// Computes for count target pixels starting at begin the first source pixel, the number of
+/// source pixels and their weights if srcSize pixels are scaled by 1 / factor (area averaging)
+inline void areaResampleWeights(const float factor, const int srcSize, const int begin, const int count,
+                                std::vector<int>& first, std::vector<int>& num, std::vector<float>& weights)
+{
+  const int maxNum = (int)ceil(factor) + 1;
+  first.resize(count);
+  num.resize(count);
+  weights.resize(count * maxNum);
+  for (int j = 0; j < count; ++j)
+  {
+    const float a = (begin + j) * factor;
+    const float b = MIN((float)srcSize, (begin + j + 1) * factor);
+    first[j] = MIN(srcSize - 1, (int)a);
+    num[j] = 0;
+    for (int i = first[j]; i < srcSize && i < b && num[j] < maxNum; ++i)
+      weights[j * maxNum + num[j]++] = (MIN(b, (float)(i + 1)) - MAX(a, (float)i)) / factor;
+    if (num[j] == 0)
+      weights[j * maxNum + num[j]++] = 1;
+  }
+}
+
+/// @details Each target pixel is the mean of the source pixels it covers, weighted by their
+///  overlap, which is what downsample() and upsample() compute for the whole matrix. Only the
+///  source pixels below the region are read, so the cost depends on the size of the region
+///  and not on the size of the matrix.
+void Matrix::rescaleRegion(Matrix& result, int newWidth, int newHeight, int x, int y, int width, int height) const
+{
+  std::vector<int> colFirst, colNum, rowFirst, rowNum;
+  std::vector<float> colWeights, rowWeights;
+  areaResampleWeights((float)ivWidth / newWidth, ivWidth, x, width, colFirst, colNum, colWeights);
+  areaResampleWeights((float)ivHeight / newHeight, ivHeight, y, height, rowFirst, rowNum, rowWeights);
+  const int colStride = colWeights.size() / width;
+  const int rowStride = rowWeights.size() / height;
+  // scale the covered source rows horizontally
+  const int srcY = rowFirst[0];
+  const int srcHeight = rowFirst[height-1] + rowNum[height-1] - srcY;
+  std::vector<float> rows(srcHeight * width);
+  for (int sy = 0; sy < srcHeight; ++sy)
+  {
+    const float * src = ivData + (srcY + sy) * ivWidth;
+    float * dst = &rows[sy * width];
+    for (int j = 0; j < width; ++j)
+    {
+      const float * w = &colWeights[j * colStride];
+      float sum = 0;
+      for (int i = 0; i < colNum[j]; ++i)
+        sum += w[i] * src[colFirst[j] + i];
+      dst[j] = sum;
+    }
+  }
+  // and vertically
+  result.setSize(width, height);
+  for (int j = 0; j < height; ++j)
+  {
+    const float * w = &rowWeights[j * rowStride];
+    float * dst = result.ivData + j * width;
+    for (int k = 0; k < width; ++k)
+      dst[k] = 0;
+    for (int i = 0; i < rowNum[j]; ++i)
+    {
+      const float * src = &rows[(rowFirst[j] - srcY + i) * width];
+      for (int k = 0; k < width; ++k)
+        dst[k] += w[i] * src[k];
+    }
+  }
+}
+
 void Matrix::fill(const float value)
 {
   int wholeSize = ivWidth*ivHeight;
@@ -1075,9 +1192,13 @@ inline Matrix& Matrix::operator=(const float value)
   return *this;
 }
 
+/// @details The memory is reused if the size does not change.
 Matrix& Matrix::operator=(const Matrix& copyFrom)
 {
-  if (this != &copyFrom) {
+  if (this != &copyFrom && ivData != 0 && copyFrom.ivData != 0
+      && ivWidth == copyFrom.ivWidth && ivHeight == copyFrom.ivHeight)
+    memcpy(ivData, copyFrom.ivData, ivWidth * ivHeight * sizeof(float));
+  else if (this != &copyFrom) {
     if (ivData != 0) delete[] ivData;
     ivWidth = copyFrom.ivWidth;
     ivHeight = copyFrom.ivHeight;
@@ -1235,6 +1356,114 @@ inline float** Matrix::createSummedAreaTable2() const
   return result;
 }
 
+inline void Matrix::createSummedAreaTable(float *& sat) const
+{
+  sat = createSummedAreaTable();
+}
+
+inline void Matrix::createSummedAreaTable2(float *& sat, float *& sat2) const
+{
+  float ** saTables = createSummedAreaTable2();
+  sat  = saTables[0];
+  sat2 = saTables[1];
+  delete[] saTables;
+}
+
+inline void Matrix::createSummedAreaTable(unsigned int *& sat) const
+{
+  unsigned int * sat2;
+  createSummedAreaTable2(sat, sat2);
+  delete[] sat2;
+}
+
+/// @details The values are rounded to the nearest integer (intended for images with values in
+///  [0, 255]). The tables may overflow for large images, but since unsigned arithmetic is modulo
+///  2^32 the area of any rectangle (see summedTableArea()) is still exact as long as it is below
+///  2^32, i.e. for rectangles of up to 66051 pixels (sat2). Each row is built with a SIMD prefix sum.
+inline void Matrix::createSummedAreaTable2(unsigned int *& sat, unsigned int *& sat2) const
+{
+  const int width = ivWidth + 1;
+  const int height = ivHeight + 1;
+
+  sat = new unsigned int[width*height];
+  sat2 = new unsigned int[width*height];
+  memset(sat, 0, width * sizeof(unsigned int));
+  memset(sat2, 0, width * sizeof(unsigned int));
+
+  for (int y = 1; y < height; ++y)
+  {
+    const float * row = ivData + (y - 1) * ivWidth;
+    unsigned int * satRow = sat + y * width;
+    unsigned int * sat2Row = sat2 + y * width;
+    satRow[0] = sat2Row[0] = 0;
+    int x = 0;
+#ifdef __SSE2__
+    const __m128 half = _mm_set1_ps(0.5f);
+    __m128i carry = _mm_setzero_si128(), carry2 = _mm_setzero_si128();
+    for (; x + 4 <= ivWidth; x += 4)
+    {
+      __m128i v = _mm_cvttps_epi32(_mm_add_ps(_mm_loadu_ps(row + x), half));
+      // squares via 16 bit multiply-add (the upper 16 bits of each value are zero)
+      __m128i v2 = _mm_madd_epi16(v, v);
+      v = _mm_add_epi32(v, _mm_slli_si128(v, 4));
+      v = _mm_add_epi32(v, _mm_slli_si128(v, 8));
+      v2 = _mm_add_epi32(v2, _mm_slli_si128(v2, 4));
+      v2 = _mm_add_epi32(v2, _mm_slli_si128(v2, 8));
+      v = _mm_add_epi32(v, carry);
+      v2 = _mm_add_epi32(v2, carry2);
+      carry = _mm_shuffle_epi32(v, 0xFF);
+      carry2 = _mm_shuffle_epi32(v2, 0xFF);
+      _mm_storeu_si128((__m128i*)(satRow + x + 1),
+                       _mm_add_epi32(v, _mm_loadu_si128((const __m128i*)(satRow - width + x + 1))));
+      _mm_storeu_si128((__m128i*)(sat2Row + x + 1),
+                       _mm_add_epi32(v2, _mm_loadu_si128((const __m128i*)(sat2Row - width + x + 1))));
+    }
+    unsigned int rowSum = _mm_cvtsi128_si32(carry), rowSum2 = _mm_cvtsi128_si32(carry2);
+#else
+    unsigned int rowSum = 0, rowSum2 = 0;
+#endif
+    for (; x < ivWidth; ++x)
+    {
+      unsigned int v = (int)(row[x] + 0.5f);
+      rowSum += v;
+      rowSum2 += v * v;
+      satRow[x + 1] = rowSum + satRow[x + 1 - width];
+      sat2Row[x + 1] = rowSum2 + sat2Row[x + 1 - width];
+    }
+  }
+}
+
+/// @details Unlike the 32 bit version the squared values are accumulated in 64 bit, so the areas
+///  of sat2 are exact for any image size; sat is exact for areas of up to 2^24 pixels.
+inline void Matrix::createSummedAreaTable2(unsigned int *& sat, unsigned long long *& sat2) const
+{
+  const int width = ivWidth + 1;
+  const int height = ivHeight + 1;
+
+  sat = new unsigned int[width*height];
+  sat2 = new unsigned long long[width*height];
+  memset(sat, 0, width * sizeof(unsigned int));
+  memset(sat2, 0, width * sizeof(unsigned long long));
+
+  for (int y = 1; y < height; ++y)
+  {
+    const float * row = ivData + (y - 1) * ivWidth;
+    unsigned int * satRow = sat + y * width;
+    unsigned long long * sat2Row = sat2 + y * width;
+    satRow[0] = sat2Row[0] = 0;
+    unsigned int rowSum = 0;
+    unsigned long long rowSum2 = 0;
+    for (int x = 0; x < ivWidth; ++x)
+    {
+      unsigned int v = (int)(row[x] + 0.5f);
+      rowSum += v;
+      rowSum2 += v * v;
+      satRow[x + 1] = rowSum + satRow[x + 1 - width];
+      sat2Row[x + 1] = rowSum2 + sat2Row[x + 1 - width];
+    }
+  }
+}
+
 inline double summedTableArea(float* sat, int width, int x1, int y1, int x2, int y2)
 {
   ++width; ++x2; ++y2;
@@ -1246,6 +1475,16 @@ inline double summedTableArea(const float * const sat, int * indices)
   return sat[indices[0]] - sat[indices[1]] - sat[indices[2]] + sat[indices[3]];
 }
 
+inline unsigned int summedTableArea(const unsigned int * const sat, int * indices)
+{
+  return sat[indices[0]] - sat[indices[1]] - sat[indices[2]] + sat[indices[3]];
+}
+
+inline unsigned long long summedTableArea(const unsigned long long * const sat, int * indices)
+{
+  return sat[indices[0]] - sat[indices[1]] - sat[indices[2]] + sat[indices[3]];
+}
+
 inline int* getSATIndices(int width, int x1, int y1, int x2, int y2)
 {
   ++width; ++x2; ++y2;
@@ -25,6 +25,7 @@
 #include <iostream>
 #include <fstream>
 #include <vector>
+#include <map>
 #include <array>
 #include "LKTracker.h"
 #include "FernFilter.h"
@@ -50,6 +51,11 @@
 
 const int STABILIZE_CNT = 2;
 
+/// size of the patch signature of the NN cache (see MOTLDSettings::nnCacheTolerance)
+#define NN_CACHE_SIGNATURE 11
+/// detections overlapping the tracker box by more than this are verified regardless of MOTLDSettings::nnVerifyBudget
+#define NN_BUDGET_TRACKER_OVERLAP 0.5
+
 /// Settings-structure that may be passed to the constructor of MultiObjectTLD
 struct MOTLDSettings
 {
@@ -72,6 +78,75 @@ struct MOTLDSettings
   bool allowFastChange;
   /// temporary trains rotated patches to account for fast rotation in image plane (experimental!)
   bool enableFastRotation;
+  ///@brief data structure holding the fern posteriors. Supported stores are FERN_STORE_HASH
+  /// (default, open addressing hash tables) and FERN_STORE_MAP (std::map, for comparison)
+  int fernStore;
+  ///@brief summed area tables used by the detector. Supported modes are FERN_SAT_INTEGER (default,
+  /// exact integer sums of the pixels rounded to integers) and FERN_SAT_FLOAT (for comparison)
+  int satMode;
+  ///@brief the way the detector scans the scales. Supported modes are FERN_SCAN_PYRAMID (default,
+  /// a scaled copy of the frame per scale) and FERN_SCAN_INTEGRAL (all scales are evaluated on a
+  /// single integral image of the frame, uses integer tables regardless of satMode)
+  int scanMode;
+  ///@brief the detector scans the whole frame only every fullScanInterval frames. In between, as
+  /// long as all objects are STATUS_OK, only the surroundings of the objects as predicted by the
+  /// tracker are scanned (see searchMargin, searchScales), otherwise the whole frame is scanned
+  /// immediately (default: 1 = always scan the whole frame)
+  int fullScanInterval;
+  /// distance searched around each object in units of its box size (default: 1)
+  float searchMargin;
+  /// number of smaller and larger scales searched around each object (default: 2)
+  int searchScales;
+  ///@brief time budget of the detector in milliseconds per frame (default: 0 = unlimited). A full
+  /// scan exceeding the budget is spread over several frames, each scanning a part of the scales
+  float detectorBudget;
+  ///@brief distance of neighboring sliding windows as a fraction of the window size, e.g. 0.1 for
+  /// the 10% shift of the original TLD (default: 0 = every position of each scale)
+  float scanStride;
+  ///@brief coarse-to-fine scanning: the grid given by scanStride is scanned first, afterwards the
+  /// neighborhoods of its hits are rescanned densely at the same and the adjacent scales (default: false)
+  bool scanRefine;
+  ///@brief the detector only scans the scales some object could occupy: the range of scales each
+  /// object has been observed at, extended by scaleMargin scales (default: -1 = all scales)
+  int scaleMargin;
+  /// additional scales searched (see scaleMargin) while an object is STATUS_LOST (default: 3)
+  int lostScaleMargin;
+  ///@brief objects whose aspect ratio differs from the ones of all groups by more than this factor
+  /// (e.g. 0.3 = 30%) form a new group with a scan grid of its own, otherwise they are reshaped to
+  /// the aspect ratio of the closest group. With FERN_SCAN_INTEGRAL all groups share the single
+  /// integral image of a frame; otherwise each group rescales the frame for its own scales, so every
+  /// group adds about the time of rescaling the frame once more (see FernScanStats::time[0]).
+  /// (default: 0 = all objects are reshaped to the aspect ratio of the first object)
+  float aspectTolerance;
+  ///@brief seed of the random number generator of the detector (fern features and warps). Given the
+  /// same seed and input, results are identical across runs, platforms and numbers of threads (default: 1)
+  unsigned int seed;
+  ///@brief the positive patches of an object and the negative patches of the nearest neighbor classifier
+  /// are searched with a cluster index once there are nnIndexMin of them (default: 0 = never, always
+  /// compare all patches)
+  int nnIndexMin;
+  ///@brief maximum number of clusters visited per search of the index (see nnIndexMin), fewer clusters
+  /// are faster but may miss the most similar patch (default: 0 = exact search, visit all clusters that
+  /// may contain a more similar patch; with NN_STORE_INT8 exact with respect to the quantized patches)
+  int nnIndexProbes;
+  ///@brief maximum number of positive patches per object and of negative patches of the nearest neighbor
+  /// classifier. Beyond the limit the patch most similar to another one is removed (default: 0 = unlimited)
+  int nnMaxPositives, nnMaxNegatives;
+  ///@brief storage of the normalized patches searched by the nearest neighbor classifier, either
+  /// NN_STORE_FLOAT or NN_STORE_INT8 (the patches keep no float pixels, about an eighth of the memory per
+  /// patch; confidences differ by up to about 2e-3, see benchExample) (default: NN_STORE_FLOAT)
+  int nnStore;
+  ///@brief detector windows at the same position as in the previous frame reuse the nearest neighbor
+  /// similarities of that frame if the mean, the standard deviation and the means of the 3 x 3 blocks
+  /// of their patches differ by at most nnCacheTolerance gray values and the classifier has not changed
+  /// in between, e.g. 0.5 for a static camera (default: -1 = no cache)
+  float nnCacheTolerance;
+  ///@brief maximum number of detections per object verified by the nearest neighbor classifier, the
+  /// ones with the highest fern confidence are kept. Detections overlapping the tracker box (by more
+  /// than NN_BUDGET_TRACKER_OVERLAP) are always verified. (default: 0 = verify all detections)
+  int nnVerifyBudget;
+  /// configuration of the short term tracker (see LKSettings)
+  LKSettings lkSettings;
 
   /// Constructor setting default configuration
   MOTLDSettings(int cm = COLOR_MODE_GRAY)
@@ -86,6 +161,26 @@ struct MOTLDSettings
     useColor = false;
     allowFastChange = false;
     enableFastRotation = false;
+    fernStore = FERN_STORE_HASH;
+    satMode = FERN_SAT_INTEGER;
+    scanMode = FERN_SCAN_PYRAMID;
+    fullScanInterval = 1;
+    searchMargin = 1;
+    searchScales = 2;
+    detectorBudget = 0;
+    scanStride = 0;
+    scanRefine = false;
+    scaleMargin = -1;
+    lostScaleMargin = 3;
+    aspectTolerance = 0;
+    seed = 1;
+    nnIndexMin = 0;
+    nnIndexProbes = 0;
+    nnMaxPositives = 0;
+    nnMaxNegatives = 0;
+    nnStore = NN_STORE_FLOAT;
+    nnCacheTolerance = -1;
+    nnVerifyBudget = 0;
   }
 };
 
@@ -102,10 +197,27 @@ public:
        : ivWidth(width), ivHeight(height),
          ivColorMode(settings.colorMode), ivPatchSize(settings.patchSize), ivBBmin(settings.bbMin),
          ivSide0Cnt(0),ivSide1Cnt(0),ivSide(0),ivUseColor(settings.useColor && ivColorMode == COLOR_MODE_RGB),
-         ivEnableFastRotation(settings.enableFastRotation), ivLKTracker(LKTracker(width, height)),
+         ivEnableFastRotation(settings.enableFastRotation), ivLKTracker(LKTracker(width, height, settings.lkSettings)),
          ivNNClassifier(NNClassifier(width, height, ivPatchSize, ivUseColor, settings.allowFastChange)),
-         ivFernFilter(FernFilter(width, height, settings.numFerns, settings.featuresPerFern)),
-         ivNObjects(0), ivGateEnabled(false), ivLearningEnabled(true), ivNLastDetections(0) { };
+         ivFernFilter(FernFilter(width, height, settings.numFerns, settings.featuresPerFern,
+                                 settings.patchSize, settings.scaleMin, settings.scaleMax,
+                                 settings.bbMin, settings.fernStore, settings.seed)),
+         ivNObjects(0), ivGateEnabled(false), ivLearningEnabled(true), ivNLastDetections(0),
+         ivFullScanInterval(settings.fullScanInterval), ivSearchMargin(settings.searchMargin),
+         ivSearchScales(settings.searchScales), ivDetectorBudget(settings.detectorBudget),
+         ivFramesSinceFullScan(0), ivNextFullScale(-1), ivWindowCost(0),
+         ivScaleMargin(settings.scaleMargin), ivLostScaleMargin(settings.lostScaleMargin),
+         ivAspectTolerance(settings.aspectTolerance), ivNNCacheTolerance(settings.nnCacheTolerance),
+         ivNNCacheVersion(0), ivNNCacheHits(0), ivNNCacheMisses(0),
+         ivNNVerifyBudget(settings.nnVerifyBudget), ivVerifiedDetections(0), ivDroppedDetections(0)
+  {
+    ivFernFilter.changeSATMode(settings.satMode);
+    ivFernFilter.changeScanMode(settings.scanMode);
+    ivFernFilter.changeScanStride(settings.scanStride, settings.scanRefine);
+    ivNNClassifier.setStore(settings.nnStore);
+    ivNNClassifier.setIndex(settings.nnIndexMin, settings.nnIndexProbes);
+    ivNNClassifier.setLimits(settings.nnMaxPositives, settings.nnMaxNegatives);
+  };
 
   /** @brief Marks a new object in the previously passed frame.
    * @note To add multiple objects in a single frame please prefer addObjects().
@@ -165,10 +277,23 @@ public:
   /// Writes a colored debug image into the given rgb matrices. Details see writeDebugImage().
   void getDebugImage(unsigned char * src, Matrix& rMat, Matrix& gMat, Matrix& bMat, int mode = 255) const;
 
-  /// Returns an instance of MultiObjectTLD while loading the classifier from file.
-  static MultiObjectTLD loadClassifier(const char * filename);
+  ///@brief Returns an instance of MultiObjectTLD while loading the classifier from file.
+  /// The runtime settings (tracker, scan schedule, stride, budgets, scale margins, aspect tolerance,
+  /// NN store, index, limits and cache) are taken from @c settings. The image format, patch size,
+  /// ferns and their modes and the state of the random number generator come from the file.
+  static MultiObjectTLD loadClassifier(const char * filename, const MOTLDSettings & settings = MOTLDSettings());
   /// Saves the classifier to a (binary) file.
   void saveClassifier(const char * filename) const;
+  /// Returns the performance counters of the detector (see FernScanStats).
+  const FernScanStats & getDetectorStats() const { return ivFernFilter.getScanStats(); }
+  /// Returns the number of positive and negative NN patches removed because of the limits (see MOTLDSettings).
+  void getNNEvictions(int & positives, int & negatives) const { ivNNClassifier.getEvictions(positives, negatives); }
+  /// Returns the number of detector windows whose NN similarities were taken from / missing in the cache (see MOTLDSettings).
+  void getNNCacheStats(long long & hits, long long & misses) const { hits = ivNNCacheHits; misses = ivNNCacheMisses; }
+  /// Returns the number of detections verified by the NN classifier and the number dropped because of MOTLDSettings::nnVerifyBudget.
+  void getNNBudgetStats(long long & verified, long long & dropped) const { verified = ivVerifiedDetections; dropped = ivDroppedDetections; }
+  /// Returns the number of iterations of the tracker and the number of tracked points (see LKTracker::getIterationStats()).
+  void getLKStats(long long & iterations, long long & points) const { ivLKTracker.getIterationStats(iterations, points); }
 
 private:
   int ivWidth;
@@ -199,13 +324,50 @@ private:
   Matrix ivCurImage;
   unsigned char * ivCurImagePtr;
   std::vector<FernDetection> ivLastDetections;
+  std::vector<int> ivDetectionWindows;  // window (i.e. patch) of each detection
   std::vector<FernDetection> ivLastDetectionClusters;
   int ivNLastDetections;
   void clusterDetections(float threshold);
 
+  // search region scheduler (see MOTLDSettings::fullScanInterval)
+  int ivFullScanInterval;
+  float ivSearchMargin;
+  int ivSearchScales;
+  float ivDetectorBudget;
+  int ivFramesSinceFullScan;
+  int ivNextFullScale;   // first scale of an unfinished full scan (-1 if there is none)
+  float ivWindowCost;    // estimated detector time per window in microseconds
+  int ivScaleMargin;
+  int ivLostScaleMargin;
+  float ivAspectTolerance;
+  std::vector<int> ivScaleLow, ivScaleHigh;  // range of scales each object has been observed at
+  void updateScaleRange(const int & o);
+  void getScaleBand(const int & o, int & begin, int & end) const;
+  void planDetection();
+
+  // NN similarities of the windows of the previous frame (see MOTLDSettings::nnCacheTolerance)
+  struct NNCacheEntry
+  {
+    float signature[NN_CACHE_SIGNATURE];
+    std::vector<float> posNCC;
+    float negNCC;
+  };
+  float ivNNCacheTolerance;
+  std::map<unsigned long long, NNCacheEntry> ivNNCache;
+  unsigned int ivNNCacheVersion;
+  long long ivNNCacheHits, ivNNCacheMisses;
+  void patchSignature(const NNPatch & patch, float * signature) const;
+  void getWindowSimilarities(const std::vector<FernDetection> & windows, const std::vector<NNPatch*> & patches,
+                             std::vector<float> & posNCC, std::vector<float> & negNCC);
+
+  // verification budget (see MOTLDSettings::nnVerifyBudget)
+  int ivNNVerifyBudget;
+  long long ivVerifiedDetections, ivDroppedDetections;
+  void applyVerifyBudget();
+
   MultiObjectTLD (int width, int height, int colorMode, int patchSize, int bbMin, bool useColor,
                   bool fastRotation, NNClassifier nnc, FernFilter ff, int nObjects,
-                  float aspectRatio, bool learningEnabled);
+                  float aspectRatio, bool learningEnabled, const MOTLDSettings & settings);
 };
 
 /**************************************************************************************************
@@ -224,21 +386,45 @@ void MultiObjectTLD::addObjects(std::vector<ObjectBox> obs)
   int n = obs.size();
   if (n == 0)
     return;
+  // aspect ratios of the groups (see MOTLDSettings::aspectTolerance)
+  std::vector<float> ratios;
+  if (ivNObjects > 0)
+  {
+    ratios.push_back(ivAspectRatio);
+    for (int g = 1; g < ivFernFilter.getNumGroups(); ++g)
+      ratios.push_back(ivFernFilter.getGroupAspectRatio(g));
+  }
+  std::vector<int> groups(n, 0);
   for (int i = 0; i < n; i++)
   {
     obs[i].path = boost::circular_buffer<CvPoint>(CB_LEN);
     obs[i].objectId = ivNObjects + i;
+    float ratio = obs[i].width / (float)obs[i].height;
     if (obs[i].objectId == 0)
-      ivAspectRatio = obs[i].width / (float)obs[i].height;
+    {
+      ivAspectRatio = ratio;
+      ratios.push_back(ratio);
+      continue;
+    }
+    int group = 0;
+    for (unsigned int g = 1; g < ratios.size(); ++g)
+      if (fabs(log(ratio / ratios[g])) < fabs(log(ratio / ratios[group])))
+        group = g;
+    if (ivAspectTolerance > 0 && fabs(log(ratio / ratios[group])) > log(1 + ivAspectTolerance))
+    { // new group with a scan grid of its own
+      group = ratios.size();
+      ratios.push_back(ratio);
+    }
     else
-    { // Force aspect ratio to be the same as of the first box
+    { // Force aspect ratio to be the same as of the group
       float centerx = obs[i].x + 0.5 * obs[i].width,
             centery = obs[i].y + 0.5 * obs[i].height;
-      obs[i].width = sqrt(ivAspectRatio * obs[i].width * obs[i].height);
-      obs[i].height = obs[i].width / ivAspectRatio;
+      obs[i].width = sqrt(ratios[group] * obs[i].width * obs[i].height);
+      obs[i].height = obs[i].width / ratios[group];
       obs[i].x = centerx - 0.5 * obs[i].width;
       obs[i].y = centery - 0.5 * obs[i].height;
     }
+    groups[i] = group;
   }
 
   if (ivNObjects == 0)
@@ -250,7 +436,7 @@ void MultiObjectTLD::addObjects(std::vector<ObjectBox> obs)
     }
     // This is the first frame
     ivLKTracker.initFirstFrame(ivCurImage);
-    std::vector<Matrix> initNegPatches = ivFernFilter.addObjects(ivCurImage, obs);
+    std::vector<Matrix> initNegPatches = ivFernFilter.addObjects(ivCurImage, obs, groups);
     for (size_t i = 0; i < initNegPatches.size(); i++)
     {
       NNPatch p(initNegPatches[i]);
@@ -262,7 +448,7 @@ void MultiObjectTLD::addObjects(std::vector<ObjectBox> obs)
     t_file.close();
     #endif
   }else
-    ivFernFilter.addObjects(ivCurImage, obs);
+    ivFernFilter.addObjects(ivCurImage, obs, groups);
 
   for (int i = 0; i < n; i++)
   {
@@ -272,6 +458,9 @@ void MultiObjectTLD::addObjects(std::vector<ObjectBox> obs)
     NNPatch p(obs[i], ivCurImage, ivPatchSize, ivUseColor ? ivCurImagePtr : NULL, ivWidth, ivHeight);
     ivCurrentPatches.push_back(p);
     ivNNClassifier.addObject(p);
+    int scale = ivFernFilter.getScale(obs[i]);
+    ivScaleLow.push_back(scale);
+    ivScaleHigh.push_back(scale);
   }
   ivNObjects += n;
 }
@@ -400,22 +589,71 @@ void MultiObjectTLD::processFrame(unsigned char * img)
   #endif
 
   // DETECTOR
-  ivLastDetections = ivFernFilter.scanPatch(ivCurImage);
+  planDetection();
+  long long detectorStart = getTimeMicro();
+  long long scannedWindows = ivFernFilter.getScanStats().scannedWindows;
+  std::vector<FernDetection> windows = ivFernFilter.scanPatch(ivCurImage);
+  scannedWindows = ivFernFilter.getScanStats().scannedWindows - scannedWindows;
+  if (scannedWindows > 0)
+  {
+    float cost = (float)(getTimeMicro() - detectorStart) / scannedWindows;
+    ivWindowCost = ivWindowCost > 0 ? 0.9f * ivWindowCost + 0.1f * cost : cost;
+  }
   #if TIMING
   t_end = getTime();
   t_detector = t_end - t_start;
   t_start = t_end;
   #endif
+  // one detection per (window, object) pair referring to the window
+  ivLastDetections.clear();
+  ivDetectionWindows.clear();
+  for (unsigned int w = 0; w < windows.size(); ++w)
+  {
+    for (int o = windows[w].box.objectId; o < ivNObjects; ++o)
+    {
+      if (!windows[w].hasObject(o))
+        continue;
+      FernDetection det;
+      det.box = windows[w].box;
+      det.box.objectId = o;
+      det.confidence = windows[w].confidence;
+      det.objectConfidence = windows[w].objectConfidences[o];
+      det.featureData = NULL;
+      det.ss = windows[w].ss;
+      det.imageOffset = windows[w].imageOffset;
+      ivLastDetections.push_back(det);
+      ivDetectionWindows.push_back(w);
+    }
+  }
+  applyVerifyBudget();
+  // one patch per window some detection refers to
+  std::vector<int> windowPatch(windows.size(), -1);
+  std::vector<FernDetection> patchWindows;
+  for (unsigned int i = 0; i < ivLastDetections.size(); ++i)
+  {
+    int & w = ivDetectionWindows[i];
+    if (windowPatch[w] < 0)
+    {
+      windowPatch[w] = detectionPatches.size();
+      detectionPatches.push_back(new NNPatch(windows[w].patch));
+      patchWindows.push_back(windows[w]);
+    }
+    w = windowPatch[w];
+  }
   ivNLastDetections = ivLastDetections.size();
+  ivVerifiedDetections += ivNLastDetections;
   ivLastDetectionClusters.clear();
   if (ivNLastDetections > 0)
   {
+    // similarities of all windows to all objects in one batch
+    std::vector<float> posNCC, negNCC;
+    getWindowSimilarities(patchWindows, detectionPatches, posNCC, negNCC);
     for (int i = 0; i < ivNLastDetections; ++i)
     {
-      detectionPatches.push_back(new NNPatch(ivLastDetections[i].patch));
+      const int w = ivDetectionWindows[i], o = ivLastDetections[i].box.objectId;
       ivLastDetections[i].confidence =
-          ivNNClassifier.getConf(*detectionPatches[i], ivLastDetections[i].box.objectId, false,
-                              ivLastDetections[i].box, ivUseColor ? img : NULL, ivWidth, ivHeight);
+          ivNNClassifier.confFromSimilarities(*detectionPatches[w], o, posNCC[w * ivNObjects + o], negNCC[w],
+                                              ivLastDetections[i].box, ivUseColor ? img : NULL, ivWidth, ivHeight);
     }
     #if ENABLE_CLUSTERING
     clusterDetections(0.5);
@@ -467,7 +705,7 @@ void MultiObjectTLD::processFrame(unsigned char * img)
       {
         //if there is a (better) detection away from tracker result
         ivCurrentBoxes[o] = ivLastDetections[bestId].box;
-        ivCurrentPatches[o] = *detectionPatches[bestId];
+        ivCurrentPatches[o] = *detectionPatches[ivDetectionWindows[bestId]];
         #if DEBUG
         std::cout << "DETECTOR: changed object " << o << " box to ("
             << round(ivCurrentBoxes[o].x) << "," << round(ivCurrentBoxes[o].y) << ", "
@@ -544,6 +782,8 @@ void MultiObjectTLD::processFrame(unsigned char * img)
   for (int o = 0; o < ivNObjects; o++)
   {
     ivCurrentBoxes[o].objectId = o;
+    if (ivValid[o])
+      updateScaleRange(o);
     if (ivValid[o] && !(ivCurrentBoxes[o].x < 0 || ivCurrentBoxes[o].y < 0
                         || ivCurrentBoxes[o].x + ivCurrentBoxes[o].width >= ivWidth-1
                         || ivCurrentBoxes[o].y + ivCurrentBoxes[o].height >= ivHeight-1)
@@ -568,7 +808,7 @@ void MultiObjectTLD::processFrame(unsigned char * img)
           break;
         }
       if (learn)
-        ivNNClassifier.trainNN(*detectionPatches[i], ivLastDetections[i].box.objectId, false);
+        ivNNClassifier.trainNN(*detectionPatches[ivDetectionWindows[i]], ivLastDetections[i].box.objectId, false);
     }
   }
   #if TIMING
@@ -590,7 +830,7 @@ void MultiObjectTLD::processFrame(unsigned char * img)
     }
 
   // clean up
-  for (int i = 0; i < ivNLastDetections; ++i)
+  for (unsigned int i = 0; i < detectionPatches.size(); ++i)
     delete detectionPatches[i];
   detectionPatches.clear();
   #if TIMING
@@ -610,6 +850,254 @@ void MultiObjectTLD::processFrame(unsigned char * img)
 
 }
 
+/// orders detections by descending fern confidence of their object (ties by position)
+struct DetectionBetter
+{
+  const std::vector<FernDetection> & detections;
+  bool operator()(const int & a, const int & b) const
+  {
+    return detections[a].objectConfidence > detections[b].objectConfidence
+           || (detections[a].objectConfidence == detections[b].objectConfidence && a < b);
+  }
+};
+
+/// @details Keeps at most MOTLDSettings::nnVerifyBudget detections per object (the ones with the
+///  highest fern confidence for this object, found by a partial sort) plus the ones overlapping the
+///  tracker box.
+///  The order of the remaining detections is preserved.
+void MultiObjectTLD::applyVerifyBudget()
+{
+  if (ivNNVerifyBudget <= 0)
+    return;
+  const int nDetections = ivLastDetections.size();
+  std::vector<bool> keep(nDetections, false);
+  for (int o = 0; o < ivNObjects; ++o)
+  {
+    std::vector<int> ranked;
+    for (int i = 0; i < nDetections; ++i)
+    {
+      if (ivLastDetections[i].box.objectId != o)
+        continue;
+      if (ivDefined[o] && rectangleOverlap(ivLastDetections[i].box, ivCurrentBoxes[o]) > NN_BUDGET_TRACKER_OVERLAP)
+        keep[i] = true;
+      else
+        ranked.push_back(i);
+    }
+    const int k = MIN((int)ranked.size(), ivNNVerifyBudget);
+    DetectionBetter better = {ivLastDetections};
+    std::partial_sort(ranked.begin(), ranked.begin() + k, ranked.end(), better);
+    for (int r = 0; r < k; ++r)
+      keep[ranked[r]] = true;
+  }
+  int n = 0;
+  for (int i = 0; i < nDetections; ++i)
+    if (keep[i])
+    {
+      ivLastDetections[n] = ivLastDetections[i];
+      ivDetectionWindows[n] = ivDetectionWindows[i];
+      n++;
+    }
+  ivDroppedDetections += nDetections - n;
+  ivLastDetections.resize(n);
+  ivDetectionWindows.resize(n);
+}
+
+/// @details The signature consists of the mean and the standard deviation of the gray values of
+///  the patch and the means of its 3 x 3 blocks.
+void MultiObjectTLD::patchSignature(const NNPatch & patch, float * signature) const
+{
+  const float * data = patch.patch.data();
+  signature[0] = patch.avg;
+  signature[1] = sqrt(patch.norm2 / (ivPatchSize * ivPatchSize));
+  for (int by = 0; by < 3; ++by)
+    for (int bx = 0; bx < 3; ++bx)
+    {
+      const int x0 = bx * ivPatchSize / 3, x1 = (bx + 1) * ivPatchSize / 3;
+      const int y0 = by * ivPatchSize / 3, y1 = (by + 1) * ivPatchSize / 3;
+      float sum = 0;
+      for (int y = y0; y < y1; ++y)
+        for (int x = x0; x < x1; ++x)
+          sum += data[y * ivPatchSize + x];
+      signature[2 + 3 * by + bx] = sum / ((x1 - x0) * (y1 - y0));
+    }
+}
+
+/// @details Same as NNClassifier::getSimilarities() for the patches of the windows, but (see
+///  MOTLDSettings::nnCacheTolerance) windows with the same (rounded) box as a window of the previous
+///  frame and a similar patch signature reuse its similarities, only the other windows are compared
+///  to the classifier. Afterwards the cache holds the windows of this frame; a hit keeps the signature
+///  of the frame the similarities were computed in, so slow changes eventually lead to a miss.
+void MultiObjectTLD::getWindowSimilarities(const std::vector<FernDetection> & windows,
+                                           const std::vector<NNPatch*> & patches,
+                                           std::vector<float> & posNCC, std::vector<float> & negNCC)
+{
+  if (ivNNCacheTolerance < 0)
+  {
+    ivNNClassifier.getSimilarities(patches, false, posNCC, negNCC);
+    return;
+  }
+  if (ivNNClassifier.getVersion() != ivNNCacheVersion)
+  {
+    ivNNCache.clear();
+    ivNNCacheVersion = ivNNClassifier.getVersion();
+  }
+  const int nWindows = windows.size();
+  posNCC.resize(nWindows * ivNObjects);
+  negNCC.resize(nWindows);
+  std::map<unsigned long long, NNCacheEntry> cache;
+  std::vector<NNPatch*> missed;
+  std::vector<int> missedWindows;
+  std::vector<unsigned long long> keys(nWindows);
+  NNCacheEntry entry;
+  for (int w = 0; w < nWindows; ++w)
+  {
+    const ObjectBox & box = windows[w].box;
+    keys[w] = ((unsigned long long)((int)round(box.x) & 0xFFFF) << 48)
+              | ((unsigned long long)((int)round(box.y) & 0xFFFF) << 32)
+              | ((unsigned long long)((int)round(box.width) & 0xFFFF) << 16)
+              | (unsigned long long)((int)round(box.height) & 0xFFFF);
+    patchSignature(*patches[w], entry.signature);
+    std::map<unsigned long long, NNCacheEntry>::const_iterator found = ivNNCache.find(keys[w]);
+    bool hit = found != ivNNCache.end();
+    for (int i = 0; hit && i < NN_CACHE_SIGNATURE; ++i)
+      hit = fabs(entry.signature[i] - found->second.signature[i]) <= ivNNCacheTolerance;
+    if (hit)
+    {
+      for (int o = 0; o < ivNObjects; ++o)
+        posNCC[w * ivNObjects + o] = found->second.posNCC[o];
+      negNCC[w] = found->second.negNCC;
+      cache[keys[w]] = found->second;
+      ivNNCacheHits++;
+    }
+    else
+    {
+      missed.push_back(patches[w]);
+      missedWindows.push_back(w);
+      ivNNCacheMisses++;
+    }
+  }
+  std::vector<float> missedPos, missedNeg;
+  ivNNClassifier.getSimilarities(missed, false, missedPos, missedNeg);
+  entry.posNCC.resize(ivNObjects);
+  for (unsigned int i = 0; i < missed.size(); ++i)
+  {
+    const int w = missedWindows[i];
+    patchSignature(*patches[w], entry.signature);
+    for (int o = 0; o < ivNObjects; ++o)
+      posNCC[w * ivNObjects + o] = entry.posNCC[o] = missedPos[i * ivNObjects + o];
+    negNCC[w] = entry.negNCC = missedNeg[i];
+    cache[keys[w]] = entry;
+  }
+  ivNNCache.swap(cache);
+}
+
+/// @details Extends the range of scales object @c o has been observed at by its current box.
+void MultiObjectTLD::updateScaleRange(const int & o)
+{
+  int scale = ivFernFilter.getScale(ivCurrentBoxes[o]);
+  ivScaleLow[o] = MIN(ivScaleLow[o], scale);
+  ivScaleHigh[o] = MAX(ivScaleHigh[o], scale);
+}
+
+/// @details Returns the scales begin, ..., end - 1 object @c o could occupy in the current frame
+///  (see MOTLDSettings::scaleMargin and MOTLDSettings::lostScaleMargin), all of them belong to
+///  the aspect ratio group of the object.
+void MultiObjectTLD::getScaleBand(const int & o, int & begin, int & end) const
+{
+  int groupBegin, groupEnd;
+  ivFernFilter.getGroupScales(ivFernFilter.getObjectGroup(o), groupBegin, groupEnd);
+  if (ivScaleMargin < 0)
+  {
+    begin = groupBegin;
+    end = groupEnd;
+    return;
+  }
+  int margin = ivScaleMargin + (getStatus(o) == STATUS_LOST ? ivLostScaleMargin : 0);
+  begin = MAX(groupBegin, ivScaleLow[o] - margin);
+  end = MIN(groupEnd, ivScaleHigh[o] + margin + 1);
+}
+
+/// @details Chooses the regions scanned by the detector in the current frame (see
+///  MOTLDSettings::fullScanInterval, MOTLDSettings::detectorBudget and MOTLDSettings::scaleMargin).
+void MultiObjectTLD::planDetection()
+{
+  const int numScales = ivFernFilter.getNumScales();
+  std::vector<FernScanRegion> regions;
+  bool fullScan = ivFullScanInterval <= 1 || ivNextFullScale >= 0
+                  || ivFramesSinceFullScan + 1 >= ivFullScanInterval;
+  for (int o = 0; o < ivNObjects; ++o)
+    if (getStatus(o) != STATUS_OK)
+      fullScan = true;
+
+  // scales some object could occupy
+  std::vector<bool> active(numScales, false);
+  bool allActive = true;
+  for (int o = 0; o < ivNObjects; ++o)
+  {
+    int begin, end;
+    getScaleBand(o, begin, end);
+    for (int i = begin; i < end; ++i)
+      active[i] = true;
+  }
+  for (int i = 0; i < numScales; ++i)
+    allActive = allActive && active[i];
+
+  if (fullScan && ivNextFullScale < 0 && ivDetectorBudget <= 0 && allActive)
+  {
+    // whole frame, all scales
+    ivFramesSinceFullScan = 0;
+    ivFernFilter.changeScanRegions(regions);
+    return;
+  }
+
+  // surroundings of the objects
+  for (int o = 0; o < ivNObjects; ++o)
+  {
+    if (getStatus(o) != STATUS_OK)
+      continue;
+    const ObjectBox & box = ivCurrentBoxes[o];
+    int scale = ivFernFilter.getScale(box);
+    int begin, end;
+    getScaleBand(o, begin, end);
+    FernScanRegion region = {box.x - ivSearchMargin * box.width, box.y - ivSearchMargin * box.height,
+                             (1 + 2 * ivSearchMargin) * box.width, (1 + 2 * ivSearchMargin) * box.height,
+                             MAX(begin, scale - ivSearchScales), MIN(end, scale + ivSearchScales + 1)};
+    regions.push_back(region);
+  }
+
+  if (fullScan)
+  {
+    // whole frame: as many active scales as the budget allows, the remaining ones in the next frames
+    int begin = MAX(0, ivNextFullScale), end = begin;
+    float time = 0;
+    while (end < numScales)
+    {
+      float scaleTime = active[end] ? ivWindowCost * ivFernFilter.getNumWindows(end) / 1000 : 0;
+      if (time > 0 && ivDetectorBudget > 0 && ivWindowCost > 0 && time + scaleTime > ivDetectorBudget)
+        break;
+      time += scaleTime;
+      end++;
+    }
+    for (int i = begin; i < end; ++i)
+    {
+      if (!active[i])
+        continue;
+      FernScanRegion region = {0, 0, (float)ivWidth, (float)ivHeight, i, i + 1};
+      while (region.scaleEnd < end && active[region.scaleEnd])
+        region.scaleEnd++;
+      regions.push_back(region);
+      i = region.scaleEnd;
+    }
+    ivNextFullScale = end < numScales ? end : -1;
+    if (ivNextFullScale < 0)
+      ivFramesSinceFullScan = 0;
+  }
+  else
+    ivFramesSinceFullScan++;
+
+  ivFernFilter.changeScanRegions(regions);
+}
+
 void MultiObjectTLD::clusterDetections(float threshold)
 {
   if (ivNLastDetections == 0)
@@ -717,7 +1205,8 @@ void MultiObjectTLD::clusterDetections(float threshold)
       #endif
       continue; // should not happen, just to be sure
     }
-    FernDetection clDet = {clBox[i], Matrix(), 0, 0};
+    FernDetection clDet = {clBox[i], Matrix(), 0, NULL, NULL, NULL, std::vector<unsigned int>(),
+                           std::vector<float>(), 0};
     ivLastDetectionClusters.push_back(clDet);
   }
   delete[] clId;
@@ -822,9 +1311,10 @@ void MultiObjectTLD::getDebugImage(unsigned char * src, Matrix& rMat, Matrix& gM
     for (unsigned int i = 0; i < negPatches->size() && i < 3*picspercol; ++i)
     {
       int x = ivPatchSize * (i/picspercol), y = ivPatchSize * (i%picspercol);
-      rMat.drawPatch((*negPatches)[i].patch, x, y, (*negPatches)[i].avg);
-      gMat.drawPatch((*negPatches)[i].patch, x, y, (*negPatches)[i].avg);
-      bMat.drawPatch((*negPatches)[i].patch, x, y, (*negPatches)[i].avg);
+      const NNPatch negPatch = ivNNClassifier.getPatch(-1, i);
+      rMat.drawPatch(negPatch.patch, x, y, negPatch.avg);
+      gMat.drawPatch(negPatch.patch, x, y, negPatch.avg);
+      bMat.drawPatch(negPatch.patch, x, y, negPatch.avg);
     }
 
   bool drawhistograms = posPatches->size() > 0 && (*posPatches)[0].size() > 0
@@ -845,9 +1335,10 @@ void MultiObjectTLD::getDebugImage(unsigned char * src, Matrix& rMat, Matrix& gM
         gMat.drawHistogram((*posPatches)[p][i].histogram, startx+ivPatchSize, y, 0, 7, ivPatchSize);
         bMat.drawHistogram((*posPatches)[p][i].histogram, startx+ivPatchSize, y, 0, 7, ivPatchSize);
       }
-      rMat.drawPatch((*posPatches)[p][i].patch, startx, y, (*posPatches)[p][i].avg);
-      gMat.drawPatch((*posPatches)[p][i].patch, startx, y, (*posPatches)[p][i].avg);
-      bMat.drawPatch((*posPatches)[p][i].patch, startx, y, (*posPatches)[p][i].avg);
+      const NNPatch posPatch = ivNNClassifier.getPatch(p, i);
+      rMat.drawPatch(posPatch.patch, startx, y, posPatch.avg);
+      gMat.drawPatch(posPatch.patch, startx, y, posPatch.avg);
+      bMat.drawPatch(posPatch.patch, startx, y, posPatch.avg);
       if (!(mode & DEBUG_DRAW_PATCHES))
         break;
     }
@@ -856,13 +1347,25 @@ void MultiObjectTLD::getDebugImage(unsigned char * src, Matrix& rMat, Matrix& gM
 
 MultiObjectTLD::MultiObjectTLD(int width, int height, int colorMode, int patchSize, int bbMin,
                                 bool useColor, bool fastRotation, NNClassifier nnc, FernFilter ff,
-                                int nObjects, float aspectRatio, bool learningEnabled)
+                                int nObjects, float aspectRatio, bool learningEnabled,
+                                const MOTLDSettings & settings)
      : ivWidth(width), ivHeight(height), ivColorMode(colorMode), ivPatchSize(patchSize),
        ivBBmin(bbMin), ivUseColor(useColor), ivEnableFastRotation(fastRotation),
-       ivLKTracker(LKTracker(width, height)), ivNNClassifier(nnc), ivFernFilter(ff),
+       ivLKTracker(LKTracker(width, height, settings.lkSettings)), ivNNClassifier(nnc), ivFernFilter(ff),
        ivNObjects(nObjects), ivAspectRatio(aspectRatio),
-       ivLearningEnabled(learningEnabled), ivNLastDetections(0)
+       ivLearningEnabled(learningEnabled), ivNLastDetections(0),
+       ivFullScanInterval(settings.fullScanInterval), ivSearchMargin(settings.searchMargin),
+       ivSearchScales(settings.searchScales), ivDetectorBudget(settings.detectorBudget),
+       ivFramesSinceFullScan(0), ivNextFullScale(-1), ivWindowCost(0),
+       ivScaleMargin(settings.scaleMargin), ivLostScaleMargin(settings.lostScaleMargin),
+       ivAspectTolerance(settings.aspectTolerance), ivNNCacheTolerance(settings.nnCacheTolerance),
+       ivNNCacheVersion(0), ivNNCacheHits(0), ivNNCacheMisses(0),
+       ivNNVerifyBudget(settings.nnVerifyBudget), ivVerifiedDetections(0), ivDroppedDetections(0)
 {
+  ivFernFilter.changeScanStride(settings.scanStride, settings.scanRefine);
+  ivNNClassifier.setStore(settings.nnStore);
+  ivNNClassifier.setIndex(settings.nnIndexMin, settings.nnIndexProbes);
+  ivNNClassifier.setLimits(settings.nnMaxPositives, settings.nnMaxNegatives);
   #if TIMING
   std::ofstream t_file("runtime.txt");
   t_file << "tracker\tdetector\tnn\tlearner\tsum";
@@ -872,6 +1375,8 @@ MultiObjectTLD::MultiObjectTLD(int width, int height, int colorMode, int patchSi
   ivDefined = std::vector<bool>(nObjects, false);
   ivValid = std::vector<bool>(nObjects, false);
   ivCurrentPatches = std::vector<NNPatch>(nObjects);
+  ivScaleLow = std::vector<int>(nObjects, 0);
+  ivScaleHigh = std::vector<int>(nObjects, ivFernFilter.getNumScales() - 1);
 }
 
 
@@ -903,7 +1408,7 @@ void MultiObjectTLD::saveClassifier(const char* filename) const
   fileOutput.close();
 }
 
-MultiObjectTLD MultiObjectTLD::loadClassifier(const char* filename)
+MultiObjectTLD MultiObjectTLD::loadClassifier(const char* filename, const MOTLDSettings & settings)
 {
   std::ifstream fileInput(filename, std::ios::in | std::ios::binary);
 
@@ -943,7 +1448,7 @@ MultiObjectTLD MultiObjectTLD::loadClassifier(const char* filename)
   fileInput.close();
 
   return MultiObjectTLD(width, height, colorMode, patchSize, bbMin, useColor, fastRotation, nnc, ff,
-                  nObjects, aspectRatio, learningEnabled);
+                  nObjects, aspectRatio, learningEnabled, settings);
 }
 
 
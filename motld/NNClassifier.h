@@ -24,6 +24,20 @@
 #include <vector>
 #include "Matrix.h"
 #include "Histogram.h"
+#include "Utils.h"
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#define NN_TEMPLATE_BLOCK 64 // templates per block of the batched cross correlation (fit into L1/L2)
+#define NN_QUERY_BLOCK 16    // patches per task of the batched cross correlation
+
+/// defines concerning the storage of the normalized patches (see MOTLDSettings::nnStore)
+#define NN_STORE_FLOAT 0
+#define NN_STORE_INT8 1
 
 /// Data structure representing nearest neighbor patches with color histograms
 class NNPatch
@@ -59,6 +73,123 @@ public:
   void saveToStream(std::ofstream & outputStream) const;
 };
 
+/// A patch prepared for the comparison with the rows of NNTemplates (see NNTemplates::prepare())
+struct NNQuery
+{
+  /// The zero mean patch values
+  const float* values;
+  /// The number of values
+  int length;
+  /// The inverse norm of the patch (0 if the norm is 0)
+  float scale;
+  /// The normalized patch quantized to 16 bit (NN_STORE_INT8 only)
+  const short* codes;
+  /// Factor mapping the dot product of codes and a quantized row to the cosine (without the row scale)
+  float codeScale;
+};
+
+/** @brief Contiguous matrix of patches normalized to unit norm (one aligned row per patch), used
+ * for the batched cross correlation of NNClassifier. With NN_STORE_INT8 each row is stored as 8 bit
+ * integers with a scale of its own (about a quarter of the memory of NN_STORE_FLOAT).
+ */
+class NNTemplates
+{
+public:
+  ///@brief Constructor for patches of size patchSize x patchSize stored as store (NN_STORE_FLOAT or
+  /// NN_STORE_INT8), see setIndex() for the other parameters
+  NNTemplates(int patchSize = 0, int indexMin = 0, int indexProbes = 0, int store = NN_STORE_FLOAT);
+  /// Copy constructor
+  NNTemplates(const NNTemplates& copyFrom);
+  /// Destructor
+  ~NNTemplates();
+  /// Copy operator
+  NNTemplates& operator=(const NNTemplates& copyFrom);
+  /// Appends a patch
+  void push_back(const NNPatch& patch);
+  /// Removes the patch at position i
+  void erase(int i);
+  /// Keeps only the first n patches
+  void resize(int n);
+  /// Returns the number of patches
+  int size() const { return ivSize; }
+  /// Returns the length of a row (number of pixels rounded up to a multiple of 8, padded with zeros)
+  int stride() const { return ivStride; }
+  /// Returns the normalized patch i (NN_STORE_FLOAT only, see values())
+  const float* row(int i) const { return ivData + i * ivStride; }
+  ///@brief Returns the normalized patch i (stride() values); for NN_STORE_INT8 it is decoded into
+  /// buffer, which must hold codeStride() floats
+  const float* values(int i, float* buffer) const;
+  /// Returns @b false if patch i has zero norm (its cross correlation is 0 by definition)
+  bool valid(int i) const { return ivValid[i] != 0; }
+  /// Returns the storage of the rows (NN_STORE_FLOAT or NN_STORE_INT8)
+  int store() const { return ivStore; }
+  /// Returns the length of a quantized row (number of pixels rounded up to a multiple of 16)
+  int codeStride() const { return ivCodeStride; }
+  /// Returns the memory of one row in bytes
+  int rowBytes() const { return ivStore == NN_STORE_INT8 ? ivCodeStride + sizeof(float) : ivStride * sizeof(float); }
+  ///@brief Quantizes query for NN_STORE_INT8 into codes (codeStride() values, 32 byte aligned),
+  /// nothing to do for NN_STORE_FLOAT
+  void prepare(NNQuery& query, short* codes) const;
+  /// Computes the cosines of query and the patches rows[0..3]
+  void dot4(const NNQuery& query, const int* rows, float* cosines) const;
+
+  ///@brief Enables the cluster index from indexMin patches on (0 = never). A search visits at most
+  /// indexProbes clusters (0 = all clusters that may contain a better patch, i.e. exact with respect
+  /// to the stored rows, which are quantized with NN_STORE_INT8)
+  void setIndex(int indexMin, int indexProbes);
+  /// (Re)builds the index if it is enabled and there are enough patches
+  void updateIndex();
+  /// Returns @b true if searches can use the index
+  bool indexed() const { return ivIndexed; }
+  /// Returns the maximum number of clusters visited by a search (0 = no limit)
+  int indexProbes() const { return ivIndexProbes; }
+  /// Returns the number of clusters of the index
+  int numClusters() const { return ivClusterMembers.size(); }
+  /// Returns the normalized center of cluster c (same layout as row())
+  const float* centroid(int c) const { return ivCentroids + c * ivStride; }
+  /// Returns the largest angle between the center of cluster c and one of its patches
+  float clusterRadius(int c) const { return ivClusterRadius[c]; }
+  /// Returns the patches of cluster c
+  const std::vector<int>& clusterMembers(int c) const { return ivClusterMembers[c]; }
+
+  /// Enables keeping track of the most similar other patch of every patch (see mostRedundant())
+  void trackNearest(bool enable);
+  /// Returns the patch in [begin, end) with the highest correlation to its most similar patch (-1 if none)
+  int mostRedundant(int begin, int end) const;
+private:
+  int ivStride, ivSize, ivCapacity;
+  float* ivData;
+  std::vector<char> ivValid;
+  // quantized rows (NN_STORE_INT8)
+  int ivStore, ivCodeStride;
+  signed char* ivCodes;
+  std::vector<float> ivRowScale;
+  // cluster index
+  int ivIndexMin, ivIndexProbes;
+  bool ivIndexed;
+  int ivIndexedSize;
+  float* ivCentroids;
+  std::vector<float> ivClusterRadius;
+  std::vector<std::vector<int> > ivClusterMembers;
+  // most similar other patch (index and cosine) of every patch
+  bool ivTrackNearest;
+  std::vector<int> ivNearest;
+  std::vector<float> ivNearestCos;
+  void reserve(int capacity);
+  void rowQuery(int i, float* values, short* codes, NNQuery& query) const;
+  void addNearest(int i);
+  void updateNearest(int i);
+  void buildIndex();
+  int nearestCluster(const float* patch, float& cosine) const;
+};
+
+/// scratch buffers of NNClassifier::searchIndex() (one per thread, reused between searches)
+struct NNSearchBuffers
+{
+  std::vector<float> bound;
+  std::vector<int> order;
+};
+
 /** @brief The nearest neighbor classifier is invoked at the top level to evaluate detections.
  */
 class NNClassifier
@@ -73,13 +204,43 @@ public:
   /// Returns the confidence of a given patch while subsequently computing and saving the color histogram if needed.
   double getConf(NNPatch& patch, int objId, bool conservative,
                   const ObjectBox& bbox, const unsigned char * rgb, int w, int h) const;
+  ///@brief Computes the maximum similarities (cross correlation mapped to [0, 1]) of several patches at once:
+  /// posNCC[i * number of objects + o] to the positive patches of object o, negNCC[i] to the negative patches.
+  void getSimilarities(const std::vector<NNPatch*>& patches, bool conservative,
+                       std::vector<float>& posNCC, std::vector<float>& negNCC) const;
+  /// Returns the confidence of a patch from its similarities (see getSimilarities()), computing the color histogram if needed.
+  double confFromSimilarities(NNPatch& patch, int objId, double posNCC, double negNCC,
+                              const ObjectBox& bbox, const unsigned char * rgb, int w, int h) const;
+  ///@brief Searches the patches of a class or the negative patches with a cluster index once there are
+  /// indexMin of them (0 = never, default). A search visits at most indexProbes clusters (0 = exact search).
+  /// Exact refers to the stored patches: with NN_STORE_INT8 the index finds the most similar quantized
+  /// patch, just like comparing all quantized patches (see setStore()).
+  void setIndex(int indexMin, int indexProbes);
+  ///@brief Limits the number of positive patches per object and of negative patches (0 = unlimited, default).
+  /// Beyond the limit the patch most similar to another one is removed, except for the first positive patch
+  /// of each object and temporary (warped) patches.
+  void setLimits(int maxPositives, int maxNegatives);
+  /// Returns the number of positive and negative patches removed because of the limits (see setLimits()).
+  void getEvictions(int& positives, int& negatives) const { positives = ivEvictedPos; negatives = ivEvictedNeg; }
+  ///@brief Stores the normalized patches searched by getConf() as float (NN_STORE_FLOAT, default) or
+  /// as 8 bit integers (NN_STORE_INT8, confidences differ slightly). With NN_STORE_INT8 the patches
+  /// keep no pixels of their own (see getPatch()), which cuts the memory per 15 x 15 patch from 1828
+  /// bytes (normalized patch and pixels) to 244 bytes.
+  void setStore(int store);
+  /// Returns the memory of the normalized patches and of the pixels kept with them in bytes (see setStore()).
+  int getTemplateMemory() const;
+  ///@brief Returns positive patch i of object objId (negative patch i for objId = -1); with NN_STORE_INT8
+  /// its pixels are reconstructed from the normalized patch.
+  NNPatch getPatch(int objId, int i) const;
+  /// Returns a number that changes whenever the patches (or the way they are searched) change.
+  unsigned int getVersion() const { return ivVersion; }
   /// Trains a new patch to the classifier if it is considered "new" enough.
   bool trainNN(const NNPatch& patch, int objId = 0, bool positive = true, bool tmp = false);
   /// Initializes a new object class with the given patch.
   void addObject(const NNPatch& patch);
-  /// Returns a pointer to positive patches (intended for drawing).
+  /// Returns a pointer to positive patches (without pixels for NN_STORE_INT8, see getPatch()).
   const std::vector<std::vector<NNPatch> > * getPosPatches() const;
-  /// Returns a pointer to negative patches (intended for drawing).
+  /// Returns a pointer to negative patches (without pixels for NN_STORE_INT8, see getPatch()).
   const std::vector<NNPatch> * getNegPatches() const;
   /// Removes previously added warps (rotated patches) from positive list.
   void removeWarps();
@@ -93,9 +254,23 @@ private:
   static Histogram * ivHistogram;
   std::vector<std::vector<NNPatch> > ivPosPatches;
   std::vector<NNPatch> ivNegPatches;
+  std::vector<NNTemplates> ivPosTemplates;
+  NNTemplates ivNegTemplates;
   std::vector<char> ivWarpIndices;
   bool ivUseColor, ivAllowFastChange;
-  double getConf(const float* patch, float norm2 = 1.0f, int objId = 0, bool conservative = false) const;
+  int ivIndexMin, ivIndexProbes;
+  int ivMaxPos, ivMaxNeg, ivEvictedPos, ivEvictedNeg;
+  int ivStore;
+  unsigned int ivVersion;
+  mutable std::vector<NNSearchBuffers> ivSearchBuffers;
+  void evict(int objId);
+  void dropPixels(NNPatch& patch) const;
+  Matrix restorePixels(const NNTemplates& templates, int i, float norm2) const;
+  void getSimilarity(const NNPatch& patch, int objId, bool conservative, float& posNCC, float& negNCC) const;
+  double combineConf(double posNCC, double negNCC, int objId) const;
+  void correlate(const NNQuery * queries, int nQueries,
+                 const NNTemplates& templates, bool weighted, float * result, int resultStride) const;
+  float searchIndex(const NNQuery& query, const NNTemplates& templates, bool weighted, float best) const;
   double crossCorr(const float* patchA, const float* patchB, float denom = 1) const;
   double cmpHistograms(const float* h1, const float* h2) const;
 };
@@ -207,16 +382,567 @@ NNPatch& NNPatch::operator=(const NNPatch& copyFrom)
   return *this;
 }
 
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// NNTemplates
+
+/// Computes the dot products of query (n values) with four rows (32 byte aligned, padded to a multiple of 8)
+inline void nnDot4(const float * query, const float * const * rows, const int n, float * dots)
+{
+  int i = 0;
+#if defined(__AVX2__)
+  __m256 acc0 = _mm256_setzero_ps(), acc1 = _mm256_setzero_ps();
+  __m256 acc2 = _mm256_setzero_ps(), acc3 = _mm256_setzero_ps();
+  for (; i + 8 <= n; i += 8)
+  {
+    const __m256 v = _mm256_loadu_ps(query + i);
+    acc0 = _mm256_add_ps(acc0, _mm256_mul_ps(v, _mm256_load_ps(rows[0] + i)));
+    acc1 = _mm256_add_ps(acc1, _mm256_mul_ps(v, _mm256_load_ps(rows[1] + i)));
+    acc2 = _mm256_add_ps(acc2, _mm256_mul_ps(v, _mm256_load_ps(rows[2] + i)));
+    acc3 = _mm256_add_ps(acc3, _mm256_mul_ps(v, _mm256_load_ps(rows[3] + i)));
+  }
+  // horizontal sums of the four accumulators
+  __m256 s01 = _mm256_hadd_ps(acc0, acc1), s23 = _mm256_hadd_ps(acc2, acc3);
+  __m256 s = _mm256_hadd_ps(s01, s23);
+  _mm_storeu_ps(dots, _mm_add_ps(_mm256_castps256_ps128(s), _mm256_extractf128_ps(s, 1)));
+#elif defined(__SSE2__)
+  __m128 acc0 = _mm_setzero_ps(), acc1 = _mm_setzero_ps(), acc2 = _mm_setzero_ps(), acc3 = _mm_setzero_ps();
+  for (; i + 4 <= n; i += 4)
+  {
+    const __m128 v = _mm_loadu_ps(query + i);
+    acc0 = _mm_add_ps(acc0, _mm_mul_ps(v, _mm_load_ps(rows[0] + i)));
+    acc1 = _mm_add_ps(acc1, _mm_mul_ps(v, _mm_load_ps(rows[1] + i)));
+    acc2 = _mm_add_ps(acc2, _mm_mul_ps(v, _mm_load_ps(rows[2] + i)));
+    acc3 = _mm_add_ps(acc3, _mm_mul_ps(v, _mm_load_ps(rows[3] + i)));
+  }
+  // transpose and add
+  __m128 t0 = _mm_unpacklo_ps(acc0, acc1), t1 = _mm_unpackhi_ps(acc0, acc1);
+  __m128 t2 = _mm_unpacklo_ps(acc2, acc3), t3 = _mm_unpackhi_ps(acc2, acc3);
+  _mm_storeu_ps(dots, _mm_add_ps(_mm_add_ps(_mm_movelh_ps(t0, t2), _mm_movehl_ps(t2, t0)),
+                                 _mm_add_ps(_mm_movelh_ps(t1, t3), _mm_movehl_ps(t3, t1))));
+#else
+  dots[0] = dots[1] = dots[2] = dots[3] = 0;
+#endif
+  for (; i < n; ++i)
+    for (int k = 0; k < 4; ++k)
+      dots[k] += query[i] * rows[k][i];
+}
+
+///@brief Computes the dot products of query (n 16 bit values, 32 byte aligned) with four rows of
+/// 8 bit values (16 byte aligned), n is a multiple of 16
+inline void nnDot4Int8(const short * query, const signed char * const * rows, const int n, int * dots)
+{
+#if defined(__AVX2__)
+  __m256i acc0 = _mm256_setzero_si256(), acc1 = _mm256_setzero_si256();
+  __m256i acc2 = _mm256_setzero_si256(), acc3 = _mm256_setzero_si256();
+  for (int i = 0; i < n; i += 16)
+  {
+    const __m256i v = _mm256_load_si256((const __m256i*)(query + i));
+    acc0 = _mm256_add_epi32(acc0, _mm256_madd_epi16(v, _mm256_cvtepi8_epi16(_mm_load_si128((const __m128i*)(rows[0] + i)))));
+    acc1 = _mm256_add_epi32(acc1, _mm256_madd_epi16(v, _mm256_cvtepi8_epi16(_mm_load_si128((const __m128i*)(rows[1] + i)))));
+    acc2 = _mm256_add_epi32(acc2, _mm256_madd_epi16(v, _mm256_cvtepi8_epi16(_mm_load_si128((const __m128i*)(rows[2] + i)))));
+    acc3 = _mm256_add_epi32(acc3, _mm256_madd_epi16(v, _mm256_cvtepi8_epi16(_mm_load_si128((const __m128i*)(rows[3] + i)))));
+  }
+  // horizontal sums of the four accumulators
+  __m256i s = _mm256_hadd_epi32(_mm256_hadd_epi32(acc0, acc1), _mm256_hadd_epi32(acc2, acc3));
+  _mm_storeu_si128((__m128i*)dots, _mm_add_epi32(_mm256_castsi256_si128(s), _mm256_extracti128_si256(s, 1)));
+#elif defined(__SSE2__)
+  __m128i acc0 = _mm_setzero_si128(), acc1 = _mm_setzero_si128();
+  __m128i acc2 = _mm_setzero_si128(), acc3 = _mm_setzero_si128();
+  for (int i = 0; i < n; i += 8)
+  {
+    const __m128i v = _mm_load_si128((const __m128i*)(query + i));
+    __m128i r0 = _mm_loadl_epi64((const __m128i*)(rows[0] + i)), r1 = _mm_loadl_epi64((const __m128i*)(rows[1] + i));
+    __m128i r2 = _mm_loadl_epi64((const __m128i*)(rows[2] + i)), r3 = _mm_loadl_epi64((const __m128i*)(rows[3] + i));
+    // sign extension to 16 bit
+    acc0 = _mm_add_epi32(acc0, _mm_madd_epi16(v, _mm_srai_epi16(_mm_unpacklo_epi8(r0, r0), 8)));
+    acc1 = _mm_add_epi32(acc1, _mm_madd_epi16(v, _mm_srai_epi16(_mm_unpacklo_epi8(r1, r1), 8)));
+    acc2 = _mm_add_epi32(acc2, _mm_madd_epi16(v, _mm_srai_epi16(_mm_unpacklo_epi8(r2, r2), 8)));
+    acc3 = _mm_add_epi32(acc3, _mm_madd_epi16(v, _mm_srai_epi16(_mm_unpacklo_epi8(r3, r3), 8)));
+  }
+  // transpose and add
+  __m128i t0 = _mm_unpacklo_epi32(acc0, acc1), t1 = _mm_unpackhi_epi32(acc0, acc1);
+  __m128i t2 = _mm_unpacklo_epi32(acc2, acc3), t3 = _mm_unpackhi_epi32(acc2, acc3);
+  _mm_storeu_si128((__m128i*)dots, _mm_add_epi32(_mm_add_epi32(_mm_unpacklo_epi64(t0, t2), _mm_unpackhi_epi64(t0, t2)),
+                                                 _mm_add_epi32(_mm_unpacklo_epi64(t1, t3), _mm_unpackhi_epi64(t1, t3))));
+#else
+  for (int k = 0; k < 4; ++k)
+  {
+    dots[k] = 0;
+    for (int i = 0; i < n; ++i)
+      dots[k] += query[i] * rows[k][i];
+  }
+#endif
+}
+
+NNTemplates::NNTemplates(int patchSize, int indexMin, int indexProbes, int store)
+  : ivStride((patchSize * patchSize + 7) / 8 * 8), ivSize(0), ivCapacity(0), ivData(NULL), ivStore(store), ivCodeStride((patchSize * patchSize + 15) / 16 * 16), ivCodes(NULL),
+    ivIndexMin(indexMin), ivIndexProbes(indexProbes), ivIndexed(false), ivIndexedSize(0), ivCentroids(NULL),
+    ivTrackNearest(false) {}
+
+NNTemplates::NNTemplates(const NNTemplates& copyFrom)
+  : ivStride(copyFrom.ivStride), ivSize(0), ivCapacity(0), ivData(NULL), ivCodes(NULL), ivCentroids(NULL)
+{
+  *this = copyFrom;
+}
+
+NNTemplates::~NNTemplates()
+{
+  alignedDelete(ivData);
+  alignedDelete(ivCodes);
+  alignedDelete(ivCentroids);
+}
+
+NNTemplates& NNTemplates::operator=(const NNTemplates& copyFrom)
+{
+  if (this != &copyFrom)
+  {
+    alignedDelete(ivData);
+    alignedDelete(ivCodes);
+    ivData = NULL;
+    ivCodes = NULL;
+    ivStride = copyFrom.ivStride;
+    ivStore = copyFrom.ivStore;
+    ivCodeStride = copyFrom.ivCodeStride;
+    ivSize = ivCapacity = 0;
+    reserve(copyFrom.ivSize);
+    if (copyFrom.ivSize > 0 && ivStore == NN_STORE_INT8)
+      memcpy(ivCodes, copyFrom.ivCodes, copyFrom.ivSize * ivCodeStride);
+    else if (copyFrom.ivSize > 0)
+      memcpy(ivData, copyFrom.ivData, copyFrom.ivSize * ivStride * sizeof(float));
+    ivSize = copyFrom.ivSize;
+    ivValid = copyFrom.ivValid;
+    ivRowScale = copyFrom.ivRowScale;
+    ivIndexMin = copyFrom.ivIndexMin;
+    ivIndexProbes = copyFrom.ivIndexProbes;
+    ivIndexed = copyFrom.ivIndexed;
+    ivIndexedSize = copyFrom.ivIndexedSize;
+    ivClusterRadius = copyFrom.ivClusterRadius;
+    ivClusterMembers = copyFrom.ivClusterMembers;
+    ivTrackNearest = copyFrom.ivTrackNearest;
+    ivNearest = copyFrom.ivNearest;
+    ivNearestCos = copyFrom.ivNearestCos;
+    alignedDelete(ivCentroids);
+    ivCentroids = NULL;
+    if (copyFrom.ivCentroids != NULL)
+    {
+      ivCentroids = alignedNew<float>(copyFrom.numClusters() * ivStride);
+      memcpy(ivCentroids, copyFrom.ivCentroids, copyFrom.numClusters() * ivStride * sizeof(float));
+    }
+  }
+  return *this;
+}
+
+void NNTemplates::reserve(int capacity)
+{
+  if (capacity <= ivCapacity)
+    return;
+  if (ivStore == NN_STORE_INT8)
+  {
+    signed char* codes = alignedNew<signed char>(capacity * ivCodeStride);
+    if (ivSize > 0)
+      memcpy(codes, ivCodes, ivSize * ivCodeStride);
+    alignedDelete(ivCodes);
+    ivCodes = codes;
+  }
+  else
+  {
+    float* data = alignedNew<float>(capacity * ivStride);
+    if (ivSize > 0)
+      memcpy(data, ivData, ivSize * ivStride * sizeof(float));
+    alignedDelete(ivData);
+    ivData = data;
+  }
+  ivCapacity = capacity;
+}
+
+const float* NNTemplates::values(int i, float* buffer) const
+{
+  if (ivStore != NN_STORE_INT8)
+    return row(i);
+  const signed char* codes = ivCodes + i * ivCodeStride;
+  for (int k = 0; k < ivStride; ++k)
+    buffer[k] = codes[k] * ivRowScale[i];
+  return buffer;
+}
+
+/// @details The normalized query is scaled to the full 15 bit range, so its rounding error is
+///  negligible compared to the one of the 8 bit rows.
+void NNTemplates::prepare(NNQuery& query, short* codes) const
+{
+  query.codes = codes;
+  query.codeScale = 0;
+  if (ivStore != NN_STORE_INT8)
+    return;
+  float maxAbs = 0;
+  for (int k = 0; k < query.length; ++k)
+    maxAbs = MAX(maxAbs, fabs(query.values[k]));
+  const float step = maxAbs / 16383;
+  const float invStep = maxAbs > 0 ? 1 / step : 0;
+  for (int k = 0; k < query.length; ++k)
+    codes[k] = (short)floor(query.values[k] * invStep + 0.5f);
+  for (int k = query.length; k < ivCodeStride; ++k)
+    codes[k] = 0;
+  query.codeScale = step * query.scale;
+}
+
+/// @details With NN_STORE_INT8 the cosine is computed from the integer dot product of the codes.
+///  Since every value of a row is rounded by at most half its scale s, the error of the cosine of
+///  a query with norm 1 is at most s / 2 times the sum of the absolute values of the query (i.e.
+///  s / 2 * sqrt(number of pixels)); being random, the rounding errors are much smaller in practice.
+void NNTemplates::dot4(const NNQuery& query, const int* rows, float* cosines) const
+{
+  if (ivStore == NN_STORE_INT8)
+  {
+    const signed char* codes[4];
+    for (int k = 0; k < 4; ++k)
+      codes[k] = ivCodes + rows[k] * ivCodeStride;
+    int dots[4];
+    nnDot4Int8(query.codes, codes, ivCodeStride, dots);
+    for (int k = 0; k < 4; ++k)
+      cosines[k] = dots[k] * query.codeScale * ivRowScale[rows[k]];
+    return;
+  }
+  const float* data[4];
+  for (int k = 0; k < 4; ++k)
+    data[k] = row(rows[k]);
+  nnDot4(query.values, data, query.length, cosines);
+  for (int k = 0; k < 4; ++k)
+    cosines[k] *= query.scale;
+}
+
+/// @details Prepares patch i as query; values and codes are buffers of codeStride() elements
+void NNTemplates::rowQuery(int i, float* values, short* codes, NNQuery& query) const
+{
+  query.values = this->values(i, values);
+  query.length = ivStride;
+  query.scale = 1;
+  query.codes = codes;
+  query.codeScale = 0;
+  if (ivStore != NN_STORE_INT8)
+    return;
+  const signed char* src = ivCodes + i * ivCodeStride;
+  for (int k = 0; k < ivCodeStride; ++k)
+    codes[k] = src[k];
+  query.codeScale = ivRowScale[i];
+}
+
+/// @details If the index is up to date, the patch is added to the nearest cluster. Once the number
+///  of patches has doubled since the index was built, the index is rebuilt (with more clusters).
+void NNTemplates::push_back(const NNPatch& patch)
+{
+  if (ivSize == ivCapacity)
+    reserve(MAX(16, 2 * ivCapacity));
+  const int n = patch.patch.size();
+  const bool valid = patch.norm2 > 0;
+  const float scale = valid ? 1 / sqrt(patch.norm2) : 0;
+  const float* src = patch.patch.data();
+  float* dst;
+  std::vector<float> buffer;
+  if (ivStore == NN_STORE_INT8)
+  {
+    // the row scale maps the largest absolute value to 127
+    float maxAbs = 0;
+    for (int i = 0; i < n; ++i)
+      maxAbs = MAX(maxAbs, fabs(src[i] * scale));
+    const float step = maxAbs / 127;
+    const float invStep = maxAbs > 0 ? 1 / step : 0;
+    signed char* codes = ivCodes + ivSize * ivCodeStride;
+    for (int i = 0; i < n; ++i)
+      codes[i] = (signed char)floor(src[i] * scale * invStep + 0.5f);
+    for (int i = n; i < ivCodeStride; ++i)
+      codes[i] = 0;
+    ivRowScale.push_back(step);
+    buffer.resize(ivCodeStride);
+    dst = &buffer[0];
+  }
+  else
+  {
+    dst = ivData + ivSize * ivStride;
+    for (int i = 0; i < n; ++i)
+      dst[i] = src[i] * scale;
+    for (int i = n; i < ivStride; ++i)
+      dst[i] = 0;
+  }
+  ivValid.push_back(valid);
+  ivSize++;
+  if (ivStore == NN_STORE_INT8)
+    values(ivSize - 1, dst);
+  if (ivTrackNearest)
+    addNearest(ivSize - 1);
+  if (ivIndexMin <= 0 || ivSize < ivIndexMin)
+    return;
+  if (!ivIndexed || ivSize > 2 * ivIndexedSize)
+    buildIndex();
+  else if (valid)
+  {
+    float cosine;
+    int c = nearestCluster(dst, cosine);
+    ivClusterMembers[c].push_back(ivSize - 1);
+    ivClusterRadius[c] = MAX(ivClusterRadius[c], acos(MAX(-1.f, MIN(1.f, cosine))));
+  }
+}
+
+/// @details The patch is removed from its cluster (the cluster radius remains a valid bound) and
+///  the patches it was the most similar patch of look for a new one.
+void NNTemplates::erase(int i)
+{
+  if (ivStore == NN_STORE_INT8)
+  {
+    memmove(ivCodes + i * ivCodeStride, ivCodes + (i + 1) * ivCodeStride, (ivSize - i - 1) * ivCodeStride);
+    ivRowScale.erase(ivRowScale.begin() + i);
+  }
+  else
+    memmove(ivData + i * ivStride, ivData + (i + 1) * ivStride, (ivSize - i - 1) * ivStride * sizeof(float));
+  ivValid.erase(ivValid.begin() + i);
+  ivSize--;
+  for (unsigned int c = 0; c < ivClusterMembers.size(); ++c)
+  {
+    std::vector<int>& members = ivClusterMembers[c];
+    for (int m = members.size() - 1; m >= 0; --m)
+      if (members[m] == i)
+        members.erase(members.begin() + m);
+      else if (members[m] > i)
+        members[m]--;
+  }
+  if (ivTrackNearest)
+  {
+    ivNearest.erase(ivNearest.begin() + i);
+    ivNearestCos.erase(ivNearestCos.begin() + i);
+    for (int j = 0; j < ivSize; ++j)
+      if (ivNearest[j] == i)
+        updateNearest(j);
+      else if (ivNearest[j] > i)
+        ivNearest[j]--;
+  }
+}
+
+void NNTemplates::resize(int n)
+{
+  if (n >= ivSize)
+    return;
+  ivSize = n;
+  ivValid.resize(n);
+  if (ivStore == NN_STORE_INT8)
+    ivRowScale.resize(n);
+  for (unsigned int c = 0; c < ivClusterMembers.size(); ++c)
+  {
+    std::vector<int>& members = ivClusterMembers[c];
+    for (int m = members.size() - 1; m >= 0; --m)
+      if (members[m] >= n)
+        members.erase(members.begin() + m);
+  }
+  if (ivTrackNearest)
+  {
+    ivNearest.resize(n);
+    ivNearestCos.resize(n);
+    for (int j = 0; j < n; ++j)
+      if (ivNearest[j] >= n)
+        updateNearest(j);
+  }
+}
+
+void NNTemplates::trackNearest(bool enable)
+{
+  ivTrackNearest = enable;
+  ivNearest.clear();
+  ivNearestCos.clear();
+  if (enable)
+    for (int i = 0; i < ivSize; ++i)
+      addNearest(i);
+}
+
+/// @details Compares the (new) patch i to the patches 0..i-1, which in turn may get i as their most similar patch
+void NNTemplates::addNearest(int i)
+{
+  ivNearest.push_back(-1);
+  ivNearestCos.push_back(-2);
+  float* values = alignedNew<float>(ivCodeStride);
+  short* codes = alignedNew<short>(ivCodeStride);
+  NNQuery query;
+  rowQuery(i, values, codes, query);
+  for (int j = 0; j < i; j += 4)
+  {
+    int rows[4];
+    for (int k = 0; k < 4; ++k)
+      rows[k] = MIN(j + k, i - 1);
+    float dots[4];
+    dot4(query, rows, dots);
+    for (int k = 0; k < 4 && j + k < i; ++k)
+    {
+      if (dots[k] > ivNearestCos[i])
+      {
+        ivNearestCos[i] = dots[k];
+        ivNearest[i] = j + k;
+      }
+      if (dots[k] > ivNearestCos[j + k])
+      {
+        ivNearestCos[j + k] = dots[k];
+        ivNearest[j + k] = i;
+      }
+    }
+  }
+  alignedDelete(values);
+  alignedDelete(codes);
+}
+
+void NNTemplates::updateNearest(int i)
+{
+  ivNearest[i] = -1;
+  ivNearestCos[i] = -2;
+  float* values = alignedNew<float>(ivCodeStride);
+  short* codes = alignedNew<short>(ivCodeStride);
+  NNQuery query;
+  rowQuery(i, values, codes, query);
+  for (int j = 0; j < ivSize; j += 4)
+  {
+    int rows[4];
+    for (int k = 0; k < 4; ++k)
+      rows[k] = MIN(j + k, ivSize - 1);
+    float dots[4];
+    dot4(query, rows, dots);
+    for (int k = 0; k < 4 && j + k < ivSize; ++k)
+      if (j + k != i && dots[k] > ivNearestCos[i])
+      {
+        ivNearestCos[i] = dots[k];
+        ivNearest[i] = j + k;
+      }
+  }
+  alignedDelete(values);
+  alignedDelete(codes);
+}
+
+int NNTemplates::mostRedundant(int begin, int end) const
+{
+  int result = -1;
+  for (int i = MAX(0, begin); i < MIN(end, (int)ivNearest.size()); ++i)
+    if (ivNearest[i] >= 0 && (result < 0 || ivNearestCos[i] > ivNearestCos[result]))
+      result = i;
+  return result;
+}
+
+void NNTemplates::setIndex(int indexMin, int indexProbes)
+{
+  ivIndexMin = indexMin;
+  ivIndexProbes = indexProbes;
+  ivIndexed = false;
+  updateIndex();
+}
+
+void NNTemplates::updateIndex()
+{
+  if (ivIndexMin > 0 && ivSize >= ivIndexMin)
+    buildIndex();
+  else
+  {
+    ivIndexed = false;
+    alignedDelete(ivCentroids);
+    ivCentroids = NULL;
+    ivClusterRadius.clear();
+    ivClusterMembers.clear();
+  }
+}
+
+/// @details Clusters the valid patches into sqrt(n) clusters by spherical k-means (one refinement
+///  step starting with evenly spaced patches as centers) and stores for each cluster the largest
+///  angle between its center and its patches, which bounds the correlation of a query with any
+///  patch of the cluster (see NNClassifier::searchIndex()).
+void NNTemplates::buildIndex()
+{
+  std::vector<int> rows;
+  for (int i = 0; i < ivSize; ++i)
+    if (ivValid[i])
+      rows.push_back(i);
+  const int n = rows.size();
+  const int nClusters = MAX(1, (int)sqrt((float)n));
+  std::vector<float> buffer(ivCodeStride);
+  alignedDelete(ivCentroids);
+  ivCentroids = alignedNew<float>(nClusters * ivStride);
+  for (int c = 0; c < nClusters; ++c)
+    if (n > 0)
+      memcpy(ivCentroids + c * ivStride, values(rows[(long long)c * n / nClusters], &buffer[0]),
+             ivStride * sizeof(float));
+    else
+      memset(ivCentroids + c * ivStride, 0, ivStride * sizeof(float));
+  ivClusterMembers.assign(nClusters, std::vector<int>());
+  ivClusterRadius.assign(nClusters, 0);
+  std::vector<float> cosines(n);
+  for (int iteration = 0; iteration < 2; ++iteration)
+  {
+    for (int c = 0; c < nClusters; ++c)
+      ivClusterMembers[c].clear();
+    for (int i = 0; i < n; ++i)
+      ivClusterMembers[nearestCluster(values(rows[i], &buffer[0]), cosines[i])].push_back(rows[i]);
+    if (iteration > 0)
+      break;
+    // move the centers to the normalized means of their clusters
+    for (int c = 0; c < nClusters; ++c)
+    {
+      if (ivClusterMembers[c].empty())
+        continue;
+      float* center = ivCentroids + c * ivStride;
+      memset(center, 0, ivStride * sizeof(float));
+      for (unsigned int m = 0; m < ivClusterMembers[c].size(); ++m)
+      {
+        const float* member = values(ivClusterMembers[c][m], &buffer[0]);
+        for (int k = 0; k < ivStride; ++k)
+          center[k] += member[k];
+      }
+      float norm2 = 0;
+      for (int k = 0; k < ivStride; ++k)
+        norm2 += center[k] * center[k];
+      const float scale = norm2 > 0 ? 1 / sqrt(norm2) : 0;
+      for (int k = 0; k < ivStride; ++k)
+        center[k] *= scale;
+    }
+  }
+  for (int c = 0; c < nClusters; ++c)
+    for (unsigned int m = 0; m < ivClusterMembers[c].size(); ++m)
+    {
+      // members are in the order of rows, so their cosines can be found by a search
+      const int i = std::lower_bound(rows.begin(), rows.end(), ivClusterMembers[c][m]) - rows.begin();
+      ivClusterRadius[c] = MAX(ivClusterRadius[c], acos(MAX(-1.f, MIN(1.f, cosines[i]))));
+    }
+  ivIndexed = true;
+  ivIndexedSize = ivSize;
+}
+
+/// @details Returns the cluster whose center has the largest cosine with the (normalized) patch
+int NNTemplates::nearestCluster(const float* patch, float& cosine) const
+{
+  const int nClusters = numClusters();
+  int best = 0;
+  cosine = -2;
+  for (int c = 0; c < nClusters; c += 4)
+  {
+    const float* rows[4];
+    for (int k = 0; k < 4; ++k)
+      rows[k] = centroid(MIN(c + k, nClusters - 1));
+    float dots[4];
+    nnDot4(patch, rows, ivStride, dots);
+    for (int k = 0; k < 4 && c + k < nClusters; ++k)
+      if (dots[k] > cosine)
+      {
+        cosine = dots[k];
+        best = c + k;
+      }
+  }
+  return best;
+}
+
 ////////////////////////////////////////////////////////////////////////////////////////////////////
 // NNClassifier
 
 Histogram * NNClassifier::ivHistogram = Histogram::getInstance();
 
 NNClassifier::NNClassifier(int width, int height, int patchSize, bool useColor, bool allowFastChange)
-  : ivWidth(width), ivHeight(height), ivPatchSize(patchSize),
-    ivUseColor(useColor), ivAllowFastChange(allowFastChange) {}
+  : ivWidth(width), ivHeight(height), ivPatchSize(patchSize), ivNegTemplates(patchSize),
+    ivUseColor(useColor), ivAllowFastChange(allowFastChange), ivIndexMin(0), ivIndexProbes(0),
+    ivMaxPos(0), ivMaxNeg(0), ivEvictedPos(0), ivEvictedNeg(0), ivStore(NN_STORE_FLOAT), ivVersion(0),
+    ivSearchBuffers(1) {}
 
 NNClassifier::NNClassifier(std::ifstream & inputStream)
+  : ivIndexMin(0), ivIndexProbes(0), ivMaxPos(0), ivMaxNeg(0), ivEvictedPos(0), ivEvictedNeg(0),
+    ivStore(NN_STORE_FLOAT), ivVersion(0), ivSearchBuffers(1)
 {
   inputStream.read((char*)&ivWidth, sizeof(int));
   inputStream.read((char*)&ivHeight, sizeof(int));
@@ -224,16 +950,24 @@ NNClassifier::NNClassifier(std::ifstream & inputStream)
   inputStream.read((char*)&ivUseColor, sizeof(bool));
   inputStream.read((char*)&ivAllowFastChange, sizeof(bool));
   int nNeg, nObs, nPos;
+  ivNegTemplates = NNTemplates(ivPatchSize);
   inputStream.read((char*)&nNeg, sizeof(int));
   for(int i = 0; i < nNeg; ++i)
+  {
     ivNegPatches.push_back(NNPatch(inputStream, ivPatchSize));
+    ivNegTemplates.push_back(ivNegPatches.back());
+  }
   inputStream.read((char*)&nObs, sizeof(int));
   ivPosPatches = std::vector<std::vector<NNPatch> >(nObs);
+  ivPosTemplates = std::vector<NNTemplates>(nObs, NNTemplates(ivPatchSize));
   for(int i = 0; i < nObs; ++i)
   {
     inputStream.read((char*)&nPos, sizeof(int));
     for(int j = 0; j < nPos; ++j)
+    {
       ivPosPatches[i].push_back(NNPatch(inputStream, ivPatchSize));
+      ivPosTemplates[i].push_back(ivPosPatches[i].back());
+    }
   }
 }
 
@@ -252,7 +986,9 @@ void NNClassifier::removeWarps()
     if(ivWarpIndices[p] > 0)
     {
       ivPosPatches[p].erase(ivPosPatches[p].end() - ivWarpIndices[p], ivPosPatches[p].end());
+      ivPosTemplates[p].resize(ivPosPatches[p].size());
       ivWarpIndices[p] = 0;
+      ivVersion++;
     }
 }
 
@@ -260,14 +996,20 @@ void NNClassifier::addObject(const NNPatch& patch)
 {
   ivPosPatches.push_back(std::vector<NNPatch>());
   ivPosPatches[ivPosPatches.size() - 1].push_back(patch);
+  ivPosTemplates.push_back(NNTemplates(ivPatchSize, ivIndexMin, ivIndexProbes, ivStore));
+  ivPosTemplates.back().trackNearest(ivMaxPos > 0);
+  ivPosTemplates.back().push_back(patch);
+  dropPixels(ivPosPatches.back().back());
   ivWarpIndices.push_back(0);
+  ivVersion++;
   // remove negative patches that are too similar to this new object
   for(int i = ivNegPatches.size() - 1; i >= 0; i--)
   {
-    double ncc = crossCorr(ivNegPatches[i].patch.data(), patch.patch.data(),
+    double ncc = crossCorr(getPatch(-1, i).patch.data(), patch.patch.data(),
                            ivNegPatches[i].norm2 * patch.norm2);
     if(ncc > 0.8){
       ivNegPatches.erase(ivNegPatches.begin() + i);
+      ivNegTemplates.erase(i);
       #if DEBUG
       std::cout << "removed negative patch " << i << " (ncc = " << ncc << ")" << std::endl;
       #endif
@@ -275,6 +1017,90 @@ void NNClassifier::addObject(const NNPatch& patch)
   }
 }
 
+void NNClassifier::setIndex(int indexMin, int indexProbes)
+{
+  ivIndexMin = indexMin;
+  ivIndexProbes = indexProbes;
+  ivNegTemplates.setIndex(indexMin, indexProbes);
+  for (unsigned int i = 0; i < ivPosTemplates.size(); ++i)
+    ivPosTemplates[i].setIndex(indexMin, indexProbes);
+  ivVersion++;
+}
+
+/// @details The normalized patches are rebuilt from the pixels of the patches, which are first
+///  restored if the patches were stored as NN_STORE_INT8 (and dropped again for NN_STORE_INT8).
+void NNClassifier::setStore(int store)
+{
+  for (unsigned int i = 0; i < ivNegPatches.size(); ++i)
+    if (ivNegPatches[i].patch.size() == 0)
+      ivNegPatches[i].patch = restorePixels(ivNegTemplates, i, ivNegPatches[i].norm2);
+  for (unsigned int o = 0; o < ivPosTemplates.size(); ++o)
+    for (unsigned int i = 0; i < ivPosPatches[o].size(); ++i)
+      if (ivPosPatches[o][i].patch.size() == 0)
+        ivPosPatches[o][i].patch = restorePixels(ivPosTemplates[o], i, ivPosPatches[o][i].norm2);
+  ivStore = store;
+  ivVersion++;
+  ivNegTemplates = NNTemplates(ivPatchSize, ivIndexMin, ivIndexProbes, store);
+  ivNegTemplates.trackNearest(ivMaxNeg > 0);
+  for (unsigned int i = 0; i < ivNegPatches.size(); ++i)
+    ivNegTemplates.push_back(ivNegPatches[i]);
+  for (unsigned int o = 0; o < ivPosTemplates.size(); ++o)
+  {
+    ivPosTemplates[o] = NNTemplates(ivPatchSize, ivIndexMin, ivIndexProbes, store);
+    ivPosTemplates[o].trackNearest(ivMaxPos > 0);
+    for (unsigned int i = 0; i < ivPosPatches[o].size(); ++i)
+      ivPosTemplates[o].push_back(ivPosPatches[o][i]);
+  }
+  for (unsigned int i = 0; i < ivNegPatches.size(); ++i)
+    dropPixels(ivNegPatches[i]);
+  for (unsigned int o = 0; o < ivPosPatches.size(); ++o)
+    for (unsigned int i = 0; i < ivPosPatches[o].size(); ++i)
+      dropPixels(ivPosPatches[o][i]);
+}
+
+/// @details With NN_STORE_INT8 the pixels of a stored patch are released, since the normalized
+///  patch (times the norm of the patch) reproduces them well enough (see restorePixels()).
+void NNClassifier::dropPixels(NNPatch& patch) const
+{
+  if (ivStore == NN_STORE_INT8)
+    patch.patch = Matrix();
+}
+
+/// @details Reconstructs the pixels (minus their average) of patch i from its normalized patch.
+Matrix NNClassifier::restorePixels(const NNTemplates& templates, int i, float norm2) const
+{
+  std::vector<float> buffer(templates.codeStride());
+  const float* values = templates.values(i, &buffer[0]);
+  const float norm = sqrt(norm2);
+  Matrix result(ivPatchSize, ivPatchSize);
+  float* pixels = result.data();
+  for (int k = 0; k < ivPatchSize * ivPatchSize; ++k)
+    pixels[k] = values[k] * norm;
+  return result;
+}
+
+NNPatch NNClassifier::getPatch(int objId, int i) const
+{
+  NNPatch result(objId < 0 ? ivNegPatches[i] : ivPosPatches[objId][i]);
+  if (result.patch.size() == 0)
+    result.patch = restorePixels(objId < 0 ? ivNegTemplates : ivPosTemplates[objId], i, result.norm2);
+  return result;
+}
+
+int NNClassifier::getTemplateMemory() const
+{
+  int result = ivNegTemplates.size() * ivNegTemplates.rowBytes();
+  for (unsigned int i = 0; i < ivNegPatches.size(); ++i)
+    result += ivNegPatches[i].patch.size() * sizeof(float);
+  for (unsigned int o = 0; o < ivPosTemplates.size(); ++o)
+  {
+    result += ivPosTemplates[o].size() * ivPosTemplates[o].rowBytes();
+    for (unsigned int i = 0; i < ivPosPatches[o].size(); ++i)
+      result += ivPosPatches[o][i].patch.size() * sizeof(float);
+  }
+  return result;
+}
+
 /// @param patch the patch that shall be learned
 /// @param objId id of the object class to which the patch should be added
 /// @param positive @b true if element of this class, @b false if not (background patch)
@@ -288,27 +1114,81 @@ bool NNClassifier::trainNN(const NNPatch& patch, int objId, bool positive, bool
     if(conf < 0.75)
     {
       ivPosPatches[objId].push_back(patch);
+      ivPosTemplates[objId].push_back(patch);
+      dropPixels(ivPosPatches[objId].back());
       if(tmp)
         ivWarpIndices[objId]++;
+      evict(objId);
+      ivVersion++;
       return true;
     }
   }
   else if(conf < 0.85)
   {
     ivNegPatches.push_back(patch);
+    ivNegTemplates.push_back(patch);
+    dropPixels(ivNegPatches.back());
+    evict(-1);
+    ivVersion++;
     return true;
   }
   return false;
 }
 
+void NNClassifier::setLimits(int maxPositives, int maxNegatives)
+{
+  ivMaxPos = maxPositives;
+  ivMaxNeg = maxNegatives;
+  ivVersion++;
+  ivNegTemplates.trackNearest(ivMaxNeg > 0);
+  evict(-1);
+  for (unsigned int i = 0; i < ivPosTemplates.size(); ++i)
+  {
+    ivPosTemplates[i].trackNearest(ivMaxPos > 0);
+    evict(i);
+  }
+}
+
+/// @details Removes the most redundant patches (highest correlation to their most similar patch)
+///  of object objId (or the negative patches for objId = -1) until the limit is met. The first
+///  positive patch (reference for the color histogram) and temporary warps are kept.
+void NNClassifier::evict(int objId)
+{
+  if (objId < 0)
+  {
+    while (ivMaxNeg > 0 && (int)ivNegPatches.size() > ivMaxNeg)
+    {
+      int i = ivNegTemplates.mostRedundant(0, ivNegPatches.size());
+      if (i < 0)
+        break;
+      ivNegPatches.erase(ivNegPatches.begin() + i);
+      ivNegTemplates.erase(i);
+      ivEvictedNeg++;
+    }
+    return;
+  }
+  std::vector<NNPatch>& patches = ivPosPatches[objId];
+  while (ivMaxPos > 0 && (int)patches.size() > ivMaxPos)
+  {
+    int i = ivPosTemplates[objId].mostRedundant(1, patches.size() - ivWarpIndices[objId]);
+    if (i < 0)
+      break;
+    patches.erase(patches.begin() + i);
+    ivPosTemplates[objId].erase(i);
+    ivEvictedPos++;
+  }
+}
+
 /// @param patch the patch that shall be evaluated
 /// @param objId Id of the class to compare or -1 for comparison to negative (background) patches
 /// @param conservative If @b true earlier positive patches are weighted more.
 double NNClassifier::getConf(const NNPatch& patch, int objId, bool conservative) const
 {
+  float posNCC, negNCC;
+  getSimilarity(patch, objId, conservative, posNCC, negNCC);
+  double conf = combineConf(posNCC, negNCC, objId);
   if(ivUseColor)
   {
-    double conf = getConf(patch.patch.data(), patch.norm2, objId, conservative);
     if(objId < 0 || conf < 0.58 || patch.histogram == NULL || ivPosPatches[objId][0].histogram == NULL)
       return conf;
     double colorCons = cmpHistograms(ivPosPatches[objId][0].histogram, patch.histogram);
@@ -318,16 +1198,70 @@ double NNClassifier::getConf(const NNPatch& patch, int objId, bool conservative)
       return conf * 0.8;
     return conf + (1-conf) * 0.4;
   } //else
-  return getConf(patch.patch.data(), patch.norm2, objId, conservative);
+  return conf;
 }
 
 /// @see getConf(const NNPatch& patch, int objId, bool conservative)
 double NNClassifier::getConf(NNPatch& patch, int objId, bool conservative,
                   const ObjectBox& bbox, const unsigned char * rgb, int w, int h) const
 {
+  float posNCC, negNCC;
+  getSimilarity(patch, objId, conservative, posNCC, negNCC);
+  return confFromSimilarities(patch, objId, posNCC, negNCC, bbox, rgb, w, h);
+}
+
+/// @details The patches are compared to NN_QUERY_BLOCK patches at a time in parallel, each block
+///  against the normalized templates of all objects and the negative templates (see correlate()).
+/// @param patches the patches that shall be evaluated
+/// @param conservative If @b true earlier positive patches are weighted more.
+/// @param posNCC maximum similarity of patch i to the positive patches of object o at i * number of objects + o
+/// @param negNCC maximum similarity of patch i to the negative patches
+void NNClassifier::getSimilarities(const std::vector<NNPatch*>& patches, bool conservative,
+                                   std::vector<float>& posNCC, std::vector<float>& negNCC) const
+{
+  const int nPatches = patches.size();
+  const int nObjects = ivPosTemplates.size();
+  posNCC.assign(nPatches * nObjects, 0);
+  //hack! there should always be a negative example from initialization
+  negNCC.assign(nPatches, ivNegPatches.empty() ? 0.3f : 0);
+  if (nPatches == 0)
+    return;
+  const int codeStride = ivNegTemplates.codeStride();
+  short* codes = ivStore == NN_STORE_INT8 ? alignedNew<short>(nPatches * codeStride) : NULL;
+  std::vector<NNQuery> queries(nPatches);
+  for (int i = 0; i < nPatches; ++i)
+  {
+    queries[i].values = patches[i]->patch.data();
+    queries[i].length = ivPatchSize * ivPatchSize;
+    queries[i].scale = patches[i]->norm2 > 0 ? 1 / sqrt(patches[i]->norm2) : 0;
+    ivNegTemplates.prepare(queries[i], codes + i * codeStride);
+  }
+  const bool weighted = !ivAllowFastChange && conservative;
+  #pragma omp parallel
+  {
+    #pragma omp single
+    if ((int)ivSearchBuffers.size() < getNumThreads())
+      ivSearchBuffers.resize(getNumThreads());
+    #pragma omp for schedule(dynamic)
+    for (int i = 0; i < nPatches; i += NN_QUERY_BLOCK)
+    {
+      const int count = MIN(NN_QUERY_BLOCK, nPatches - i);
+      for (int o = 0; o < nObjects; ++o)
+        correlate(&queries[i], count, ivPosTemplates[o], weighted, &posNCC[i * nObjects + o], nObjects);
+      if (!ivNegPatches.empty())
+        correlate(&queries[i], count, ivNegTemplates, false, &negNCC[i], 1);
+    }
+  }
+  alignedDelete(codes);
+}
+
+/// @see getConf(NNPatch& patch, int objId, bool conservative, const ObjectBox& bbox, const unsigned char * rgb, int w, int h)
+double NNClassifier::confFromSimilarities(NNPatch& patch, int objId, double posNCC, double negNCC,
+                                          const ObjectBox& bbox, const unsigned char * rgb, int w, int h) const
+{
+  double conf = combineConf(posNCC, negNCC, objId);
   if(ivUseColor)
   {
-    double conf = getConf(patch.patch.data(), patch.norm2, objId, conservative);
     if(objId < 0 || conf < 0.58 || ivPosPatches[objId][0].histogram == NULL)
       return conf;
     else{
@@ -345,50 +1279,152 @@ double NNClassifier::getConf(NNPatch& patch, int objId, bool conservative,
       return conf;
     }
   } //else
-  return getConf(patch.patch.data(), patch.norm2, objId, conservative);
+  return conf;
 }
 
-double NNClassifier::getConf(const float* patch, float norm2, int objId, bool conservative) const
+void NNClassifier::getSimilarity(const NNPatch& patch, int objId, bool conservative, float& posNCC, float& negNCC) const
 {
+  short* codes = ivStore == NN_STORE_INT8 ? alignedNew<short>(ivNegTemplates.codeStride()) : NULL;
+  NNQuery query;
+  query.values = patch.patch.data();
+  query.length = ivPatchSize * ivPatchSize;
+  query.scale = patch.norm2 > 0 ? 1 / sqrt(patch.norm2) : 0;
+  ivNegTemplates.prepare(query, codes);
   //max NCC with positive examples
-  double posNCC = 0;
+  posNCC = 0;
   if (objId >= 0)
-  {
-    int nPos = ivPosPatches[objId].size();
-    double* posNCCs = new double[nPos];
-    #pragma omp parallel for
-    for (int i = 0; i < nPos; i++)
-    {
-      posNCCs[i] = crossCorr(ivPosPatches[objId][i].patch.data(), patch, (ivPosPatches[objId][i].norm2 * norm2));
-      if (!ivAllowFastChange && conservative && i > nPos/2)
-        posNCCs[i] *= 1.0 - 0.05 * (i-nPos/2) / (double)nPos;
-    }
-    for (int i = 0; i < nPos; i++)
-      if (posNCCs[i] > posNCC)
-        posNCC = posNCCs[i];
-    delete[] posNCCs;
-  }
+    correlate(&query, 1, ivPosTemplates[objId], !ivAllowFastChange && conservative, &posNCC, 1);
   //max NCC with negative examples
-  double negNCC = 0;
-  int nNeg = ivNegPatches.size();
-  if (nNeg)
-  {
-    double* negNCCs = new double[nNeg];
-    #pragma omp parallel for
-    for (int i = 0; i < nNeg; i++)
-      negNCCs[i] = crossCorr(ivNegPatches[i].patch.data(), patch, (ivNegPatches[i].norm2 * norm2));
-    for (int i = 0; i < nNeg; i++)
-      if (negNCCs[i] > negNCC)
-        negNCC = negNCCs[i];
-    delete[] negNCCs;
-  }else
+  negNCC = 0;
+  if (!ivNegPatches.empty())
+    correlate(&query, 1, ivNegTemplates, false, &negNCC, 1);
+  else
     negNCC = 0.3; //hack! there should always be a negative example from initialization
+  alignedDelete(codes);
+}
 
+double NNClassifier::combineConf(double posNCC, double negNCC, int objId) const
+{
   if(objId < 0)
     return negNCC;
   return (1 - negNCC) / (2 - negNCC - posNCC);
 }
 
+/// @details Updates result[q * resultStride] with the maximum similarity (NCC + 1) / 2 of query q
+///  (skipped if its norm is 0, see NNTemplates::prepare()) to the templates. The templates
+///  are processed in blocks of NN_TEMPLATE_BLOCK rows which stay in cache for all queries, each
+///  query is compared to four templates at a time with SIMD. If the templates are indexed, only
+///  the shortlist of searchIndex() is compared. If @c weighted is set, the later half of the
+///  templates is weighted less (conservative confidence).
+void NNClassifier::correlate(const NNQuery * queries, int nQueries,
+                             const NNTemplates& templates, bool weighted, float * result, int resultStride) const
+{
+  const int nTemplates = templates.size();
+  const int half = nTemplates / 2;
+  if (templates.indexed())
+  {
+    for (int q = 0; q < nQueries; ++q)
+      if (queries[q].scale != 0)
+        result[q * resultStride] = searchIndex(queries[q], templates, weighted, result[q * resultStride]);
+    return;
+  }
+  for (int b = 0; b < nTemplates; b += NN_TEMPLATE_BLOCK)
+  {
+    const int bEnd = MIN(nTemplates, b + NN_TEMPLATE_BLOCK);
+    for (int q = 0; q < nQueries; ++q)
+    {
+      if (queries[q].scale == 0)
+        continue;
+      float best = result[q * resultStride];
+      for (int t = b; t < bEnd; t += 4)
+      {
+        const int count = MIN(4, bEnd - t);
+        int rows[4];
+        for (int k = 0; k < 4; ++k)
+          rows[k] = t + MIN(k, count - 1);
+        float dots[4];
+        templates.dot4(queries[q], rows, dots);
+        for (int k = 0; k < count; ++k)
+        {
+          const int j = t + k;
+          float ncc = templates.valid(j) ? (dots[k] + 1) / 2 : 0;
+          if (weighted && j > half)
+            ncc *= 1.0 - 0.05 * (j - half) / (double)nTemplates;
+          best = MAX(best, ncc);
+        }
+      }
+      result[q * resultStride] = best;
+    }
+  }
+}
+
+/// orders clusters by descending bound
+struct NNClusterBetter
+{
+  const std::vector<float> & bound;
+  bool operator()(const int & a, const int & b) const { return bound[a] > bound[b]; }
+};
+
+/// @details The angle between the query and any patch of a cluster is at least the angle between
+///  the query and the cluster center minus the cluster radius, which bounds the similarity of
+///  the cluster's patches. The clusters are visited by descending bound until the bound does not
+///  exceed the best similarity found so far (so the search is exact) or templates.indexProbes()
+///  clusters have been visited (approximate). With NN_STORE_INT8 the clusters are built from the
+///  quantized rows, so the search is exact with respect to those (up to the rounding of the query).
+///  Returns the maximum of best and the similarities found.
+float NNClassifier::searchIndex(const NNQuery& query, const NNTemplates& templates, bool weighted, float best) const
+{
+  const int nTemplates = templates.size();
+  const int half = nTemplates / 2;
+  const int nClusters = templates.numClusters();
+  NNSearchBuffers& buffers = ivSearchBuffers[getThreadNum()];
+  std::vector<float>& bound = buffers.bound;
+  std::vector<int>& order = buffers.order;
+  bound.resize(nClusters);
+  order.resize(nClusters);
+  for (int c = 0; c < nClusters; c += 4)
+  {
+    const float* rows[4];
+    for (int k = 0; k < 4; ++k)
+      rows[k] = templates.centroid(MIN(c + k, nClusters - 1));
+    float dots[4];
+    nnDot4(query.values, rows, query.length, dots);
+    for (int k = 0; k < 4 && c + k < nClusters; ++k)
+    {
+      const float angle = acos(MAX(-1.f, MIN(1.f, dots[k] * query.scale)));
+      // (small tolerance for rounding errors)
+      bound[c + k] = (cos(MAX(0.f, angle - templates.clusterRadius(c + k))) + 1) / 2 + 1e-5f;
+      order[c + k] = c + k;
+    }
+  }
+  NNClusterBetter better = {bound};
+  std::sort(order.begin(), order.end(), better);
+  const int probes = templates.indexProbes() > 0 ? MIN(nClusters, templates.indexProbes()) : nClusters;
+  for (int v = 0; v < probes && bound[order[v]] > best; ++v)
+  {
+    const std::vector<int>& members = templates.clusterMembers(order[v]);
+    const int nMembers = members.size();
+    for (int m = 0; m < nMembers; m += 4)
+    {
+      const int count = MIN(4, nMembers - m);
+      int rows[4];
+      for (int k = 0; k < 4; ++k)
+        rows[k] = members[m + MIN(k, count - 1)];
+      float dots[4];
+      templates.dot4(query, rows, dots);
+      for (int k = 0; k < count; ++k)
+      {
+        const int j = members[m + k];
+        float ncc = (dots[k] + 1) / 2;
+        if (weighted && j > half)
+          ncc *= 1.0 - 0.05 * (j - half) / (double)nTemplates;
+        best = MAX(best, ncc);
+      }
+    }
+  }
+  return best;
+}
+
 double NNClassifier::crossCorr(const float* patchA, const float* patchB, float denom) const
 {
   double sumDiff = 0;
@@ -424,17 +1460,18 @@ void NNClassifier::saveToStream(std::ofstream & outputStream) const
   // negative patches
   int nNeg = ivNegPatches.size();
   outputStream.write((char*)&nNeg, sizeof(int));
-  for(std::vector<NNPatch>::const_iterator it = ivNegPatches.begin(); it != ivNegPatches.end(); ++it)
-    it->saveToStream(outputStream);
+  // (patches stored as NN_STORE_INT8 are saved with their reconstructed pixels)
+  for(int i = 0; i < nNeg; ++i)
+    getPatch(-1, i).saveToStream(outputStream);
   // positive patches
   int nObs = ivPosPatches.size();
   outputStream.write((char*)&nObs, sizeof(int));
-  for(std::vector<std::vector<NNPatch> >::const_iterator oit = ivPosPatches.begin(); oit != ivPosPatches.end(); ++oit)
+  for(int o = 0; o < nObs; ++o)
   {
-    int nPos = oit->size();
+    int nPos = ivPosPatches[o].size();
     outputStream.write((char*)&nPos, sizeof(int));
-    for(std::vector<NNPatch>::const_iterator it = oit->begin(); it != oit->end(); ++it)
-      it->saveToStream(outputStream);
+    for(int i = 0; i < nPos; ++i)
+      getPatch(o, i).saveToStream(outputStream);
   }
 }
 
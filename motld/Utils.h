@@ -27,6 +27,10 @@
 #include <sys/time.h>
 #endif
 
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
 /*****************************************************************************
  *                                 General Stuff                             *
  *****************************************************************************/
@@ -43,6 +47,40 @@ inline float randFloat(float min, float max)
   return min + ((float)rand() / RAND_MAX)*(max-min);
 }
 
+/// seedable pseudo random number generator (xorshift64*) producing the same sequence on every
+/// platform; each instance has its own state, so it does not interfere with rand() or other instances
+class RandomGenerator
+{
+public:
+  /// creates a generator with the given seed
+  explicit RandomGenerator(const unsigned int seed = 1) { setSeed(seed); }
+  /// restarts the sequence for the given seed
+  void setSeed(const unsigned int seed)
+  {
+    ivState = (seed + 1ULL) * 0x9E3779B97F4A7C15ULL;
+    next();
+  }
+  /// returns the next 32 bit random number
+  unsigned int next()
+  {
+    ivState ^= ivState >> 12;
+    ivState ^= ivState << 25;
+    ivState ^= ivState >> 27;
+    return (unsigned int)((ivState * 0x2545F4914F6CDD1DULL) >> 32);
+  }
+  /// returns random integer n with min <= n <= max
+  int randInt(int min, int max) { return min + (int)(next() % (unsigned int)(1 + max - min)); }
+  /// returns random float x with min <= x <= max
+  float randFloat(float min, float max) { return min + (next() >> 8) * (1.f / 16777215) * (max-min); }
+  /// returns the internal state (e.g. to save it, see setState())
+  unsigned long long getState() const { return ivState; }
+  /// continues the sequence from a state returned by getState()
+  void setState(const unsigned long long state) { ivState = state; }
+
+private:
+  unsigned long long ivState;
+};
+
 /// returns time value in milliseconds
 inline int getTime()
 {
@@ -56,6 +94,58 @@ inline int getTime()
   #endif
 }
 
+/// returns time value in microseconds (used for fine grained performance counters)
+inline long long getTimeMicro()
+{
+  #ifdef _MSC_VER
+  clock_t t = clock();
+  return (long long)t * 1000000 / CLOCKS_PER_SEC;
+  #else
+  timeval t;
+  gettimeofday(&t, 0);
+  return (long long)t.tv_sec*1000000 + t.tv_usec;
+  #endif
+}
+
+/// returns the number of the calling thread within the current OpenMP team (0 without OpenMP)
+inline int getThreadNum()
+{
+  #ifdef _OPENMP
+  return omp_get_thread_num();
+  #else
+  return 0;
+  #endif
+}
+
+/// returns the number of threads in the current OpenMP team (1 without OpenMP)
+inline int getNumThreads()
+{
+  #ifdef _OPENMP
+  return omp_get_num_threads();
+  #else
+  return 1;
+  #endif
+}
+
+/// allocates an (uninitialized) array of n plain data elements aligned to a cache line (64 bytes)
+template <class T>
+T* alignedNew(const int n)
+{
+  char * raw = new char[n * sizeof(T) + 64 + sizeof(char*)];
+  char * aligned = raw + sizeof(char*);
+  aligned += (64 - ((size_t)aligned & 63)) & 63;
+  ((char**)aligned)[-1] = raw;
+  return (T*)aligned;
+}
+
+/// frees an array that was allocated by alignedNew()
+template <class T>
+void alignedDelete(T * ptr)
+{
+  if (ptr != NULL)
+    delete[] ((char**)ptr)[-1];
+}
+
 /*****************************************************************************
  *                   File Input / Output - PGM and PPM                       *
  *****************************************************************************/